@@ -0,0 +1,162 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include <Eigen/Dense>
+
+#include <visnav/camera_models.h>
+
+namespace visnav {
+
+/// Camera decorator that answers unproject from a table of the bearing vectors
+/// of the wrapped camera at every pixel, interpolated bilinearly and
+/// normalized, instead of evaluating the (possibly iterative) unprojection of
+/// the model. Everything else is forwarded to the wrapped camera, including
+/// the parameters, so optimizing the intrinsics through data() still works; as
+/// long as they differ from the ones the table was built for, unproject falls
+/// back to the wrapped camera until update() rebuilds the table.
+template <typename Scalar = double>
+class BearingLutCamera : public AbstractCamera<Scalar> {
+ public:
+  typedef AbstractCamera<Scalar> Base;
+  typedef typename Base::Vec2 Vec2;
+  typedef typename Base::Vec3 Vec3;
+  typedef typename Base::VecN VecN;
+  typedef typename Base::Mat23 Mat23;
+  typedef typename Base::Mat2N Mat2N;
+  typedef typename Base::Vec2Batch Vec2Batch;
+  typedef typename Base::Vec3Batch Vec3Batch;
+  typedef typename Base::Mat23Batch Mat23Batch;
+  typedef typename Base::Mat2NBatch Mat2NBatch;
+
+  /// Wrap cam and build the table for its image size, which has to be set.
+  explicit BearingLutCamera(std::shared_ptr<Base> cam) : cam_(std::move(cam)) {
+    this->width() = cam_->width();
+    this->height() = cam_->height();
+    update();
+  }
+
+  /// Rebuild the table if the intrinsics changed since it was built. Returns
+  /// true if it was rebuilt. Must not run concurrently with unproject.
+  bool update() {
+    if (!lut_.empty() && cam_->getParam() == lut_param_) return false;
+
+    const int w = this->width();
+    const int h = this->height();
+    lut_.resize(size_t(w) * h);
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, h), [&](const auto& range) {
+      for (int y = range.begin(); y != range.end(); y++) {
+        for (int x = 0; x < w; x++) {
+          lut_[size_t(y) * w + x] =
+              cam_->unproject(Vec2(x, y)).template cast<float>();
+        }
+      }
+    });
+
+    lut_param_ = cam_->getParam();
+    return true;
+  }
+
+  const std::shared_ptr<Base>& camera() const { return cam_; }
+
+  Scalar* data() override { return cam_->data(); }
+  const Scalar* data() const override { return cam_->data(); }
+
+  std::string name() const override { return cam_->name(); }
+  const VecN& getParam() const override { return cam_->getParam(); }
+
+  Vec2 project(const Vec3& p) const override { return cam_->project(p); }
+
+  Vec2 project(const Vec3& p, Mat23* d_proj_d_p3d,
+               Mat2N* d_proj_d_param) const override {
+    return cam_->project(p, d_proj_d_p3d, d_proj_d_param);
+  }
+
+  void projectBatch(const Eigen::Ref<const Vec3Batch>& p,
+                    Eigen::Ref<Vec2Batch> res) const override {
+    cam_->projectBatch(p, res);
+  }
+
+  void projectBatch(const Eigen::Ref<const Vec3Batch>& p,
+                    Eigen::Ref<Vec2Batch> res, Mat23Batch* d_proj_d_p3d,
+                    Mat2NBatch* d_proj_d_param) const override {
+    cam_->projectBatch(p, res, d_proj_d_p3d, d_proj_d_param);
+  }
+
+  Vec3 unproject(const Vec2& p) const override {
+    const int w = this->width();
+    const int h = this->height();
+
+    // written such that NaN coordinates also take the fallback
+    if (!(p[0] >= 0 && p[1] >= 0 && p[0] < w - 1 && p[1] < h - 1) ||
+        cam_->getParam() != lut_param_) {
+      return cam_->unproject(p);
+    }
+
+    const int x = int(p[0]);
+    const int y = int(p[1]);
+    const float dx = float(p[0] - x);
+    const float dy = float(p[1] - y);
+
+    const Eigen::Vector3f* row0 = &lut_[size_t(y) * w + x];
+    const Eigen::Vector3f* row1 = row0 + w;
+    const Eigen::Vector3f bearing =
+        (1 - dy) * ((1 - dx) * row0[0] + dx * row0[1]) +
+        dy * ((1 - dx) * row1[0] + dx * row1[1]);
+
+    // pixels next to the border of the valid region of the model have
+    // undefined table entries
+    if (!bearing.allFinite()) return cam_->unproject(p);
+
+    return bearing.template cast<Scalar>().normalized();
+  }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+ private:
+  std::shared_ptr<Base> cam_;
+
+  // bearing of pixel (x, y) at index y * width + x
+  std::vector<Eigen::Vector3f> lut_;
+  VecN lut_param_ = VecN::Zero();
+};
+
+}  // namespace visnav
@@ -40,6 +40,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cereal/archives/binary.hpp>
 
 #include <visnav/common_types.h>
+#include <visnav/serialization.h>
 
 namespace cereal {
 class access;
@@ -50,7 +51,7 @@ namespace visnav {
 class BowVocabulary {
  public:
   using NodeId = unsigned int;
-  using TDescriptor = std::bitset<256>;
+  using TDescriptor = Descriptor;
 
   BowVocabulary(const std::string& filename) { load(filename); }
 
@@ -77,7 +78,8 @@ class BowVocabulary {
         // traverse all node's children 
       for (int child_id : m_nodes[current_node_id].children) {
         //calculate the distance between descriptors
-        double distance = (feature ^ m_nodes[child_id].descriptor).count();
+        double distance =
+            hammingDistance(feature, m_nodes[child_id].descriptor);
         
         
         if (distance < min_distance) {
@@ -94,7 +96,10 @@ class BowVocabulary {
       weight = m_nodes[current_node_id].weight;
   }
 
-  inline void transform(const std::vector<TDescriptor>& features,
+  /// features can be TDescriptor or anything convertible to it (e.g.
+  /// std::bitset<256>)
+  template <class TFeature>
+  inline void transform(const std::vector<TFeature>& features,
                         BowVector& v) const {
     v.clear();
 
@@ -33,6 +33,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #pragma once
 
 #include <memory>
+#include <type_traits>
+#include <vector>
 
 #include <Eigen/Dense>
 #include <sophus/se3.hpp>
@@ -54,6 +56,14 @@ class PinholeCamera : public AbstractCamera<Scalar> {
 
   typedef Eigen::Matrix<Scalar, N, 1> VecN;
 
+  typedef Eigen::Matrix<Scalar, 2, 3> Mat23;
+  typedef Eigen::Matrix<Scalar, 2, N> Mat2N;
+
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 2> Vec2Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 3> Vec3Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 6> Mat23Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 2 * N> Mat2NBatch;
+
   PinholeCamera() = default;
   PinholeCamera(const VecN& p) : param(p) {}
 
@@ -97,6 +107,74 @@ class PinholeCamera : public AbstractCamera<Scalar> {
     return res;
   }
 
+  /// Project p and compute the Jacobians of the projection with respect to p
+  /// and to the parameter vector in the same pass; either Jacobian may be
+  /// nullptr.
+  virtual Vec2 project(const Vec3& p, Mat23* d_proj_d_p3d,
+                       Mat2N* d_proj_d_param) const {
+    const Scalar& fx = param[0];
+    const Scalar& fy = param[1];
+    const Scalar& cx = param[2];
+    const Scalar& cy = param[3];
+
+    const Scalar& x = p[0];
+    const Scalar& y = p[1];
+    const Scalar& z = p[2];
+
+    const Scalar z_inv = Scalar(1) / z;
+    const Scalar mx = x * z_inv;
+    const Scalar my = y * z_inv;
+
+    Vec2 res;
+    res(0) = fx * mx + cx;
+    res(1) = fy * my + cy;
+
+    if (d_proj_d_p3d) {
+      d_proj_d_p3d->setZero();
+      (*d_proj_d_p3d)(0, 0) = fx * z_inv;
+      (*d_proj_d_p3d)(0, 2) = -fx * mx * z_inv;
+      (*d_proj_d_p3d)(1, 1) = fy * z_inv;
+      (*d_proj_d_p3d)(1, 2) = -fy * my * z_inv;
+    }
+
+    if (d_proj_d_param) {
+      d_proj_d_param->setZero();
+      (*d_proj_d_param)(0, 0) = mx;
+      (*d_proj_d_param)(0, 2) = Scalar(1);
+      (*d_proj_d_param)(1, 1) = my;
+      (*d_proj_d_param)(1, 3) = Scalar(1);
+    }
+
+    return res;
+  }
+
+  virtual void projectBatch(const Eigen::Ref<const Vec3Batch>& p,
+                            Eigen::Ref<Vec2Batch> res) const {
+    if constexpr (std::is_floating_point_v<Scalar>) {
+      const Scalar& fx = param[0];
+      const Scalar& fy = param[1];
+      const Scalar& cx = param[2];
+      const Scalar& cy = param[3];
+
+      const auto x = p.col(0).array();
+      const auto y = p.col(1).array();
+      const auto z = p.col(2).array();
+
+      res.col(0).array() = fx * (x / z) + cx;
+      res.col(1).array() = fy * (y / z) + cy;
+    } else {
+      this->projectBatchPointwise(p, res);
+    }
+  }
+
+  virtual void projectBatch(const Eigen::Ref<const Vec3Batch>& p,
+                            Eigen::Ref<Vec2Batch> res,
+                            Mat23Batch* d_proj_d_p3d,
+                            Mat2NBatch* d_proj_d_param) const {
+    this->projectBatchWithJacobians(*this, p, res, d_proj_d_p3d,
+                                    d_proj_d_param);
+  }
+
   virtual Vec3 unproject(const Vec2& p) const {
     const Scalar& fx = param[0];
     const Scalar& fy = param[1];
@@ -145,6 +223,14 @@ class ExtendedUnifiedCamera : public AbstractCamera<Scalar> {
 
   typedef Eigen::Matrix<Scalar, N, 1> VecN;
 
+  typedef Eigen::Matrix<Scalar, 2, 3> Mat23;
+  typedef Eigen::Matrix<Scalar, 2, N> Mat2N;
+
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 2> Vec2Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 3> Vec3Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 6> Mat23Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 2 * N> Mat2NBatch;
+
   ExtendedUnifiedCamera() = default;
   ExtendedUnifiedCamera(const VecN& p) : param(p) {}
 
@@ -194,6 +280,97 @@ class ExtendedUnifiedCamera : public AbstractCamera<Scalar> {
     return res;
   }
 
+  /// Project p and compute the Jacobians of the projection with respect to p
+  /// and to the parameter vector in the same pass; either Jacobian may be
+  /// nullptr.
+  virtual Vec2 project(const Vec3& p, Mat23* d_proj_d_p3d,
+                       Mat2N* d_proj_d_param) const {
+    const Scalar& fx = param[0];
+    const Scalar& fy = param[1];
+    const Scalar& cx = param[2];
+    const Scalar& cy = param[3];
+    const Scalar& alpha = param[4];
+    const Scalar& beta = param[5];
+
+    const Scalar& x = p[0];
+    const Scalar& y = p[1];
+    const Scalar& z = p[2];
+
+    const Scalar one = Scalar(1);
+    const Scalar r2 = x * x + y * y;
+    const Scalar d = ceres::sqrt(beta * r2 + z * z);
+    const Scalar denom_inv = one / (alpha * d + (one - alpha) * z);
+    const Scalar mx = x * denom_inv;
+    const Scalar my = y * denom_inv;
+
+    Vec2 res;
+    res(0) = fx * mx + cx;
+    res(1) = fy * my + cy;
+
+    // both coordinates are x / denom (resp. y / denom), so only the
+    // derivatives of the denominator are model specific
+    if (d_proj_d_p3d) {
+      const Scalar d_inv = one / d;
+      Vec3 d_denom_d_p3d;
+      d_denom_d_p3d << alpha * beta * x * d_inv, alpha * beta * y * d_inv,
+          alpha * z * d_inv + (one - alpha);
+
+      d_proj_d_p3d->row(0) = (-fx * mx * denom_inv) * d_denom_d_p3d;
+      d_proj_d_p3d->row(1) = (-fy * my * denom_inv) * d_denom_d_p3d;
+      (*d_proj_d_p3d)(0, 0) += fx * denom_inv;
+      (*d_proj_d_p3d)(1, 1) += fy * denom_inv;
+    }
+
+    if (d_proj_d_param) {
+      const Scalar d_denom_d_alpha = d - z;
+      const Scalar d_denom_d_beta = alpha * r2 / (Scalar(2) * d);
+
+      d_proj_d_param->setZero();
+      (*d_proj_d_param)(0, 0) = mx;
+      (*d_proj_d_param)(0, 2) = one;
+      (*d_proj_d_param)(0, 4) = -fx * mx * denom_inv * d_denom_d_alpha;
+      (*d_proj_d_param)(0, 5) = -fx * mx * denom_inv * d_denom_d_beta;
+      (*d_proj_d_param)(1, 1) = my;
+      (*d_proj_d_param)(1, 3) = one;
+      (*d_proj_d_param)(1, 4) = -fy * my * denom_inv * d_denom_d_alpha;
+      (*d_proj_d_param)(1, 5) = -fy * my * denom_inv * d_denom_d_beta;
+    }
+
+    return res;
+  }
+
+  virtual void projectBatch(const Eigen::Ref<const Vec3Batch>& p,
+                            Eigen::Ref<Vec2Batch> res) const {
+    if constexpr (std::is_floating_point_v<Scalar>) {
+      const Scalar& fx = param[0];
+      const Scalar& fy = param[1];
+      const Scalar& cx = param[2];
+      const Scalar& cy = param[3];
+      const Scalar& alpha = param[4];
+      const Scalar& beta = param[5];
+
+      const auto x = p.col(0).array();
+      const auto y = p.col(1).array();
+      const auto z = p.col(2).array();
+
+      const Eigen::Array<Scalar, Eigen::Dynamic, 1> denom =
+          alpha * (beta * (x * x + y * y) + z * z).sqrt() + (1 - alpha) * z;
+
+      res.col(0).array() = fx * (x / denom) + cx;
+      res.col(1).array() = fy * (y / denom) + cy;
+    } else {
+      this->projectBatchPointwise(p, res);
+    }
+  }
+
+  virtual void projectBatch(const Eigen::Ref<const Vec3Batch>& p,
+                            Eigen::Ref<Vec2Batch> res,
+                            Mat23Batch* d_proj_d_p3d,
+                            Mat2NBatch* d_proj_d_param) const {
+    this->projectBatchWithJacobians(*this, p, res, d_proj_d_p3d,
+                                    d_proj_d_param);
+  }
+
   virtual Vec3 unproject(const Vec2& p) const {
     const Scalar& fx = param[0];
     const Scalar& fy = param[1];
@@ -245,6 +422,14 @@ class DoubleSphereCamera : public AbstractCamera<Scalar> {
 
   typedef Eigen::Matrix<Scalar, N, 1> VecN;
 
+  typedef Eigen::Matrix<Scalar, 2, 3> Mat23;
+  typedef Eigen::Matrix<Scalar, 2, N> Mat2N;
+
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 2> Vec2Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 3> Vec3Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 6> Mat23Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 2 * N> Mat2NBatch;
+
   DoubleSphereCamera() = default;
   DoubleSphereCamera(const VecN& p) : param(p) {}
 
@@ -296,6 +481,105 @@ class DoubleSphereCamera : public AbstractCamera<Scalar> {
     return res;
   }
 
+  /// Project p and compute the Jacobians of the projection with respect to p
+  /// and to the parameter vector in the same pass; either Jacobian may be
+  /// nullptr.
+  virtual Vec2 project(const Vec3& p, Mat23* d_proj_d_p3d,
+                       Mat2N* d_proj_d_param) const {
+    const Scalar& fx = param[0];
+    const Scalar& fy = param[1];
+    const Scalar& cx = param[2];
+    const Scalar& cy = param[3];
+    const Scalar& xi = param[4];
+    const Scalar& alpha = param[5];
+
+    const Scalar& x = p[0];
+    const Scalar& y = p[1];
+    const Scalar& z = p[2];
+
+    const Scalar one = Scalar(1);
+    const Scalar r2 = x * x + y * y;
+    const Scalar d1 = ceres::sqrt(r2 + z * z);
+    const Scalar k = xi * d1 + z;
+    const Scalar d2 = ceres::sqrt(r2 + k * k);
+    const Scalar denom_inv = one / (alpha * d2 + (one - alpha) * k);
+    const Scalar mx = x * denom_inv;
+    const Scalar my = y * denom_inv;
+
+    Vec2 res;
+    res(0) = fx * mx + cx;
+    res(1) = fy * my + cy;
+
+    if (d_proj_d_p3d) {
+      const Scalar d1_inv = one / d1;
+      const Scalar d2_inv = one / d2;
+
+      Vec3 d_k_d_p3d;
+      d_k_d_p3d << xi * x * d1_inv, xi * y * d1_inv, xi * z * d1_inv + one;
+
+      Vec3 d_denom_d_p3d;
+      d_denom_d_p3d << alpha * d2_inv * x, alpha * d2_inv * y, Scalar(0);
+      d_denom_d_p3d += (alpha * k * d2_inv + (one - alpha)) * d_k_d_p3d;
+
+      d_proj_d_p3d->row(0) = (-fx * mx * denom_inv) * d_denom_d_p3d;
+      d_proj_d_p3d->row(1) = (-fy * my * denom_inv) * d_denom_d_p3d;
+      (*d_proj_d_p3d)(0, 0) += fx * denom_inv;
+      (*d_proj_d_p3d)(1, 1) += fy * denom_inv;
+    }
+
+    if (d_proj_d_param) {
+      const Scalar d_denom_d_xi = (alpha * k / d2 + (one - alpha)) * d1;
+      const Scalar d_denom_d_alpha = d2 - k;
+
+      d_proj_d_param->setZero();
+      (*d_proj_d_param)(0, 0) = mx;
+      (*d_proj_d_param)(0, 2) = one;
+      (*d_proj_d_param)(0, 4) = -fx * mx * denom_inv * d_denom_d_xi;
+      (*d_proj_d_param)(0, 5) = -fx * mx * denom_inv * d_denom_d_alpha;
+      (*d_proj_d_param)(1, 1) = my;
+      (*d_proj_d_param)(1, 3) = one;
+      (*d_proj_d_param)(1, 4) = -fy * my * denom_inv * d_denom_d_xi;
+      (*d_proj_d_param)(1, 5) = -fy * my * denom_inv * d_denom_d_alpha;
+    }
+
+    return res;
+  }
+
+  virtual void projectBatch(const Eigen::Ref<const Vec3Batch>& p,
+                            Eigen::Ref<Vec2Batch> res) const {
+    if constexpr (std::is_floating_point_v<Scalar>) {
+      const Scalar& fx = param[0];
+      const Scalar& fy = param[1];
+      const Scalar& cx = param[2];
+      const Scalar& cy = param[3];
+      const Scalar& xi = param[4];
+      const Scalar& alpha = param[5];
+
+      const auto x = p.col(0).array();
+      const auto y = p.col(1).array();
+      const auto z = p.col(2).array();
+
+      const Eigen::Array<Scalar, Eigen::Dynamic, 1> r2 = x * x + y * y;
+      const Eigen::Array<Scalar, Eigen::Dynamic, 1> k =
+          xi * (r2 + z * z).sqrt() + z;
+      const Eigen::Array<Scalar, Eigen::Dynamic, 1> denom =
+          alpha * (r2 + k * k).sqrt() + (1 - alpha) * k;
+
+      res.col(0).array() = fx * (x / denom) + cx;
+      res.col(1).array() = fy * (y / denom) + cy;
+    } else {
+      this->projectBatchPointwise(p, res);
+    }
+  }
+
+  virtual void projectBatch(const Eigen::Ref<const Vec3Batch>& p,
+                            Eigen::Ref<Vec2Batch> res,
+                            Mat23Batch* d_proj_d_p3d,
+                            Mat2NBatch* d_proj_d_param) const {
+    this->projectBatchWithJacobians(*this, p, res, d_proj_d_p3d,
+                                    d_proj_d_param);
+  }
+
   virtual Vec3 unproject(const Vec2& p) const {
     const Scalar& fx = param[0];
     const Scalar& fy = param[1];
@@ -345,6 +629,14 @@ class KannalaBrandt4Camera : public AbstractCamera<Scalar> {
 
   typedef Eigen::Matrix<Scalar, N, 1> VecN;
 
+  typedef Eigen::Matrix<Scalar, 2, 3> Mat23;
+  typedef Eigen::Matrix<Scalar, 2, N> Mat2N;
+
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 2> Vec2Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 3> Vec3Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 6> Mat23Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 2 * N> Mat2NBatch;
+
   KannalaBrandt4Camera() = default;
   KannalaBrandt4Camera(const VecN& p) : param(p) {}
 
@@ -401,13 +693,163 @@ class KannalaBrandt4Camera : public AbstractCamera<Scalar> {
     return res;
     }
     Scalar theta = ceres::atan2(r,z);
-    std::vector<Scalar> coefficients = {k4,zero,k3,zero,k2,zero,k1,zero,one,zero};
-    Scalar d_theta = Hornes(coefficients,theta);
+    // odd polynomial theta + k1 theta^3 + ... + k4 theta^9 in Horner form,
+    // without a heap allocated coefficient vector as this runs in the cost
+    // functions
+    Scalar theta2 = theta * theta;
+    Scalar d_theta =
+        theta *
+        (one + theta2 * (k1 + theta2 * (k2 + theta2 * (k3 + theta2 * k4))));
     res(0) = (fx*d_theta*x/r) +cx;
     res(1) = (fy*d_theta*y/r) +cy;
     return res;
   }
 
+  /// Project p and compute the Jacobians of the projection with respect to p
+  /// and to the parameter vector in the same pass; either Jacobian may be
+  /// nullptr.
+  virtual Vec2 project(const Vec3& p, Mat23* d_proj_d_p3d,
+                       Mat2N* d_proj_d_param) const {
+    const Scalar& fx = param[0];
+    const Scalar& fy = param[1];
+    const Scalar& cx = param[2];
+    const Scalar& cy = param[3];
+    const Scalar& k1 = param[4];
+    const Scalar& k2 = param[5];
+    const Scalar& k3 = param[6];
+    const Scalar& k4 = param[7];
+
+    const Scalar& x = p[0];
+    const Scalar& y = p[1];
+    const Scalar& z = p[2];
+
+    const Scalar zero = Scalar(0);
+    const Scalar one = Scalar(1);
+    const Scalar r2 = x * x + y * y;
+    const Scalar r = ceres::sqrt(r2);
+
+    Vec2 res;
+
+    if (r == zero) {
+      // on the optical axis the model is locally a pinhole camera
+      res(0) = cx;
+      res(1) = cy;
+      if (d_proj_d_p3d) {
+        d_proj_d_p3d->setZero();
+        (*d_proj_d_p3d)(0, 0) = fx / z;
+        (*d_proj_d_p3d)(1, 1) = fy / z;
+      }
+      if (d_proj_d_param) {
+        d_proj_d_param->setZero();
+        (*d_proj_d_param)(0, 2) = one;
+        (*d_proj_d_param)(1, 3) = one;
+      }
+      return res;
+    }
+
+    const Scalar theta = ceres::atan2(r, z);
+    const Scalar theta2 = theta * theta;
+    const Scalar d_theta =
+        theta *
+        (one + theta2 * (k1 + theta2 * (k2 + theta2 * (k3 + theta2 * k4))));
+
+    // projection is (fx * s * x + cx, fy * s * y + cy) with s = d_theta / r
+    const Scalar r_inv = one / r;
+    const Scalar s = d_theta * r_inv;
+    const Scalar mx = s * x;
+    const Scalar my = s * y;
+
+    res(0) = fx * mx + cx;
+    res(1) = fy * my + cy;
+
+    if (d_proj_d_p3d) {
+      const Scalar rho2_inv = one / (r2 + z * z);
+      const Scalar d_d_theta_d_theta =
+          one + theta2 * (Scalar(3) * k1 +
+                          theta2 * (Scalar(5) * k2 +
+                                    theta2 * (Scalar(7) * k3 +
+                                              theta2 * Scalar(9) * k4)));
+
+      // d theta / d p3d = (x z / r, y z / r, -r) / |p3d|^2
+      const Scalar c = (d_d_theta_d_theta * z * rho2_inv - s) * r_inv * r_inv;
+      Vec3 d_s_d_p3d;
+      d_s_d_p3d << c * x, c * y, -d_d_theta_d_theta * rho2_inv;
+
+      d_proj_d_p3d->row(0) = (fx * x) * d_s_d_p3d;
+      d_proj_d_p3d->row(1) = (fy * y) * d_s_d_p3d;
+      (*d_proj_d_p3d)(0, 0) += fx * s;
+      (*d_proj_d_p3d)(1, 1) += fy * s;
+    }
+
+    if (d_proj_d_param) {
+      const Scalar theta3 = theta * theta2;
+      const Scalar theta5 = theta3 * theta2;
+      const Scalar theta7 = theta5 * theta2;
+      const Scalar theta9 = theta7 * theta2;
+      const Scalar x_r = fx * x * r_inv;
+      const Scalar y_r = fy * y * r_inv;
+
+      d_proj_d_param->setZero();
+      (*d_proj_d_param)(0, 0) = mx;
+      (*d_proj_d_param)(0, 2) = one;
+      (*d_proj_d_param)(0, 4) = x_r * theta3;
+      (*d_proj_d_param)(0, 5) = x_r * theta5;
+      (*d_proj_d_param)(0, 6) = x_r * theta7;
+      (*d_proj_d_param)(0, 7) = x_r * theta9;
+      (*d_proj_d_param)(1, 1) = my;
+      (*d_proj_d_param)(1, 3) = one;
+      (*d_proj_d_param)(1, 4) = y_r * theta3;
+      (*d_proj_d_param)(1, 5) = y_r * theta5;
+      (*d_proj_d_param)(1, 6) = y_r * theta7;
+      (*d_proj_d_param)(1, 7) = y_r * theta9;
+    }
+
+    return res;
+  }
+
+  virtual void projectBatch(const Eigen::Ref<const Vec3Batch>& p,
+                            Eigen::Ref<Vec2Batch> res) const {
+    if constexpr (std::is_floating_point_v<Scalar>) {
+      const Scalar& fx = param[0];
+      const Scalar& fy = param[1];
+      const Scalar& cx = param[2];
+      const Scalar& cy = param[3];
+      const Scalar& k1 = param[4];
+      const Scalar& k2 = param[5];
+      const Scalar& k3 = param[6];
+      const Scalar& k4 = param[7];
+
+      const auto x = p.col(0).array();
+      const auto y = p.col(1).array();
+      const auto z = p.col(2).array();
+
+      typedef Eigen::Array<Scalar, Eigen::Dynamic, 1> ArrayX;
+      const ArrayX r = (x * x + y * y).sqrt();
+      const ArrayX theta = r.binaryExpr(
+          z, [](Scalar a, Scalar b) { return std::atan2(a, b); });
+      const ArrayX theta2 = theta * theta;
+      const ArrayX d_theta =
+          theta *
+          (1 + theta2 * (k1 + theta2 * (k2 + theta2 * (k3 + theta2 * k4))));
+
+      // points on the optical axis project to the principal point
+      const ArrayX scale = (r == 0).select(ArrayX::Zero(r.size()), d_theta / r);
+
+      res.col(0).array() = fx * scale * x + cx;
+      res.col(1).array() = fy * scale * y + cy;
+    } else {
+      this->projectBatchPointwise(p, res);
+    }
+  }
+
+
+  virtual void projectBatch(const Eigen::Ref<const Vec3Batch>& p,
+                            Eigen::Ref<Vec2Batch> res,
+                            Mat23Batch* d_proj_d_p3d,
+                            Mat2NBatch* d_proj_d_param) const {
+    this->projectBatchWithJacobians(*this, p, res, d_proj_d_p3d,
+                                    d_proj_d_param);
+  }
 
   virtual Vec3 unproject(const Vec2& p) const {
     const Scalar& fx = param[0];
@@ -467,7 +909,6 @@ class KannalaBrandt4Camera : public AbstractCamera<Scalar> {
     for (size_t i = 0; i < 10; i++) {
     Scalar f = Hornes(v, root) - x;
     Scalar f_d = Hornes(v_d, root);
-    std::cout<<f_d<<std::endl;
     if (abs(f_d) < 1e-8) {
         break;
     }
@@ -498,6 +939,14 @@ class AbstractCamera {
 
   typedef Eigen::Matrix<Scalar, N, 1> VecN;
 
+  typedef Eigen::Matrix<Scalar, 2, 3> Mat23;
+  typedef Eigen::Matrix<Scalar, 2, N> Mat2N;
+
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 2> Vec2Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 3> Vec3Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 6> Mat23Batch;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 2 * N> Mat2NBatch;
+
   virtual ~AbstractCamera() = default;
 
   virtual Scalar* data() = 0;
@@ -508,6 +957,80 @@ class AbstractCamera {
 
   virtual Vec3 unproject(const Vec2& p) const = 0;
 
+  /// Project p and compute the Jacobians of the projection with respect to p
+  /// and to the parameter vector in the same pass, sharing the intermediate
+  /// terms; either Jacobian may be nullptr.
+  virtual Vec2 project(const Vec3& p, Mat23* d_proj_d_p3d,
+                       Mat2N* d_proj_d_param) const = 0;
+
+  /// Project a batch of points given in camera coordinates, one point per row.
+  /// The batch is stored column major, i.e. as a structure of arrays, so models
+  /// can project whole columns with vectorized array expressions.
+  virtual void projectBatch(const Eigen::Ref<const Vec3Batch>& p,
+                            Eigen::Ref<Vec2Batch> res) const = 0;
+
+  /// projectBatch that also computes the Jacobians of every projection. Row i
+  /// of d_proj_d_p3d holds the 2x3 Jacobian of point i and row i of
+  /// d_proj_d_param its 2xN Jacobian, each stored row after row; both are
+  /// resized to the number of points and may be nullptr.
+  virtual void projectBatch(const Eigen::Ref<const Vec3Batch>& p,
+                            Eigen::Ref<Vec2Batch> res,
+                            Mat23Batch* d_proj_d_p3d,
+                            Mat2NBatch* d_proj_d_param) const = 0;
+
+  /// Transform the world points p_w (one per row) into the camera with pose
+  /// T_w_c and project them in one batch. Points with depth below z_threshold
+  /// and, if cull_outside_image is set, points projecting outside the image are
+  /// dropped. For the kept points the row in p_w is written to indices and the
+  /// camera coordinates and projections to the same rows of p_c and proj.
+  /// Returns the number of kept points. p_c and proj are only ever grown, so
+  /// they can be reused across calls.
+  size_t projectWorldBatch(const Sophus::SE3<Scalar>& T_w_c,
+                           const Eigen::Ref<const Vec3Batch>& p_w,
+                           const Scalar z_threshold,
+                           const bool cull_outside_image, Vec3Batch& p_c,
+                           Vec2Batch& proj, std::vector<int>& indices) const {
+    const Eigen::Index n = p_w.rows();
+    if (p_c.rows() < n) p_c.resize(n, 3);
+    if (proj.rows() < n) proj.resize(n, 2);
+    indices.clear();
+
+    const Sophus::SE3<Scalar> T_c_w = T_w_c.inverse();
+    const Eigen::Matrix<Scalar, 3, 3> R_c_w = T_c_w.rotationMatrix();
+    p_c.topRows(n).noalias() = p_w * R_c_w.transpose();
+    p_c.topRows(n).rowwise() += T_c_w.translation().transpose();
+
+    // compact the points in front of the camera before projecting them
+    Eigen::Index num_front = 0;
+    for (Eigen::Index i = 0; i < n; i++) {
+      if (p_c(i, 2) >= z_threshold) {
+        if (num_front != i) p_c.row(num_front) = p_c.row(i);
+        indices.push_back(i);
+        num_front++;
+      }
+    }
+
+    projectBatch(p_c.topRows(num_front), proj.topRows(num_front));
+
+    if (!cull_outside_image) return num_front;
+
+    size_t num_inside = 0;
+    for (Eigen::Index i = 0; i < num_front; i++) {
+      if (proj(i, 0) >= 0 && proj(i, 0) < width_ && proj(i, 1) >= 0 &&
+          proj(i, 1) < height_) {
+        if (Eigen::Index(num_inside) != i) {
+          p_c.row(num_inside) = p_c.row(i);
+          proj.row(num_inside) = proj.row(i);
+          indices[num_inside] = indices[i];
+        }
+        num_inside++;
+      }
+    }
+    indices.resize(num_inside);
+
+    return num_inside;
+  }
+
   virtual std::string name() const = 0;
 
   virtual const VecN& getParam() const = 0;
@@ -585,6 +1108,45 @@ class AbstractCamera {
     }
   }
 
+ protected:
+  /// projectBatch for scalar types without vectorized array math (e.g. ceres
+  /// jets): project point by point
+  void projectBatchPointwise(const Eigen::Ref<const Vec3Batch>& p,
+                             Eigen::Ref<Vec2Batch> res) const {
+    for (Eigen::Index i = 0; i < p.rows(); i++) {
+      res.row(i) = project(p.row(i).transpose()).transpose();
+    }
+  }
+
+  /// Batch projection with Jacobians for the camera model Camera, calling its
+  /// fused per-point project without virtual dispatch.
+  template <class Camera>
+  static void projectBatchWithJacobians(const Camera& cam,
+                                        const Eigen::Ref<const Vec3Batch>& p,
+                                        Eigen::Ref<Vec2Batch> res,
+                                        Mat23Batch* d_proj_d_p3d,
+                                        Mat2NBatch* d_proj_d_param) {
+    if (d_proj_d_p3d) d_proj_d_p3d->resize(p.rows(), 6);
+    if (d_proj_d_param) d_proj_d_param->resize(p.rows(), 2 * N);
+
+    Mat23 d_p3d;
+    Mat2N d_param;
+    for (Eigen::Index i = 0; i < p.rows(); i++) {
+      res.row(i) = cam.Camera::project(p.row(i).transpose(),
+                                       d_proj_d_p3d ? &d_p3d : nullptr,
+                                       d_proj_d_param ? &d_param : nullptr)
+                       .transpose();
+      if (d_proj_d_p3d) {
+        d_proj_d_p3d->row(i).template head<3>() = d_p3d.row(0);
+        d_proj_d_p3d->row(i).template tail<3>() = d_p3d.row(1);
+      }
+      if (d_proj_d_param) {
+        d_proj_d_param->row(i).template head<N>() = d_param.row(0);
+        d_proj_d_param->row(i).template tail<N>() = d_param.row(1);
+      }
+    }
+  }
+
  private:
   // image dimensions
   int width_ = 0;
@@ -32,10 +32,19 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <bitset>
 #include <cstdint>
+#include <deque>
+#include <iterator>
+#include <limits>
 #include <map>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <tbb/concurrent_unordered_map.h>
@@ -45,6 +54,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <Eigen/StdVector>
 #include <sophus/se3.hpp>
 
+#include <visnav/flat_containers.h>
 #include <visnav/hash.h>
 
 #define UNUSED(x) (void)(x)
@@ -110,6 +120,67 @@ using FeatureId = int;
 /// tracks;
 using TrackId = int64_t;
 
+/// 256 bit binary feature descriptor. The bits are packed into four 64 bit
+/// words (bit n is bit n % 64 of words[n / 64]), so comparing two descriptors
+/// is four XORs and POPCNTs on a single 32 byte aligned block.
+struct alignas(32) Descriptor {
+  uint64_t words[4] = {0, 0, 0, 0};
+
+  Descriptor() = default;
+
+  Descriptor(const std::bitset<256>& bits) {
+    for (size_t n = 0; n < 256; n++) set(n, bits[n]);
+  }
+
+  operator std::bitset<256>() const {
+    std::bitset<256> bits;
+    for (int w = 3; w >= 0; w--) {
+      bits <<= 64;
+      bits |= std::bitset<256>(words[w]);
+    }
+    return bits;
+  }
+
+  bool test(size_t n) const { return (words[n / 64] >> (n % 64)) & 1; }
+
+  bool operator[](size_t n) const { return test(n); }
+
+  void set(size_t n, bool value = true) {
+    const uint64_t mask = uint64_t(1) << (n % 64);
+    words[n / 64] = value ? (words[n / 64] | mask) : (words[n / 64] & ~mask);
+  }
+
+  void reset() { words[0] = words[1] = words[2] = words[3] = 0; }
+
+  int count() const {
+    return __builtin_popcountll(words[0]) + __builtin_popcountll(words[1]) +
+           __builtin_popcountll(words[2]) + __builtin_popcountll(words[3]);
+  }
+
+  bool any() const { return (words[0] | words[1] | words[2] | words[3]) != 0; }
+
+  Descriptor operator^(const Descriptor& other) const {
+    Descriptor res;
+    for (int w = 0; w < 4; w++) res.words[w] = words[w] ^ other.words[w];
+    return res;
+  }
+
+  bool operator==(const Descriptor& other) const {
+    return words[0] == other.words[0] && words[1] == other.words[1] &&
+           words[2] == other.words[2] && words[3] == other.words[3];
+  }
+
+  bool operator!=(const Descriptor& other) const { return !(*this == other); }
+};
+
+/// number of differing bits of two descriptors
+inline int hammingDistance(const Descriptor& a, const Descriptor& b) {
+  return __builtin_popcountll(a.words[0] ^ b.words[0]) +
+         __builtin_popcountll(a.words[1] ^ b.words[1]) +
+         __builtin_popcountll(a.words[2] ^ b.words[2]) +
+         __builtin_popcountll(a.words[3] ^ b.words[3]);
+}
+
 /// keypoint positions and descriptors for an image
 struct KeypointsData {
   /// collection of 2d corner points (indexed by FeatureId)
@@ -120,11 +191,238 @@ struct KeypointsData {
   std::vector<double> corner_angles;
   /// collection of feature descriptors with same index as `corners` (indexed by
   /// FeatureId)
-  std::vector<std::bitset<256>> corner_descriptors;
+  std::vector<Descriptor> corner_descriptors;
+};
+
+/// Keypoints of the images of a sequence, stored by frame: a deque with one
+/// entry per frame between the oldest and the newest stored frame, each with a
+/// slot per camera. It has the map interface {imageId => KeypointsData} and
+/// iterates in order of the images. References to the keypoints stay valid
+/// until the image is erased. Not safe for concurrent modification.
+///
+/// Besides erasing whole images, compact drops the descriptors of an image
+/// but keeps the corners and angles (e.g. for display), so a caller can bound
+/// the memory of long sequences by what it still needs. Frames that are empty
+/// at either end of the deque are released.
+class FeatureStore {
+ public:
+  /// maximal number of cameras per frame
+  static constexpr size_t MAX_CAMS = 2;
+
+  using key_type = FrameCamId;
+  using mapped_type = KeypointsData;
+  using value_type = std::pair<const FrameCamId, KeypointsData>;
+
+ private:
+  using Frame = std::array<std::unique_ptr<value_type>, MAX_CAMS>;
+
+ public:
+  template <bool Const>
+  class Iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = FeatureStore::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = std::conditional_t<Const, const value_type*, value_type*>;
+    using reference = std::conditional_t<Const, const value_type&, value_type&>;
+
+    Iterator() = default;
+
+    template <bool C = Const, class = std::enable_if_t<C>>
+    Iterator(const Iterator<false>& other)
+        : frames_(other.frames_), pos_(other.pos_) {}
+
+    reference operator*() const {
+      return *(*frames_)[pos_ / MAX_CAMS][pos_ % MAX_CAMS];
+    }
+    pointer operator->() const { return &**this; }
+
+    Iterator& operator++() {
+      pos_++;
+      skipEmpty();
+      return *this;
+    }
+
+    Iterator operator++(int) {
+      Iterator it = *this;
+      ++*this;
+      return it;
+    }
+
+    bool operator==(const Iterator& other) const { return pos_ == other.pos_; }
+    bool operator!=(const Iterator& other) const { return pos_ != other.pos_; }
+
+   private:
+    friend class FeatureStore;
+    friend class Iterator<!Const>;
+
+    using Frames =
+        std::conditional_t<Const, const std::deque<Frame>, std::deque<Frame>>;
+
+    Iterator(Frames* frames, size_t pos) : frames_(frames), pos_(pos) {
+      skipEmpty();
+    }
+
+    void skipEmpty() {
+      const size_t end = frames_->size() * MAX_CAMS;
+      while (pos_ < end && !(*frames_)[pos_ / MAX_CAMS][pos_ % MAX_CAMS]) {
+        pos_++;
+      }
+    }
+
+    Frames* frames_ = nullptr;
+    size_t pos_ = 0;
+  };
+
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  FeatureStore() = default;
+
+  FeatureStore(const FeatureStore& other) { *this = other; }
+  FeatureStore(FeatureStore&& other) { *this = std::move(other); }
+
+  FeatureStore& operator=(const FeatureStore& other) {
+    if (this == &other) return *this;
+    clear();
+    for (const auto& kv : other) (*this)[kv.first] = kv.second;
+    return *this;
+  }
+
+  /// leaves other empty
+  FeatureStore& operator=(FeatureStore&& other) {
+    if (this == &other) return *this;
+    frames_ = std::move(other.frames_);
+    first_frame_ = other.first_frame_;
+    size_ = other.size_;
+    other.clear();
+    return *this;
+  }
+
+  /// number of stored images
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  void clear() {
+    frames_.clear();
+    size_ = 0;
+  }
+
+  iterator begin() { return iterator(&frames_, 0); }
+  iterator end() { return iterator(&frames_, frames_.size() * MAX_CAMS); }
+  const_iterator begin() const { return const_iterator(&frames_, 0); }
+  const_iterator end() const {
+    return const_iterator(&frames_, frames_.size() * MAX_CAMS);
+  }
+
+  iterator find(const FrameCamId& fcid) {
+    return slot(fcid) ? iterator(&frames_, position(fcid)) : end();
+  }
+
+  const_iterator find(const FrameCamId& fcid) const {
+    return slot(fcid) ? const_iterator(&frames_, position(fcid)) : end();
+  }
+
+  size_t count(const FrameCamId& fcid) const { return slot(fcid) ? 1 : 0; }
+
+  KeypointsData& at(const FrameCamId& fcid) {
+    value_type* kv = slot(fcid);
+    if (!kv) throw std::out_of_range("FeatureStore::at");
+    return kv->second;
+  }
+
+  const KeypointsData& at(const FrameCamId& fcid) const {
+    const value_type* kv = slot(fcid);
+    if (!kv) throw std::out_of_range("FeatureStore::at");
+    return kv->second;
+  }
+
+  KeypointsData& operator[](const FrameCamId& fcid) {
+    if (fcid.cam_id >= MAX_CAMS) {
+      throw std::out_of_range("FeatureStore: invalid camera id");
+    }
+
+    if (frames_.empty()) first_frame_ = fcid.frame_id;
+    while (fcid.frame_id < first_frame_) {
+      frames_.emplace_front();
+      first_frame_--;
+    }
+    while (fcid.frame_id >= first_frame_ + FrameId(frames_.size())) {
+      frames_.emplace_back();
+    }
+
+    auto& kv = frames_[fcid.frame_id - first_frame_][fcid.cam_id];
+    if (!kv) {
+      kv.reset(new value_type(fcid, KeypointsData()));
+      size_++;
+    }
+    return kv->second;
+  }
+
+  /// Remove the keypoints of fcid. Returns the number of removed images.
+  size_t erase(const FrameCamId& fcid) {
+    if (!slot(fcid)) return 0;
+
+    frames_[fcid.frame_id - first_frame_][fcid.cam_id].reset();
+    size_--;
+
+    const auto is_empty = [](const Frame& frame) {
+      return std::none_of(frame.begin(), frame.end(),
+                          [](const auto& kv) { return bool(kv); });
+    };
+    while (!frames_.empty() && is_empty(frames_.front())) {
+      frames_.pop_front();
+      first_frame_++;
+    }
+    while (!frames_.empty() && is_empty(frames_.back())) frames_.pop_back();
+    return 1;
+  }
+
+  /// Release the descriptors of fcid, keeping its corners and angles.
+  void compact(const FrameCamId& fcid) {
+    value_type* kv = slot(fcid);
+    if (!kv) return;
+    std::vector<Descriptor>().swap(kv->second.corner_descriptors);
+  }
+
+  /// bytes allocated for the stored keypoints (without allocator overhead)
+  size_t memoryUsage() const {
+    size_t bytes = frames_.size() * sizeof(Frame);
+    for (const auto& kv : *this) {
+      const KeypointsData& kd = kv.second;
+      bytes += sizeof(value_type) +
+               kd.corners.capacity() * sizeof(Eigen::Vector2d) +
+               kd.corner_angles.capacity() * sizeof(double) +
+               kd.corner_descriptors.capacity() * sizeof(Descriptor);
+    }
+    return bytes;
+  }
+
+ private:
+  size_t position(const FrameCamId& fcid) const {
+    return (fcid.frame_id - first_frame_) * MAX_CAMS + fcid.cam_id;
+  }
+
+  const value_type* slot(const FrameCamId& fcid) const {
+    if (fcid.frame_id < first_frame_ ||
+        fcid.frame_id >= first_frame_ + FrameId(frames_.size()) ||
+        fcid.cam_id >= MAX_CAMS) {
+      return nullptr;
+    }
+    return frames_[fcid.frame_id - first_frame_][fcid.cam_id].get();
+  }
+
+  value_type* slot(const FrameCamId& fcid) {
+    return const_cast<value_type*>(std::as_const(*this).slot(fcid));
+  }
+
+  std::deque<Frame> frames_;
+  FrameId first_frame_ = 0;
+  size_t size_ = 0;
 };
 
 /// feature corners is a collection of { imageId => KeypointsData }
-using Corners = tbb::concurrent_unordered_map<FrameCamId, KeypointsData>;
+using Corners = FeatureStore;
 
 /// feature matches for an image pair
 struct MatchData {
@@ -178,6 +476,96 @@ struct Camera {
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
+/// number of most recent observation descriptors cached per landmark
+const int LANDMARK_NUM_RECENT_DESCRIPTORS = 4;
+
+/// Fixed-size summary of the descriptors of a landmark's observations, so that
+/// matching against a landmark costs the same regardless of the track length.
+/// Keeps the bitwise median of all summarized descriptors (maintained through
+/// per-bit counts) and the descriptors of the most recent observations.
+struct LandmarkDescriptors {
+  /// number of descriptors summarized by bit_counts
+  int num_obs = 0;
+  std::array<uint8_t, 256> bit_counts{};
+  Descriptor median;
+
+  /// most recently added observations, oldest first
+  int num_recent = 0;
+  std::array<Descriptor, LANDMARK_NUM_RECENT_DESCRIPTORS> recent;
+  std::array<FrameCamId, LANDMARK_NUM_RECENT_DESCRIPTORS> recent_fcids;
+
+  void clear() { *this = LandmarkDescriptors(); }
+
+  /// Add the descriptor of a new observation in image fcid. Returns false (and
+  /// leaves the cache empty) if the per-bit counts would overflow.
+  bool add(const FrameCamId& fcid, const Descriptor& d) {
+    if (num_obs == std::numeric_limits<uint8_t>::max()) {
+      clear();
+      return false;
+    }
+
+    num_obs++;
+    for (int n = 0; n < 256; n++) bit_counts[n] += d.test(n);
+    updateMedian();
+
+    if (num_recent == LANDMARK_NUM_RECENT_DESCRIPTORS) {
+      std::move(recent.begin() + 1, recent.end(), recent.begin());
+      std::move(recent_fcids.begin() + 1, recent_fcids.end(),
+                recent_fcids.begin());
+      num_recent--;
+    }
+    recent[num_recent] = d;
+    recent_fcids[num_recent] = fcid;
+    num_recent++;
+    return true;
+  }
+
+  /// Remove the descriptor d of the observation in image fcid.
+  void remove(const FrameCamId& fcid, const Descriptor& d) {
+    num_obs--;
+    for (int n = 0; n < 256; n++) bit_counts[n] -= d.test(n);
+    updateMedian();
+
+    for (int i = 0; i < num_recent; i++) {
+      if (recent_fcids[i] == fcid) {
+        std::move(recent.begin() + i + 1, recent.begin() + num_recent,
+                  recent.begin() + i);
+        std::move(recent_fcids.begin() + i + 1,
+                  recent_fcids.begin() + num_recent, recent_fcids.begin() + i);
+        num_recent--;
+        break;
+      }
+    }
+  }
+
+  /// minimal Hamming distance between d and the cached descriptors
+  int minDistance(const Descriptor& d) const {
+    int dist = hammingDistance(d, median);
+    for (int i = 0; i < num_recent; i++) {
+      dist = std::min(dist, hammingDistance(d, recent[i]));
+    }
+    return dist;
+  }
+
+ private:
+  void updateMedian() {
+    median.reset();
+    for (int n = 0; n < 256; n++) {
+      if (2 * bit_counts[n] > num_obs) median.set(n);
+    }
+  }
+};
+
+/// number of observations stored inline in a landmark before they spill to
+/// the heap
+const size_t LANDMARK_NUM_INLINE_OBS = 4;
+
+/// Observations {ImageId => FeatureId} of a landmark. Same interface as
+/// FeatureTrack, but stored contiguously (sorted by image) and without a heap
+/// allocation for short tracks.
+using LandmarkObservations =
+    SmallFlatMap<FrameCamId, FeatureId, LANDMARK_NUM_INLINE_OBS>;
+
 /// landmarks in the map
 struct Landmark {
   /// 3d position in world coordinates
@@ -185,11 +573,19 @@ struct Landmark {
 
   /// Inlier observations in the current map.
   /// This is a subset of the original feature track.
-  FeatureTrack obs; // a map from image to featureID
+  LandmarkObservations obs; // a map from image to featureID
 
   /// Outlier observations in the current map.
   /// This is a subset of the original feature track.
-  FeatureTrack outlier_obs;
+  LandmarkObservations outlier_obs;
+
+  /// Representative descriptors of obs for matching. Not serialized; only
+  /// used while it summarizes exactly the current inlier observations.
+  LandmarkDescriptors descriptors;
+
+  bool hasDescriptorCache() const {
+    return descriptors.num_obs > 0 && descriptors.num_obs == int(obs.size());
+  }
 };
 
 /// collection {imageId => Camera} for all cameras in the map
@@ -198,8 +594,60 @@ using Cameras =
              Eigen::aligned_allocator<std::pair<const FrameCamId, Camera>>>;
 
 /// collection {trackId => Landmark} for all landmarks in the map.
-/// trackIds correspond to feature_tracks
-using Landmarks = std::unordered_map<TrackId, Landmark>;
+/// trackIds correspond to feature_tracks. The landmarks are stored densely, so
+/// references to them are invalidated when landmarks are added or removed.
+using Landmarks = DenseMap<TrackId, Landmark>;
+
+/// Reverse index of the inlier observations of a map: the trackIds of the
+/// landmarks observed in every image. It is updated along with the
+/// observations, so that operations on a single keyframe (removing it,
+/// collecting its landmarks) only touch the landmarks it observes instead of
+/// scanning the whole map.
+class FrameLandmarkIndex {
+ public:
+  /// Record that landmark track_id is observed in fcid.
+  void add(const FrameCamId& fcid, TrackId track_id) {
+    index_[fcid].push_back(track_id);
+  }
+
+  /// trackIds of the landmarks observed in fcid, in the order they were added
+  const std::vector<TrackId>& landmarks(const FrameCamId& fcid) const {
+    static const std::vector<TrackId> empty;
+    auto it = index_.find(fcid);
+    return it == index_.end() ? empty : it->second;
+  }
+
+  /// Remove fcid from the index and return its landmarks.
+  std::vector<TrackId> take(const FrameCamId& fcid) {
+    std::vector<TrackId> track_ids;
+    auto it = index_.find(fcid);
+    if (it != index_.end()) {
+      track_ids = std::move(it->second);
+      index_.erase(it);
+    }
+    return track_ids;
+  }
+
+  /// number of indexed images
+  size_t size() const { return index_.size(); }
+
+  void clear() { index_.clear(); }
+
+  /// Index all observations of landmarks from scratch.
+  void rebuild(const Landmarks& landmarks) {
+    index_.clear();
+    for (const auto& kv : landmarks) {
+      for (const auto& obs : kv.second.obs) add(obs.first, kv.first);
+    }
+  }
+
+  const std::map<FrameCamId, std::vector<TrackId>>& images() const {
+    return index_;
+  }
+
+ private:
+  std::map<FrameCamId, std::vector<TrackId>> index_;
+};
 
 /// camera candidate to be added to map
 struct CameraCandidate {
@@ -0,0 +1,116 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <visnav/common_types.h>
+
+namespace visnav {
+
+/// image file of one camera of a dataset frame
+struct DatasetImage {
+  FrameCamId fcid;
+  Timestamp timestamp;
+  std::string path;
+};
+
+/// List the images of the layout read by odometry: timestamps and file names
+/// in cam0/data.csv, images in cam<i>/data/. Frames are numbered in the order
+/// of the file, with the images of all cameras of a frame next to each other.
+inline void list_euroc_images(const std::string& dataset_path, int num_cams,
+                              std::vector<DatasetImage>& images) {
+  std::ifstream times(dataset_path + "/cam0/data.csv");
+
+  FrameId id = 0;
+  while (times) {
+    std::string line;
+    std::getline(times, line);
+
+    if (line.size() < 20 || line[0] == '#') continue;
+
+    Timestamp timestamp;
+    std::istringstream(line.substr(0, 19)) >> timestamp;
+    const std::string img_name = line.substr(20, line.size() - 21);
+
+    for (int i = 0; i < num_cams; i++) {
+      std::stringstream ss;
+      ss << dataset_path << "/cam" << i << "/data/" << img_name;
+      images.push_back({FrameCamId(id, i), timestamp, ss.str()});
+    }
+
+    id++;
+  }
+}
+
+/// List the images of the layout read by sfm: timestamps in timestamps.txt,
+/// images <timestamp>_<i>.jpg. If max_frames > 0, list at most that many
+/// frames.
+inline void list_sfm_images(const std::string& dataset_path, int num_cams,
+                            int max_frames,
+                            std::vector<DatasetImage>& images) {
+  std::ifstream times(dataset_path + "/timestamps.txt");
+
+  FrameId id = 0;
+  while (times && (max_frames <= 0 || id < FrameId(max_frames))) {
+    Timestamp timestamp;
+    times >> timestamp;
+
+    // ensure that we actually read a new timestamp (and not e.g. just newline
+    // at the end of the file)
+    if (times.fail()) {
+      times.clear();
+      std::string temp;
+      times >> temp;
+      if (temp.size() > 0) {
+        std::cerr << "Skipping '" << temp << "' while reading times."
+                  << std::endl;
+      }
+      continue;
+    }
+
+    for (int i = 0; i < num_cams; i++) {
+      std::stringstream ss;
+      ss << dataset_path << "/" << timestamp << "_" << i << ".jpg";
+      images.push_back({FrameCamId(id, i), timestamp, ss.str()});
+    }
+
+    id++;
+  }
+}
+
+}  // namespace visnav
@@ -0,0 +1,361 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace visnav {
+
+/// Vector that keeps up to N elements inline and only moves them to the heap
+/// when it grows beyond that. Meant for short lists of small, cheap to copy
+/// elements; iterators and references are invalidated by every insertion and
+/// removal.
+template <class T, size_t N>
+class SmallVector {
+ public:
+  using value_type = T;
+  using iterator = T*;
+  using const_iterator = const T*;
+
+  SmallVector() = default;
+
+  SmallVector(const SmallVector& other) { assign(other.begin(), other.end()); }
+
+  SmallVector(SmallVector&& other) noexcept { take(other); }
+
+  ~SmallVector() { release(); }
+
+  SmallVector& operator=(const SmallVector& other) {
+    if (this != &other) assign(other.begin(), other.end());
+    return *this;
+  }
+
+  SmallVector& operator=(SmallVector&& other) noexcept {
+    if (this != &other) {
+      release();
+      take(other);
+    }
+    return *this;
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t capacity() const { return capacity_; }
+
+  T* data() { return data_; }
+  const T* data() const { return data_; }
+
+  iterator begin() { return data_; }
+  iterator end() { return data_ + size_; }
+  const_iterator begin() const { return data_; }
+  const_iterator end() const { return data_ + size_; }
+
+  T& operator[](size_t i) { return data_[i]; }
+  const T& operator[](size_t i) const { return data_[i]; }
+
+  void clear() { size_ = 0; }
+
+  void reserve(size_t n) {
+    if (n <= capacity_) return;
+
+    T* heap = new T[n];
+    std::copy(begin(), end(), heap);
+    const uint32_t size = size_;
+    release();
+    data_ = heap;
+    size_ = size;
+    capacity_ = uint32_t(n);
+  }
+
+  iterator insert(const_iterator pos, const T& value) {
+    const size_t i = pos - begin();
+    const T copy = value;
+    if (size_ == capacity_) reserve(2 * capacity_);
+    std::copy_backward(begin() + i, end(), end() + 1);
+    data_[i] = copy;
+    size_++;
+    return begin() + i;
+  }
+
+  void push_back(const T& value) { insert(end(), value); }
+
+  iterator erase(const_iterator pos) {
+    const size_t i = pos - begin();
+    std::copy(begin() + i + 1, end(), begin() + i);
+    size_--;
+    return begin() + i;
+  }
+
+ private:
+  bool isInline() const { return data_ == inline_; }
+
+  void release() {
+    if (!isInline()) delete[] data_;
+    data_ = inline_;
+    size_ = 0;
+    capacity_ = N;
+  }
+
+  void assign(const_iterator first, const_iterator last) {
+    size_ = 0;
+    reserve(last - first);
+    std::copy(first, last, data_);
+    size_ = uint32_t(last - first);
+  }
+
+  void take(SmallVector& other) {
+    if (other.isInline()) {
+      std::copy(other.begin(), other.end(), inline_);
+    } else {
+      data_ = other.data_;
+      capacity_ = other.capacity_;
+      other.data_ = other.inline_;
+      other.capacity_ = N;
+    }
+    size_ = other.size_;
+    other.size_ = 0;
+  }
+
+  T* data_ = inline_;
+  uint32_t size_ = 0;
+  uint32_t capacity_ = N;
+  T inline_[N];
+};
+
+/// Map with the interface of std::map for the few operations we need, stored
+/// as a SmallVector of (key, value) pairs sorted by key. For short maps this
+/// avoids a heap allocation per entry and keeps iteration contiguous; lookups
+/// are binary searches and insertions shift the later entries.
+template <class K, class V, size_t N>
+class SmallFlatMap {
+ public:
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<K, V>;
+  using iterator = value_type*;
+  using const_iterator = const value_type*;
+
+  size_t size() const { return values_.size(); }
+  bool empty() const { return values_.empty(); }
+  void clear() { values_.clear(); }
+
+  iterator begin() { return values_.begin(); }
+  iterator end() { return values_.end(); }
+  const_iterator begin() const { return values_.begin(); }
+  const_iterator end() const { return values_.end(); }
+
+  iterator find(const K& key) {
+    iterator it = lowerBound(key);
+    return it != end() && !(key < it->first) ? it : end();
+  }
+
+  const_iterator find(const K& key) const {
+    const_iterator it = lowerBound(key);
+    return it != end() && !(key < it->first) ? it : end();
+  }
+
+  size_t count(const K& key) const { return find(key) != end() ? 1 : 0; }
+
+  V& at(const K& key) {
+    iterator it = find(key);
+    if (it == end()) throw std::out_of_range("SmallFlatMap::at");
+    return it->second;
+  }
+
+  const V& at(const K& key) const {
+    const_iterator it = find(key);
+    if (it == end()) throw std::out_of_range("SmallFlatMap::at");
+    return it->second;
+  }
+
+  V& operator[](const K& key) { return emplace(key, V()).first->second; }
+
+  /// Insert (key, value) unless key is already in the map. Returns the entry
+  /// of key and whether it was inserted.
+  std::pair<iterator, bool> emplace(const K& key, const V& value) {
+    iterator it = lowerBound(key);
+    if (it != end() && !(key < it->first)) return {it, false};
+    return {values_.insert(it, value_type(key, value)), true};
+  }
+
+  size_t erase(const K& key) {
+    iterator it = find(key);
+    if (it == end()) return 0;
+    values_.erase(it);
+    return 1;
+  }
+
+  iterator erase(const_iterator pos) { return values_.erase(pos); }
+
+  friend bool operator==(const SmallFlatMap& a, const SmallFlatMap& b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end());
+  }
+
+  friend bool operator!=(const SmallFlatMap& a, const SmallFlatMap& b) {
+    return !(a == b);
+  }
+
+  friend bool operator<(const SmallFlatMap& a, const SmallFlatMap& b) {
+    return std::lexicographical_compare(a.begin(), a.end(), b.begin(),
+                                        b.end());
+  }
+
+ private:
+  iterator lowerBound(const K& key) {
+    return std::lower_bound(
+        begin(), end(), key,
+        [](const value_type& kv, const K& k) { return kv.first < k; });
+  }
+
+  const_iterator lowerBound(const K& key) const {
+    return std::lower_bound(
+        begin(), end(), key,
+        [](const value_type& kv, const K& k) { return kv.first < k; });
+  }
+
+  SmallVector<value_type, N> values_;
+};
+
+/// Hash map that stores its (key, value) pairs densely in a vector, with a
+/// separate hash index from key to position. Iterating over all values is a
+/// linear scan of contiguous memory. Erasing moves the last pair into the
+/// freed position, so the order of the pairs is arbitrary, and erase(it)
+/// returns an iterator to the pair that took its place (so the usual
+/// erase-while-iterating loop still visits every pair once). Insertions and
+/// removals invalidate iterators and references to the values.
+template <class K, class V, class Hash = std::hash<K>>
+class DenseMap {
+ public:
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<K, V>;
+  using iterator = typename std::vector<value_type>::iterator;
+  using const_iterator = typename std::vector<value_type>::const_iterator;
+
+  size_t size() const { return values_.size(); }
+  bool empty() const { return values_.empty(); }
+
+  void clear() {
+    values_.clear();
+    index_.clear();
+  }
+
+  void reserve(size_t n) {
+    values_.reserve(n);
+    index_.reserve(n);
+  }
+
+  iterator begin() { return values_.begin(); }
+  iterator end() { return values_.end(); }
+  const_iterator begin() const { return values_.begin(); }
+  const_iterator end() const { return values_.end(); }
+
+  iterator find(const K& key) {
+    auto it = index_.find(key);
+    return it != index_.end() ? begin() + it->second : end();
+  }
+
+  const_iterator find(const K& key) const {
+    auto it = index_.find(key);
+    return it != index_.end() ? begin() + it->second : end();
+  }
+
+  size_t count(const K& key) const { return index_.count(key); }
+
+  V& at(const K& key) { return values_[index_.at(key)].second; }
+  const V& at(const K& key) const { return values_[index_.at(key)].second; }
+
+  V& operator[](const K& key) { return emplace(key).first->second; }
+
+  /// Construct the value of key from args unless key is already in the map.
+  /// Returns the entry of key and whether it was inserted.
+  template <class... Args>
+  std::pair<iterator, bool> emplace(const K& key, Args&&... args) {
+    auto [it, inserted] = index_.emplace(key, values_.size());
+    if (!inserted) return {begin() + it->second, false};
+
+    values_.emplace_back(std::piecewise_construct, std::forward_as_tuple(key),
+                         std::forward_as_tuple(std::forward<Args>(args)...));
+    return {end() - 1, true};
+  }
+
+  std::pair<iterator, bool> insert(const value_type& value) {
+    return emplace(value.first, value.second);
+  }
+
+  size_t erase(const K& key) {
+    const_iterator it = find(key);
+    if (it == end()) return 0;
+    erase(it);
+    return 1;
+  }
+
+  /// Release unused capacity, e.g. after many pairs were erased.
+  void shrink_to_fit() {
+    values_.shrink_to_fit();
+    index_.rehash(0);
+  }
+
+  /// bytes allocated by the map itself, without memory owned by the values;
+  /// the hash index is estimated with one node per entry
+  size_t memoryUsage() const {
+    const size_t node_bytes =
+        sizeof(typename decltype(index_)::value_type) + 2 * sizeof(void*);
+    return values_.capacity() * sizeof(value_type) +
+           index_.bucket_count() * sizeof(void*) + index_.size() * node_bytes;
+  }
+
+  iterator erase(const_iterator pos) {
+    const size_t i = pos - values_.cbegin();
+    index_.erase(values_[i].first);
+    if (i + 1 != values_.size()) {
+      values_[i] = std::move(values_.back());
+      index_[values_[i].first] = i;
+    }
+    values_.pop_back();
+    return begin() + i;
+  }
+
+ private:
+  std::vector<value_type> values_;
+  std::unordered_map<K, size_t, Hash> index_;
+};
+
+}  // namespace visnav
@@ -0,0 +1,290 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pangolin/image/image.h>
+
+#include <visnav/common_types.h>
+
+namespace visnav {
+
+/// Single-file pack of raw 8-bit images for fast repeated loading of
+/// datasets. The file starts with an ImagePackHeader; the images follow, each
+/// starting at a multiple of IMAGE_PACK_ALIGNMENT, and the ImagePackEntry index
+/// is at the end. Integers are stored in host byte order.
+constexpr char IMAGE_PACK_MAGIC[8] = {'V', 'N', 'I', 'M', 'G', 'P', 'K', '1'};
+constexpr uint32_t IMAGE_PACK_VERSION = 1;
+constexpr uint64_t IMAGE_PACK_ALIGNMENT = 4096;
+
+struct ImagePackHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t alignment;
+  uint64_t num_entries;
+  uint64_t index_offset;
+};
+
+struct ImagePackEntry {
+  int64_t timestamp;
+  int64_t frame_id;
+  uint64_t cam_id;
+  uint32_t width;
+  uint32_t height;
+  uint64_t pitch;
+  uint64_t offset;
+};
+
+/// Writes an image pack: add the images, then finish() to write the index.
+class ImagePackWriter {
+ public:
+  ~ImagePackWriter() { close(); }
+
+  bool open(const std::string& path) {
+    close();
+    file_ = std::fopen(path.c_str(), "wb");
+    if (!file_) {
+      std::cerr << "Could not open image pack " << path << " for writing."
+                << std::endl;
+      return false;
+    }
+    entries_.clear();
+    pos_ = 0;
+    ImagePackHeader header = {};
+    return write(&header, sizeof(header));
+  }
+
+  /// Append the image of fcid taken at timestamp.
+  bool add(const FrameCamId& fcid, Timestamp timestamp,
+           const pangolin::Image<uint8_t>& img) {
+    if (!pad_to(IMAGE_PACK_ALIGNMENT)) return false;
+
+    ImagePackEntry entry;
+    entry.timestamp = timestamp;
+    entry.frame_id = fcid.frame_id;
+    entry.cam_id = fcid.cam_id;
+    entry.width = img.w;
+    entry.height = img.h;
+    entry.pitch = img.w;
+    entry.offset = pos_;
+
+    for (size_t y = 0; y < img.h; y++) {
+      if (!write(img.RowPtr(y), img.w)) return false;
+    }
+
+    entries_.push_back(entry);
+    return true;
+  }
+
+  /// Write the index and the header and close the file.
+  bool finish() {
+    if (!file_) return false;
+
+    bool ok = pad_to(sizeof(uint64_t));
+
+    ImagePackHeader header;
+    std::memcpy(header.magic, IMAGE_PACK_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_PACK_VERSION;
+    header.alignment = IMAGE_PACK_ALIGNMENT;
+    header.num_entries = entries_.size();
+    header.index_offset = pos_;
+
+    ok = ok && write(entries_.data(), entries_.size() * sizeof(ImagePackEntry));
+    ok = ok && std::fseek(file_, 0, SEEK_SET) == 0 &&
+         std::fwrite(&header, sizeof(header), 1, file_) == 1;
+    ok = (std::fclose(file_) == 0) && ok;
+    file_ = nullptr;
+
+    if (!ok) std::cerr << "Writing the image pack failed." << std::endl;
+    return ok;
+  }
+
+ private:
+  void close() {
+    if (file_) std::fclose(file_);
+    file_ = nullptr;
+  }
+
+  bool write(const void* data, size_t size) {
+    if (size > 0 && std::fwrite(data, size, 1, file_) != 1) return false;
+    pos_ += size;
+    return true;
+  }
+
+  bool pad_to(uint64_t alignment) {
+    static const char zeros[IMAGE_PACK_ALIGNMENT] = {};
+    return write(zeros, (alignment - pos_ % alignment) % alignment);
+  }
+
+  std::FILE* file_ = nullptr;
+  uint64_t pos_ = 0;
+  std::vector<ImagePackEntry> entries_;
+};
+
+/// Read-only memory mapping of an image pack. The images are returned as
+/// views into the mapping, so nothing is copied or decoded, and the pages are
+/// only read from disk (or the page cache) when the images are accessed.
+class ImagePack {
+ public:
+  ImagePack() = default;
+  ~ImagePack() { close(); }
+
+  ImagePack(const ImagePack&) = delete;
+  ImagePack& operator=(const ImagePack&) = delete;
+
+  /// Map the pack at path; prints the reason and returns false on failure.
+  bool open(const std::string& path) {
+    close();
+
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cerr << "Could not open image pack " << path << std::endl;
+      return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(ImagePackHeader)) {
+      size_ = st.st_size;
+      void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+      if (data != MAP_FAILED) data_ = static_cast<const uint8_t*>(data);
+    }
+    ::close(fd);
+
+    if (!data_ || !validate()) {
+      std::cerr << "Invalid image pack " << path << std::endl;
+      close();
+      return false;
+    }
+
+    const ImagePackHeader* header =
+        reinterpret_cast<const ImagePackHeader*>(data_);
+    entries_ = reinterpret_cast<const ImagePackEntry*>(data_ +
+                                                       header->index_offset);
+    num_entries_ = header->num_entries;
+
+    for (size_t i = 0; i < num_entries_; i++) {
+      index_[FrameCamId(entries_[i].frame_id, entries_[i].cam_id)] = i;
+    }
+
+    return true;
+  }
+
+  void close() {
+    if (data_) munmap(const_cast<uint8_t*>(data_), size_);
+    data_ = nullptr;
+    size_ = 0;
+    entries_ = nullptr;
+    num_entries_ = 0;
+    index_.clear();
+  }
+
+  bool isOpen() const { return data_ != nullptr; }
+
+  size_t size() const { return num_entries_; }
+
+  const ImagePackEntry& entry(size_t i) const { return entries_[i]; }
+
+  /// index of the image of fcid or -1 if it is not in the pack
+  int64_t find(const FrameCamId& fcid) const {
+    const auto it = index_.find(fcid);
+    return it == index_.end() ? -1 : int64_t(it->second);
+  }
+
+  /// View of image i in the mapping. The pixels are read-only even though
+  /// pangolin's image type does not express it.
+  pangolin::Image<uint8_t> image(size_t i) const {
+    const ImagePackEntry& e = entries_[i];
+    return pangolin::Image<uint8_t>(const_cast<uint8_t*>(data_ + e.offset),
+                                    e.width, e.height, e.pitch);
+  }
+
+  /// Ask the kernel to start reading image i in the background.
+  void prefetch(size_t i) const {
+    const ImagePackEntry& e = entries_[i];
+    // madvise needs a page aligned address; packs written with a smaller
+    // alignment can start an image in the middle of a page
+    static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const uint64_t begin = e.offset - e.offset % page_size;
+    madvise(const_cast<uint8_t*>(data_ + begin),
+            e.offset - begin + e.pitch * e.height, MADV_WILLNEED);
+  }
+
+ private:
+  bool validate() const {
+    const ImagePackHeader* header =
+        reinterpret_cast<const ImagePackHeader*>(data_);
+    if (std::memcmp(header->magic, IMAGE_PACK_MAGIC, sizeof(header->magic)) ||
+        header->version != IMAGE_PACK_VERSION || header->alignment == 0 ||
+        header->index_offset % sizeof(uint64_t) != 0 ||
+        header->index_offset > size_ ||
+        header->num_entries >
+            (size_ - header->index_offset) / sizeof(ImagePackEntry)) {
+      return false;
+    }
+
+    const ImagePackEntry* entries = reinterpret_cast<const ImagePackEntry*>(
+        data_ + header->index_offset);
+    for (size_t i = 0; i < header->num_entries; i++) {
+      const ImagePackEntry& e = entries[i];
+      // the image has to end before the index; divide instead of multiplying
+      // pitch and height, which could wrap around for a corrupt entry
+      if (e.pitch == 0 || e.pitch < e.width ||
+          e.offset % header->alignment != 0 ||
+          e.offset > header->index_offset ||
+          e.height > (header->index_offset - e.offset) / e.pitch) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  const ImagePackEntry* entries_ = nullptr;
+  size_t num_entries_ = 0;
+  std::unordered_map<FrameCamId, size_t> index_;
+};
+
+}  // namespace visnav
@@ -0,0 +1,222 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pangolin/image/image_io.h>
+#include <pangolin/image/managed_image.h>
+
+#include <visnav/common_types.h>
+
+namespace visnav {
+
+/// Loads the images of a sequence of frames in a background thread ahead of
+/// the consumer. Frames are loaded in order into a ring of capacity slots, so
+/// at most capacity frames (including the one the consumer holds) are decoded
+/// at a time; the loader blocks once the ring is full until the consumer moves
+/// on. The slots and their image vectors are reused; the image buffers
+/// themselves come from pangolin's decoder and are moved into the slots.
+class ImagePrefetcher {
+ public:
+  typedef std::vector<pangolin::ManagedImage<uint8_t>> FrameImages;
+
+  /// image file of a frame and camera
+  typedef std::function<std::string(const FrameCamId&)> PathFunction;
+
+  struct Stats {
+    /// number of frames decoded by the loader thread
+    size_t num_loaded = 0;
+
+    /// time the loader spent decoding
+    double load_time_s = 0;
+
+    /// time the loader waited for a free slot (backpressure)
+    double blocked_time_s = 0;
+
+    /// number of acquire calls and how many of them had to wait for the
+    /// loader, with the total time waited
+    size_t num_acquired = 0;
+    size_t num_stalls = 0;
+    double stall_time_s = 0;
+  };
+
+  /// Prefetch the images of cameras 0, ..., num_cams - 1 for the frames
+  /// 0, ..., num_frames - 1.
+  ImagePrefetcher(FrameId num_frames, CamId num_cams, PathFunction path,
+                  size_t capacity)
+      : num_frames_(num_frames),
+        num_cams_(num_cams),
+        path_(std::move(path)),
+        slots_(std::max<size_t>(capacity, 1)) {
+    thread_ = std::thread([this] { run(); });
+  }
+
+  ~ImagePrefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    free_cv_.notify_all();
+    thread_.join();
+  }
+
+  ImagePrefetcher(const ImagePrefetcher&) = delete;
+  ImagePrefetcher& operator=(const ImagePrefetcher&) = delete;
+
+  /// Return the images of frame_id (one per camera), waiting for the loader
+  /// if necessary, and release all earlier frames. The result stays valid
+  /// until the next call. Going back to an earlier frame loads it
+  /// synchronously. Rethrows loading errors of the frame.
+  const FrameImages& acquire(FrameId frame_id) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stats_.num_acquired++;
+
+    if (frame_id < min_frame_ || frame_id >= num_frames_) {
+      lock.unlock();
+      sync_images_ = load(frame_id);
+      return sync_images_;
+    }
+
+    // skip frames the consumer will not ask for
+    min_frame_ = frame_id;
+    if (next_frame_ < frame_id) next_frame_ = frame_id;
+    free_cv_.notify_one();
+
+    Slot& slot = slots_[size_t(frame_id) % slots_.size()];
+    if (slot.frame_id != frame_id) {
+      const auto start = std::chrono::steady_clock::now();
+      loaded_cv_.wait(lock, [&] { return slot.frame_id == frame_id; });
+      stats_.num_stalls++;
+      stats_.stall_time_s += seconds_since(start);
+    }
+
+    if (slot.error) std::rethrow_exception(slot.error);
+    return slot.images;
+  }
+
+  Stats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+
+ private:
+  struct Slot {
+    FrameId frame_id = -1;
+    FrameImages images;
+    std::exception_ptr error;
+  };
+
+  static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  }
+
+  FrameImages load(FrameId frame_id) const {
+    FrameImages images(num_cams_);
+    for (CamId cam_id = 0; cam_id < num_cams_; cam_id++) {
+      images[cam_id] = pangolin::LoadImage(path_(FrameCamId(frame_id, cam_id)));
+    }
+    return images;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      const auto start = std::chrono::steady_clock::now();
+      free_cv_.wait(lock, [&] {
+        return stop_ || (next_frame_ < num_frames_ &&
+                         next_frame_ < min_frame_ + FrameId(slots_.size()));
+      });
+      stats_.blocked_time_s += seconds_since(start);
+      if (stop_) return;
+
+      const FrameId frame_id = next_frame_++;
+      lock.unlock();
+
+      const auto load_start = std::chrono::steady_clock::now();
+      FrameImages images;
+      std::exception_ptr error;
+      try {
+        images = load(frame_id);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      const double load_time = seconds_since(load_start);
+
+      lock.lock();
+      stats_.num_loaded++;
+      stats_.load_time_s += load_time;
+
+      // the consumer might have skipped the frame in the meantime
+      if (frame_id >= min_frame_) {
+        Slot& slot = slots_[size_t(frame_id) % slots_.size()];
+        slot.frame_id = frame_id;
+        slot.images = std::move(images);
+        slot.error = error;
+        loaded_cv_.notify_one();
+      }
+    }
+  }
+
+  const FrameId num_frames_;
+  const CamId num_cams_;
+  const PathFunction path_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable free_cv_;
+  std::condition_variable loaded_cv_;
+
+  std::vector<Slot> slots_;
+  FrameImages sync_images_;
+
+  // next frame to load and first frame still needed by the consumer
+  FrameId next_frame_ = 0;
+  FrameId min_frame_ = 0;
+  bool stop_ = false;
+
+  Stats stats_;
+  std::thread thread_;
+};
+
+}  // namespace visnav
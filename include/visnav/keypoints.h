@@ -32,9 +32,21 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <bitset>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include <set>
 
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#if defined(__SSE2__) || defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
 #include <Eigen/Dense>
 #include <sophus/se3.hpp>
 #include <pangolin/image/managed_image.h>
@@ -47,7 +59,28 @@ const int PATCH_SIZE = 31;
 const int HALF_PATCH_SIZE = 15;
 const int EDGE_THRESHOLD = 19;
 
-typedef std::bitset<256> Descriptor;
+/// number of discrete orientations for the pre-rotated pattern (12 deg bins as
+/// in ORB)
+const int NUM_ANGLE_BINS = 30;
+
+/// FAST intensity threshold and the lower threshold used for grid cells in
+/// which no corner passes the default one (as in ORB-SLAM)
+const int FAST_THRESHOLD = 20;
+const int FAST_MIN_THRESHOLD = 7;
+/// size in pixels of the grid cells of the FAST detector
+const int FAST_GRID_CELL_SIZE = 32;
+
+/// corner detector used by detectKeypoints
+enum class DetectorMethod {
+  GoodFeatures,  ///< Shi-Tomasi corners from OpenCV's goodFeaturesToTrack
+  FastGrid       ///< FAST-9 corners with a feature quota per grid cell
+};
+
+/// how computeDescriptors steers the sampling pattern with the corner angle
+enum class DescriptorMethod {
+  Exact,     ///< rotate the pattern by the exact corner angle
+  Quantized  ///< use the pattern pre-rotated to the closest angle bin
+};
 
 char pattern_31_x_a[256] = {
     8,   4,   -11, 7,   2,   1,   -2,  -13, -13, 10,  -13, -11, 7,   -4,  -13,
@@ -127,8 +160,8 @@ char pattern_31_y_b[256] = {
     -9,  -1,  -2,  -8,  5,   10,  5,   5,   11,  -6,  -12, 9,   4,   -2, -2,
     -11};
 
-void detectKeypoints(const pangolin::ManagedImage<uint8_t>& img_raw,
-                     KeypointsData& kd, int num_features) {
+void detectKeypointsGoodFeatures(const pangolin::Image<uint8_t>& img_raw,
+                                 KeypointsData& kd, int num_features) {
   cv::Mat image(img_raw.h, img_raw.w, CV_8U, img_raw.ptr);
 
   std::vector<cv::Point2f> points;
@@ -145,45 +178,348 @@ void detectKeypoints(const pangolin::ManagedImage<uint8_t>& img_raw,
   }
 }
 
-void computeAngles(const pangolin::ManagedImage<uint8_t>& img_raw,  
-                   KeypointsData& kd, bool rotate_features) {
-  kd.corner_angles.resize(kd.corners.size());
+/// Byte offsets of the 16 pixels of the Bresenham circle of radius 3 used by
+/// FAST, in circular order.
+std::array<int, 16> fastCircleOffsets(size_t pitch) {
+  static const int circle[16][2] = {{0, -3}, {1, -3},  {2, -2},  {3, -1},
+                                    {3, 0},  {3, 1},   {2, 2},   {1, 3},
+                                    {0, 3},  {-1, 3},  {-2, 2},  {-3, 1},
+                                    {-3, 0}, {-3, -1}, {-2, -2}, {-1, -3}};
+  std::array<int, 16> offsets;
+  for (int k = 0; k < 16; k++) {
+    offsets[k] = circle[k][1] * int(pitch) + circle[k][0];
+  }
+  return offsets;
+}
 
-  for (size_t i = 0; i < kd.corners.size(); i++) {
-    const Eigen::Vector2d& p = kd.corners[i];
+/// FAST-9 score of a pixel: the largest threshold for which 9 contiguous
+/// circle pixels are all brighter or all darker than the center. Returns 0
+/// if the pixel is not a corner for the given threshold.
+int fastCornerScore(const uint8_t* p, const std::array<int, 16>& offsets,
+                    int threshold) {
+  int diff[16];
+  for (int k = 0; k < 16; k++) diff[k] = int(p[offsets[k]]) - int(p[0]);
+
+  int score = 0;
+  for (int k = 0; k < 16; k++) {
+    int min_brighter = 255, min_darker = 255;
+    for (int j = 0; j < 9; j++) {
+      const int d = diff[(k + j) & 15];
+      min_brighter = std::min(min_brighter, d);
+      min_darker = std::min(min_darker, -d);
+    }
+    score = std::max(score, std::max(min_brighter, min_darker));
+  }
+  return score > threshold ? score : 0;
+}
 
-    const int cx = p[0];
-    const int cy = p[1];
+/// Segment test for the 16 consecutive pixels starting at p. Bit k of the
+/// result is set if pixel k has 9 contiguous circle pixels that are all
+/// brighter or all darker than it by more than the threshold.
+int fastSegmentTest16(const uint8_t* p, const std::array<int, 16>& offsets,
+                      int threshold) {
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i t = _mm_set1_epi8(char(threshold));
+  const __m128i center = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  const __m128i upper = _mm_adds_epu8(center, t);
+  const __m128i lower = _mm_subs_epu8(center, t);
+
+  __m128i brighter[16], darker[16];
+  for (int k = 0; k < 16; k++) {
+    const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + offsets[k]));
+    // all ones in lanes with v > upper and v < lower respectively
+    brighter[k] = _mm_xor_si128(
+        _mm_cmpeq_epi8(_mm_subs_epu8(v, upper), zero), _mm_set1_epi8(-1));
+    darker[k] = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(lower, v), zero),
+                              _mm_set1_epi8(-1));
+  }
 
-    double angle = 0;
-
-  if (rotate_features) {
-        double m_01 = 0;
-        double m_10 = 0;
-        for(int u = -HALF_PATCH_SIZE; u <= HALF_PATCH_SIZE; ++u) {
-          for(int v = -HALF_PATCH_SIZE; v <= HALF_PATCH_SIZE; ++v) {
-            if(u * u + v * v <= HALF_PATCH_SIZE * HALF_PATCH_SIZE) {
-              double pixel = img_raw(cx + u , cy + v);
-              m_01 += v * pixel;
-              m_10 += u * pixel;
-            }
-          }
-        }
+  // longest run of set masks around the circle, wrapping once
+  __m128i run_b = zero, run_d = zero, max_b = zero, max_d = zero;
+  for (int k = 0; k < 16 + 8; k++) {
+    run_b = _mm_and_si128(_mm_sub_epi8(run_b, brighter[k & 15]),
+                          brighter[k & 15]);
+    run_d = _mm_and_si128(_mm_sub_epi8(run_d, darker[k & 15]), darker[k & 15]);
+    max_b = _mm_max_epu8(max_b, run_b);
+    max_d = _mm_max_epu8(max_d, run_d);
+  }
+
+  const __m128i max_run = _mm_max_epu8(max_b, max_d);
+  const __m128i nine = _mm_set1_epi8(9);
+  return _mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_max_epu8(max_run, nine), max_run));
+#else
+  int mask = 0;
+  for (int i = 0; i < 16; i++) {
+    if (fastCornerScore(p + i, offsets, threshold) > 0) mask |= 1 << i;
+  }
+  return mask;
+#endif
+}
 
-      if (std::abs(m_01) > std::numeric_limits<double>::epsilon() || std::abs(m_10) > std::numeric_limits<double>::epsilon()) {
-        angle = std::atan2(m_01, m_10);
-      } else {
-        angle = 0;
+/// FAST corner candidate of one grid cell
+struct FastCorner {
+  int score;
+  int x;
+  int y;
+};
+
+/// Detect FAST-9 corners in the cell [x0, x1) x [y0, y1) with 3x3 non-maximum
+/// suppression and keep the (at most) quota strongest ones.
+void detectFastCornersInCell(const pangolin::Image<uint8_t>& img_raw,
+                             const std::array<int, 16>& offsets, int x0,
+                             int y0, int x1, int y1, int threshold, int quota,
+                             std::vector<FastCorner>& corners) {
+  // scores for the cell with a one pixel border for the suppression
+  const int bx0 = std::max(x0 - 1, EDGE_THRESHOLD);
+  const int by0 = std::max(y0 - 1, EDGE_THRESHOLD);
+  const int bx1 = std::min(x1 + 1, int(img_raw.w) - EDGE_THRESHOLD);
+  const int by1 = std::min(y1 + 1, int(img_raw.h) - EDGE_THRESHOLD);
+  const int bw = bx1 - bx0;
+  const int bh = by1 - by0;
+
+  std::vector<int> scores(bw * bh, 0);
+  for (int y = by0; y < by1; y++) {
+    const uint8_t* row = img_raw.RowPtr(y);
+    int* score_row = &scores[(y - by0) * bw];
+    for (int x = bx0; x < bx1; x += 16) {
+      int mask = fastSegmentTest16(row + x, offsets, threshold);
+      mask &= (bx1 - x >= 16) ? 0xffff : (1 << (bx1 - x)) - 1;
+      while (mask) {
+        const int i = __builtin_ctz(mask);
+        mask &= mask - 1;
+        score_row[x - bx0 + i] =
+            fastCornerScore(row + x + i, offsets, threshold);
       }
+    }
+  }
 
+  corners.clear();
+  for (int y = y0; y < y1; y++) {
+    for (int x = x0; x < x1; x++) {
+      const int* s = &scores[(y - by0) * bw + (x - bx0)];
+      const int score = s[0];
+      if (score == 0) continue;
+
+      // strict maximum w.r.t. later pixels, ties with earlier ones are kept
+      // by the earlier pixel
+      const bool left = x > bx0, right = x + 1 < bx1;
+      const bool up = y > by0, down = y + 1 < by1;
+      if ((left && s[-1] >= score) || (right && s[1] > score) ||
+          (up && s[-bw] >= score) || (down && s[bw] > score) ||
+          (up && left && s[-bw - 1] >= score) ||
+          (up && right && s[-bw + 1] >= score) ||
+          (down && left && s[bw - 1] > score) ||
+          (down && right && s[bw + 1] > score)) {
+        continue;
       }
+      corners.push_back({score, x, y});
+    }
+  }
+
+  auto stronger = [](const FastCorner& a, const FastCorner& b) {
+    return a.score > b.score;
+  };
+  if (int(corners.size()) > quota) {
+    std::partial_sort(corners.begin(), corners.begin() + quota, corners.end(),
+                      stronger);
+    corners.resize(quota);
+  }
+}
+
+void detectKeypointsFastGrid(const pangolin::Image<uint8_t>& img_raw,
+                             KeypointsData& kd, int num_features) {
+  kd.corners.clear();
+  kd.corner_angles.clear();
+  kd.corner_descriptors.clear();
 
-    kd.corner_angles[i] = angle; // each coner has a Intensity moment
+  const int x_min = EDGE_THRESHOLD, x_max = int(img_raw.w) - EDGE_THRESHOLD;
+  const int y_min = EDGE_THRESHOLD, y_max = int(img_raw.h) - EDGE_THRESHOLD;
+  if (x_max <= x_min || y_max <= y_min || num_features <= 0) return;
+
+  const int cell = FAST_GRID_CELL_SIZE;
+  const int cols = (x_max - x_min + cell - 1) / cell;
+  const int rows = (y_max - y_min + cell - 1) / cell;
+  const int num_cells = cols * rows;
+  const int quota = (num_features + num_cells - 1) / num_cells;
+
+  const std::array<int, 16> offsets = fastCircleOffsets(img_raw.pitch);
+
+  std::vector<std::vector<FastCorner>> cell_corners(num_cells);
+  tbb::parallel_for(
+      tbb::blocked_range<int>(0, num_cells),
+      [&](const tbb::blocked_range<int>& r) {
+        for (int c = r.begin(); c != r.end(); ++c) {
+          const int x0 = x_min + (c % cols) * cell;
+          const int y0 = y_min + (c / cols) * cell;
+          const int x1 = std::min(x0 + cell, x_max);
+          const int y1 = std::min(y0 + cell, y_max);
+
+          detectFastCornersInCell(img_raw, offsets, x0, y0, x1, y1,
+                                  FAST_THRESHOLD, quota, cell_corners[c]);
+          if (cell_corners[c].empty()) {
+            detectFastCornersInCell(img_raw, offsets, x0, y0, x1, y1,
+                                    FAST_MIN_THRESHOLD, quota, cell_corners[c]);
+          }
+        }
+      });
+
+  std::vector<FastCorner> corners;
+  corners.reserve(num_cells * quota);
+  for (const auto& cc : cell_corners) {
+    corners.insert(corners.end(), cc.begin(), cc.end());
+  }
+
+  // strongest corners first, as goodFeaturesToTrack returns them
+  std::stable_sort(corners.begin(), corners.end(),
+                   [](const FastCorner& a, const FastCorner& b) {
+                     return a.score > b.score;
+                   });
+  if (int(corners.size()) > num_features) corners.resize(num_features);
+
+  kd.corners.reserve(corners.size());
+  for (const FastCorner& c : corners) {
+    kd.corners.emplace_back(c.x, c.y);
+  }
+}
+
+void detectKeypoints(const pangolin::Image<uint8_t>& img_raw,
+                     KeypointsData& kd, int num_features,
+                     DetectorMethod method = DetectorMethod::GoodFeatures) {
+  if (method == DetectorMethod::FastGrid) {
+    detectKeypointsFastGrid(img_raw, kd, num_features);
+  } else {
+    detectKeypointsGoodFeatures(img_raw, kd, num_features);
+  }
+}
+
+/// Half width of the circular orientation patch for every row offset, i.e.
+/// umax[|v|] is the largest u with u * u + v * v <= HALF_PATCH_SIZE^2.
+const std::array<int, HALF_PATCH_SIZE + 1>& getPatchUmax() {
+  static const std::array<int, HALF_PATCH_SIZE + 1> umax = [] {
+    std::array<int, HALF_PATCH_SIZE + 1> res;
+    for (int v = 0; v <= HALF_PATCH_SIZE; v++) {
+      int u = HALF_PATCH_SIZE;
+      while (u * u + v * v > HALF_PATCH_SIZE * HALF_PATCH_SIZE) u--;
+      res[v] = u;
+    }
+    return res;
+  }();
+  return umax;
+}
+
+/// Intensity centroid moments m_01 and m_10 of the circular patch around the
+/// corner pixel. All sums are exact integers.
+void computePatchMoments(const uint8_t* center, size_t pitch, int& m_01,
+                         int& m_10) {
+  const std::array<int, HALF_PATCH_SIZE + 1>& umax = getPatchUmax();
+
+#if defined(__AVX2__)
+  // Lane k of a row load holds u = k - HALF_PATCH_SIZE, the last lane (u = 16)
+  // is always masked out.
+  alignas(32) static const std::array<std::array<uint8_t, 32>,
+                                      HALF_PATCH_SIZE + 1>
+      row_masks = [&umax] {
+        std::array<std::array<uint8_t, 32>, HALF_PATCH_SIZE + 1> res;
+        for (int v = 0; v <= HALF_PATCH_SIZE; v++) {
+          for (int k = 0; k < 32; k++) {
+            const int u = k - HALF_PATCH_SIZE;
+            res[v][k] = std::abs(u) <= umax[v] ? 0xff : 0;
+          }
+        }
+        return res;
+      }();
+  alignas(32) static const std::array<int8_t, 32> u_weights = [] {
+    std::array<int8_t, 32> res;
+    for (int k = 0; k < 32; k++) {
+      res[k] = k < PATCH_SIZE ? k - HALF_PATCH_SIZE : 0;
+    }
+    return res;
+  }();
+
+  const __m256i weights =
+      _mm256_load_si256(reinterpret_cast<const __m256i*>(u_weights.data()));
+  const __m256i ones = _mm256_set1_epi16(1);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc_01 = zero;
+  __m256i acc_10 = zero;
+
+  for (int v = -HALF_PATCH_SIZE; v <= HALF_PATCH_SIZE; v++) {
+    const uint8_t* row = center + v * std::ptrdiff_t(pitch) - HALF_PATCH_SIZE;
+    const __m256i mask = _mm256_load_si256(
+        reinterpret_cast<const __m256i*>(row_masks[std::abs(v)].data()));
+    const __m256i pixels = _mm256_and_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row)), mask);
+
+    // sum of the row (4 partial sums in 64 bit lanes) weighted with v
+    const __m256i row_sum = _mm256_sad_epu8(pixels, zero);
+    acc_01 = _mm256_add_epi64(acc_01,
+                              _mm256_mul_epi32(row_sum, _mm256_set1_epi32(v)));
+
+    // sum of u * pixel, pairs fit into int16 since 2 * 255 * 15 < 2^15
+    acc_10 = _mm256_add_epi32(
+        acc_10, _mm256_madd_epi16(_mm256_maddubs_epi16(pixels, weights), ones));
+  }
+
+  alignas(32) int64_t sums_01[4];
+  alignas(32) int32_t sums_10[8];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(sums_01), acc_01);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(sums_10), acc_10);
+
+  m_01 = sums_01[0] + sums_01[1] + sums_01[2] + sums_01[3];
+  m_10 = 0;
+  for (int k = 0; k < 8; k++) m_10 += sums_10[k];
+#else
+  m_01 = 0;
+  m_10 = 0;
+  for (int v = -HALF_PATCH_SIZE; v <= HALF_PATCH_SIZE; v++) {
+    const uint8_t* row = center + v * std::ptrdiff_t(pitch);
+    const int w = umax[std::abs(v)];
+    int row_sum = 0;
+    for (int u = -w; u <= w; u++) {
+      row_sum += row[u];
+      m_10 += u * row[u];
+    }
+    m_01 += v * row_sum;
+  }
+#endif
+}
+
+void computeAngles(const pangolin::Image<uint8_t>& img_raw,
+                   KeypointsData& kd, bool rotate_features) {
+  kd.corner_angles.resize(kd.corners.size());
+
+  if (!rotate_features) {
+    std::fill(kd.corner_angles.begin(), kd.corner_angles.end(), 0.0);
+    return;
   }
+
+  // corners are independent, process them in batches in parallel
+  tbb::parallel_for(
+      tbb::blocked_range<size_t>(0, kd.corners.size(), 64),
+      [&](const tbb::blocked_range<size_t>& r) {
+        for (size_t i = r.begin(); i != r.end(); ++i) {
+          const Eigen::Vector2d& p = kd.corners[i];
+
+          const int cx = p[0];
+          const int cy = p[1];
+
+          int m_01, m_10;
+          computePatchMoments(img_raw.RowPtr(cy) + cx, img_raw.pitch, m_01,
+                              m_10);
+
+          // each corner has an intensity centroid, m_01 = m_10 = 0 only for
+          // a constant patch
+          kd.corner_angles[i] =
+              (m_01 != 0 || m_10 != 0) ? std::atan2(m_01, m_10) : 0.0;
+        }
+      });
 }
 
-void computeDescriptors(const pangolin::ManagedImage<uint8_t>& img_raw,
-                        KeypointsData& kd) {
+void computeDescriptorsExact(const pangolin::Image<uint8_t>& img_raw,
+                             KeypointsData& kd) {
   kd.corner_descriptors.resize(kd.corners.size());
 
   double pattern_31_x_a_double[256];
@@ -198,7 +534,7 @@ void computeDescriptors(const pangolin::ManagedImage<uint8_t>& img_raw,
   pattern_31_y_b_double[i] = static_cast<double>(pattern_31_y_b[i]);}
 
   for (size_t i=0;i<kd.corners.size();i++) {
-    std::bitset<256> descriptor;
+    Descriptor descriptor;
 
     const Eigen::Vector2d& p = kd.corners[i];
     const double angle = kd.corner_angles[i];
@@ -235,11 +571,7 @@ void computeDescriptors(const pangolin::ManagedImage<uint8_t>& img_raw,
             const int intensity_b = img_raw(x_b_prime, y_b_prime);
 
             // Compare the pixel intensities
-            if (intensity_a < intensity_b) {
-                descriptor[n] = 1;
-            } else {
-                descriptor[n] = 0;
-            }
+            descriptor.set(n, intensity_a < intensity_b);
             
     }
     kd.corner_descriptors[i] = descriptor;
@@ -247,83 +579,357 @@ void computeDescriptors(const pangolin::ManagedImage<uint8_t>& img_raw,
   }
 }
 
+/// Sampling pattern rotated to the center of every angle bin and rounded to
+/// integer pixel offsets relative to the corner.
+struct RotatedPattern {
+  int8_t x_a[NUM_ANGLE_BINS][256];
+  int8_t y_a[NUM_ANGLE_BINS][256];
+  int8_t x_b[NUM_ANGLE_BINS][256];
+  int8_t y_b[NUM_ANGLE_BINS][256];
+};
+
+// Round to the closest integer offset. Rotated coordinates that are within
+// numerical noise of .5 are resolved upwards, which is what round(cx + offset)
+// does for the exact rotation at positive image coordinates.
+int roundPatternOffset(double v) { return std::floor(v + 0.5 + 1e-9); }
+
+const RotatedPattern& getRotatedPattern() {
+  static const RotatedPattern rp = [] {
+    RotatedPattern res;
+    for (int bin = 0; bin < NUM_ANGLE_BINS; bin++) {
+      const double angle = bin * 2 * M_PI / NUM_ANGLE_BINS;
+      const double c = std::cos(angle);
+      const double s = std::sin(angle);
+      for (int n = 0; n < 256; n++) {
+        const double xa = pattern_31_x_a[n], ya = pattern_31_y_a[n];
+        const double xb = pattern_31_x_b[n], yb = pattern_31_y_b[n];
+        res.x_a[bin][n] = roundPatternOffset(c * xa - s * ya);
+        res.y_a[bin][n] = roundPatternOffset(s * xa + c * ya);
+        res.x_b[bin][n] = roundPatternOffset(c * xb - s * yb);
+        res.y_b[bin][n] = roundPatternOffset(s * xb + c * yb);
+      }
+    }
+    return res;
+  }();
+  return rp;
+}
+
+int angleToBin(double angle) {
+  int bin = std::lround(angle * NUM_ANGLE_BINS / (2 * M_PI)) % NUM_ANGLE_BINS;
+  return bin < 0 ? bin + NUM_ANGLE_BINS : bin;
+}
+
+/// Compute the 256 intensity tests of one corner. Offsets are byte offsets
+/// relative to the corner pixel for the first (a) and second (b) test point.
+/// The gather paths load 4 bytes per test point, which stays inside the image
+/// since corners keep EDGE_THRESHOLD distance to the border.
+void computeDescriptorWords(const uint8_t* center, const int32_t* offsets_a,
+                            const int32_t* offsets_b, uint64_t words[4]) {
+  for (int w = 0; w < 4; w++) {
+    const int32_t* oa = offsets_a + 64 * w;
+    const int32_t* ob = offsets_b + 64 * w;
+    uint64_t word = 0;
+#if defined(__AVX512F__)
+    const __m512i byte_mask = _mm512_set1_epi32(0xff);
+    for (int k = 0; k < 64; k += 16) {
+      const __m512i ia = _mm512_loadu_si512(oa + k);
+      const __m512i ib = _mm512_loadu_si512(ob + k);
+      const __m512i va =
+          _mm512_and_si512(_mm512_i32gather_epi32(ia, center, 1), byte_mask);
+      const __m512i vb =
+          _mm512_and_si512(_mm512_i32gather_epi32(ib, center, 1), byte_mask);
+      word |= uint64_t(_mm512_cmplt_epi32_mask(va, vb)) << k;
+    }
+#elif defined(__AVX2__)
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    const int* base = reinterpret_cast<const int*>(center);
+    for (int k = 0; k < 64; k += 8) {
+      const __m256i ia =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(oa + k));
+      const __m256i ib =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ob + k));
+      const __m256i va =
+          _mm256_and_si256(_mm256_i32gather_epi32(base, ia, 1), byte_mask);
+      const __m256i vb =
+          _mm256_and_si256(_mm256_i32gather_epi32(base, ib, 1), byte_mask);
+      const __m256i lt = _mm256_cmpgt_epi32(vb, va);
+      word |= uint64_t(uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(lt))))
+              << k;
+    }
+#else
+    for (int k = 0; k < 64; k++) {
+      word |= uint64_t(center[oa[k]] < center[ob[k]]) << k;
+    }
+#endif
+    words[w] = word;
+  }
+}
+
+void computeDescriptorsQuantized(const pangolin::Image<uint8_t>& img_raw,
+                                 KeypointsData& kd) {
+  kd.corner_descriptors.resize(kd.corners.size());
+
+  const RotatedPattern& rp = getRotatedPattern();
+
+  // byte offsets of the rotated pattern for the pitch of this image
+  std::vector<int32_t> offsets_a(NUM_ANGLE_BINS * 256);
+  std::vector<int32_t> offsets_b(NUM_ANGLE_BINS * 256);
+  const int32_t pitch = img_raw.pitch;
+  for (int bin = 0; bin < NUM_ANGLE_BINS; bin++) {
+    for (int n = 0; n < 256; n++) {
+      offsets_a[bin * 256 + n] = rp.y_a[bin][n] * pitch + rp.x_a[bin][n];
+      offsets_b[bin * 256 + n] = rp.y_b[bin][n] * pitch + rp.x_b[bin][n];
+    }
+  }
+
+  for (size_t i = 0; i < kd.corners.size(); i++) {
+    const Eigen::Vector2d& p = kd.corners[i];
+    const int cx = p[0];
+    const int cy = p[1];
+    const int bin = angleToBin(kd.corner_angles[i]);
+
+    computeDescriptorWords(img_raw.RowPtr(cy) + cx, &offsets_a[bin * 256],
+                           &offsets_b[bin * 256],
+                           kd.corner_descriptors[i].words);
+  }
+}
+
+void computeDescriptors(const pangolin::Image<uint8_t>& img_raw,
+                        KeypointsData& kd,
+                        DescriptorMethod method = DescriptorMethod::Exact) {
+  if (method == DescriptorMethod::Quantized) {
+    computeDescriptorsQuantized(img_raw, kd);
+  } else {
+    computeDescriptorsExact(img_raw, kd);
+  }
+}
 
 ///////////////////////////////////
 void detectKeypointsAndDescriptors(
-    const pangolin::ManagedImage<uint8_t>& img_raw, KeypointsData& kd,
-    int num_features, bool rotate_features) {
-  detectKeypoints(img_raw, kd, num_features);
+    const pangolin::Image<uint8_t>& img_raw, KeypointsData& kd,
+    int num_features, bool rotate_features,
+    DetectorMethod detector_method = DetectorMethod::GoodFeatures,
+    DescriptorMethod descriptor_method = DescriptorMethod::Exact) {
+  detectKeypoints(img_raw, kd, num_features, detector_method);
   computeAngles(img_raw, kd, rotate_features);
-  computeDescriptors(img_raw, kd);
+  computeDescriptors(img_raw, kd, descriptor_method);
 }/////////////////////////////////
 
 
 
 
 
-void matchDescriptors(const std::vector<std::bitset<256>>& corner_descriptors_1,
-                      const std::vector<std::bitset<256>>& corner_descriptors_2,
-                      std::vector<std::pair<int, int>>& matches, int threshold,
-                      double dist_2_best) {
-  matches.clear();
-// Match from P to Q
-  std::vector<std::pair<int, int>> matches_p_to_q;
-  for (size_t i = 0; i < corner_descriptors_1.size(); ++i) {
-    int best_idx = -1;
-    int best_dist = INT_MAX;
-    int second_best_dist = INT_MAX;
-
-    for (size_t j = 0; j < corner_descriptors_2.size(); ++j) {
-      int dist = (corner_descriptors_1[i] ^ corner_descriptors_2[j]).count();
-
-      if (dist < best_dist) {
-        second_best_dist = best_dist;
-        best_dist = dist;
-        best_idx = j;
-      } else if (dist < second_best_dist) {
-        second_best_dist = dist;
-      }
+/// rows and columns of the descriptor distance matrix processed per tile
+const int MATCH_TILE_ROWS = 64;
+const int MATCH_TILE_COLS = 256;
+
+/// Best and second best distance in a row or column of the distance matrix.
+/// On equal distances the first index wins, and the second best distance is
+/// the second smallest value (it can be equal to the best one).
+struct MatchCandidate {
+  int best_dist = std::numeric_limits<int>::max();
+  int second_best_dist = std::numeric_limits<int>::max();
+  int best_idx = -1;
+
+  void update(int dist, int idx) {
+    if (dist < best_dist) {
+      second_best_dist = best_dist;
+      best_dist = dist;
+      best_idx = idx;
+    } else if (dist < second_best_dist) {
+      second_best_dist = dist;
     }
+  }
 
-    if (best_dist < threshold && second_best_dist >= best_dist * dist_2_best) {
-      matches_p_to_q.emplace_back(i, best_idx);
+  /// merge with the candidate of a range of later indices
+  void merge(const MatchCandidate& later) {
+    if (later.best_dist < best_dist) {
+      second_best_dist = std::min(best_dist, later.second_best_dist);
+      best_dist = later.best_dist;
+      best_idx = later.best_idx;
+    } else {
+      second_best_dist = std::min(second_best_dist, later.best_dist);
     }
   }
 
-  // Match from Q to P
-  std::vector<std::pair<int, int>> matches_q_to_p;
-  for (size_t j = 0; j < corner_descriptors_2.size(); ++j) {
-    int best_idx = -1;
-    int best_dist = INT_MAX;
-    int second_best_dist = INT_MAX;
+  bool accepted(int threshold, double dist_2_best) const {
+    return best_dist < threshold && second_best_dist >= best_dist * dist_2_best;
+  }
+};
+
+/// MatchCandidate for a range of columns stored as separate arrays, so that
+/// one row of distances updates all of them in a vectorizable loop.
+struct ColumnMatchCandidates {
+  std::vector<int> best_dist;
+  std::vector<int> second_best_dist;
+  std::vector<int> best_idx;
+
+  void resize(int n) {
+    best_dist.assign(n, std::numeric_limits<int>::max());
+    second_best_dist.assign(n, std::numeric_limits<int>::max());
+    best_idx.assign(n, -1);
+  }
 
-    for (size_t i = 0; i < corner_descriptors_1.size(); ++i) {
-      int dist = (corner_descriptors_2[j] ^ corner_descriptors_1[i]).count();
+  /// same as MatchCandidate::update for the distances of row idx to the
+  /// columns j0, ..., j0 + n - 1, written without branches
+  void update(const int* dists, int j0, int n, int idx) {
+    int* best = best_dist.data() + j0;
+    int* second = second_best_dist.data() + j0;
+    int* bidx = best_idx.data() + j0;
+    for (int k = 0; k < n; k++) {
+      const int d = dists[k];
+      const bool better = d < best[k];
+      second[k] = std::min(second[k], std::max(best[k], d));
+      bidx[k] = better ? idx : bidx[k];
+      best[k] = better ? d : best[k];
+    }
+  }
 
-      if (dist < best_dist) {
-        second_best_dist = best_dist;
-        best_dist = dist;
-        best_idx = i;
-      } else if (dist < second_best_dist) {
-        second_best_dist = dist;
+  MatchCandidate operator[](int j) const {
+    MatchCandidate c;
+    c.best_dist = best_dist[j];
+    c.second_best_dist = second_best_dist[j];
+    c.best_idx = best_idx[j];
+    return c;
+  }
+};
+
+/// MatchCandidate of a row of n distances to the columns j0, ..., j0 + n - 1.
+/// 16 interleaved partial candidates are updated without branches and merged
+/// at the end, which gives the same result as updating sequentially.
+MatchCandidate rowMatchCandidate(const int* dists, int j0, int n) {
+  const int lanes = 16;
+  int best[lanes], second[lanes], idx[lanes];
+  for (int l = 0; l < lanes; l++) {
+    best[l] = second[l] = std::numeric_limits<int>::max();
+    idx[l] = std::numeric_limits<int>::max();
+  }
 
-      }
+  int k = 0;
+  for (; k + lanes <= n; k += lanes) {
+    for (int l = 0; l < lanes; l++) {
+      const int d = dists[k + l];
+      const bool better = d < best[l];
+      second[l] = std::min(second[l], std::max(best[l], d));
+      idx[l] = better ? j0 + k + l : idx[l];
+      best[l] = better ? d : best[l];
     }
+  }
 
-    if (best_dist < threshold && second_best_dist >= best_dist * dist_2_best) {
-      matches_q_to_p.emplace_back(best_idx, j);
-    }
+  // lane with the smallest distance and on ties the smallest index wins
+  int w = 0;
+  for (int l = 1; l < lanes; l++) {
+    if (best[l] < best[w] || (best[l] == best[w] && idx[l] < idx[w])) w = l;
   }
 
-  // Cross-check to ensure match consistency
-  for (const auto& match_pq : matches_p_to_q) {
-    for (const auto& match_qp : matches_q_to_p) {
-      if (match_pq.first == match_qp.first && match_pq.second == match_qp.second) {
-        matches.emplace_back(match_pq.first, match_pq.second);
-        break;
+  MatchCandidate res;
+  if (best[w] != std::numeric_limits<int>::max()) {
+    res.best_dist = best[w];
+    res.best_idx = idx[w];
+    for (int l = 0; l < lanes; l++) {
+      res.second_best_dist = std::min(res.second_best_dist, second[l]);
+      if (l != w) {
+        res.second_best_dist = std::min(res.second_best_dist, best[l]);
       }
     }
   }
- }
+
+  for (; k < n; k++) res.update(dists[k], j0 + k);
+  return res;
+}
+
+/// Hamming distances between one descriptor and n consecutive descriptors.
+void computeHammingDistances(const Descriptor& query, const Descriptor* descs,
+                             int n, int* dists) {
+  int j = 0;
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512F__)
+  // 8 descriptors per step; two descriptors fit into one register
+  const __m512i q = _mm512_broadcast_i64x4(
+      _mm256_load_si256(reinterpret_cast<const __m256i*>(query.words)));
+  const __m256i order = _mm256_setr_epi32(0, 2, 1, 3, 4, 6, 5, 7);
+  for (; j + 8 <= n; j += 8) {
+    const uint64_t* p = descs[j].words;
+    const __m512i a =
+        _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(p)));
+    const __m512i b =
+        _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(p + 8)));
+    const __m512i c =
+        _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(p + 16)));
+    const __m512i d =
+        _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(p + 24)));
+    // add neighbouring words, then the two halves of every descriptor
+    const __m512i ab = _mm512_add_epi64(_mm512_unpacklo_epi64(a, b),
+                                        _mm512_unpackhi_epi64(a, b));
+    const __m512i cd = _mm512_add_epi64(_mm512_unpacklo_epi64(c, d),
+                                        _mm512_unpackhi_epi64(c, d));
+    const __m512i sum = _mm512_add_epi64(
+        _mm512_shuffle_i64x2(ab, cd, _MM_SHUFFLE(2, 0, 2, 0)),
+        _mm512_shuffle_i64x2(ab, cd, _MM_SHUFFLE(3, 1, 3, 1)));
+    // sum holds descriptors j, j+2, j+1, j+3, j+4, j+6, j+5, j+7
+    const __m256i res =
+        _mm256_permutevar8x32_epi32(_mm512_cvtepi64_epi32(sum), order);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dists + j), res);
+  }
+#endif
+  for (; j < n; j++) dists[j] = hammingDistance(query, descs[j]);
+}
+
+/// Mutual best matches between two sets of descriptors that pass the
+/// threshold and the ratio test in both directions. The distance matrix is
+/// computed once, tile by tile. Blocks of rows are processed in parallel and
+/// keep their own column candidates, which are merged in order afterwards.
+void matchDescriptors(const std::vector<Descriptor>& corner_descriptors_1,
+                      const std::vector<Descriptor>& corner_descriptors_2,
+                      std::vector<std::pair<int, int>>& matches, int threshold,
+                      double dist_2_best) {
+  matches.clear();
+
+  const int n1 = corner_descriptors_1.size();
+  const int n2 = corner_descriptors_2.size();
+  if (n1 == 0 || n2 == 0) return;
+
+  const int num_blocks = (n1 + MATCH_TILE_ROWS - 1) / MATCH_TILE_ROWS;
+
+  std::vector<MatchCandidate> row_candidates(n1);
+  std::vector<ColumnMatchCandidates> block_col_candidates(num_blocks);
+
+  tbb::parallel_for(
+      tbb::blocked_range<int>(0, num_blocks),
+      [&](const tbb::blocked_range<int>& r) {
+        int dists[MATCH_TILE_COLS];
+        for (int b = r.begin(); b != r.end(); ++b) {
+          const int i0 = b * MATCH_TILE_ROWS;
+          const int i1 = std::min(i0 + MATCH_TILE_ROWS, n1);
+          ColumnMatchCandidates& col_candidates = block_col_candidates[b];
+          col_candidates.resize(n2);
+
+          for (int j0 = 0; j0 < n2; j0 += MATCH_TILE_COLS) {
+            const int nj = std::min(MATCH_TILE_COLS, n2 - j0);
+            for (int i = i0; i < i1; i++) {
+              computeHammingDistances(corner_descriptors_1[i],
+                                      &corner_descriptors_2[j0], nj, dists);
+              row_candidates[i].merge(rowMatchCandidate(dists, j0, nj));
+              col_candidates.update(dists, j0, nj, i);
+            }
+          }
+        }
+      });
+
+  // best match in the first set for every descriptor of the second set
+  std::vector<int> col_best(n2, -1);
+  for (int j = 0; j < n2; j++) {
+    MatchCandidate col = block_col_candidates[0][j];
+    for (int b = 1; b < num_blocks; b++) col.merge(block_col_candidates[b][j]);
+    if (col.accepted(threshold, dist_2_best)) col_best[j] = col.best_idx;
+  }
+
+  // cross-check through the index arrays
+  for (int i = 0; i < n1; i++) {
+    const MatchCandidate& row = row_candidates[i];
+    if (row.accepted(threshold, dist_2_best) && col_best[row.best_idx] == i) {
+      matches.emplace_back(i, row.best_idx);
+    }
+  }
+}
 
 }  // namespace visnav
@@ -0,0 +1,333 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <visnav/calibration.h>
+#include <visnav/common_types.h>
+#include <visnav/map_utils.h>
+#include <visnav/timing.h>
+
+namespace visnav {
+
+/// Changes of the tracker's map made by one keyframe. The optimizer applies
+/// them in the order the tracker made them: the new cameras and their
+/// keypoints, the new observations of existing landmarks and the new
+/// landmarks, and finally the removal of the oldest keyframes, which also
+/// drops landmarks that are left without observations.
+struct MapDelta {
+  Cameras new_cameras;
+
+  /// keypoints of the new cameras; only the corners are used
+  std::vector<std::pair<FrameCamId, KeypointsData>> new_corners;
+
+  /// observations added to existing landmarks
+  std::vector<std::tuple<TrackId, FrameCamId, FeatureId>> new_observations;
+
+  /// new landmarks with their observations
+  Landmarks new_landmarks;
+
+  /// keyframes removed from the map
+  std::vector<FrameId> removed_frames;
+
+  /// oldest keyframe in the map; its cameras are fixed to fix the gauge
+  FrameId fixed_frame = 0;
+
+  BundleAdjustmentOptions options;
+
+  /// with IMU: the keyframe states in the window and the integrated
+  /// measurements ending at them
+  bool imu = false;
+  Eigen::aligned_map<Timestamp, PoseVelState<double>> frame_states;
+  Eigen::aligned_map<Timestamp, IntegratedImuMeasurement<double>>
+      imu_measurements;
+};
+
+/// Optimized parameters of the map as published by the MapOptimizer.
+struct OptimizedMap {
+  /// increases with every published result; 0 if there is none yet
+  uint64_t version = 0;
+
+  /// number of deltas applied to the map before it was optimized
+  size_t num_deltas = 0;
+
+  std::vector<std::pair<FrameCamId, Sophus::SE3d>,
+              Eigen::aligned_allocator<std::pair<FrameCamId, Sophus::SE3d>>>
+      camera_poses;
+  std::vector<std::pair<TrackId, Eigen::Vector3d>> landmark_positions;
+  Eigen::aligned_vector<AbstractCamera<double>::VecN> intrinsics;
+  Eigen::aligned_map<Timestamp, PoseVelState<double>> frame_states;
+};
+
+/// Long-lived bundle adjustment worker. It keeps its own copy of the map,
+/// which the tracker updates by sending the changes of every keyframe as a
+/// MapDelta instead of copying the whole map. Deltas that arrive while an
+/// optimization runs are applied together before the next one.
+///
+/// Results are published through a double buffer: the worker fills the back
+/// buffer without locking and swaps it in under a short lock, and the tracker
+/// reads the front buffer under the same lock. The tracker only takes the
+/// optimized poses, positions and intrinsics from the result, so observations
+/// and landmarks it added in the meantime are kept.
+class MapOptimizer {
+ public:
+  /// Start the worker with a copy of calib; timestamps are needed to match
+  /// frames to IMU states.
+  MapOptimizer(const Calibration& calib, std::vector<Timestamp> timestamps)
+      : calib_(calib), timestamps_(std::move(timestamps)) {
+    // the intrinsics are optimized in place, so they must not be shared with
+    // the tracker
+    for (auto& cam : calib_.intrinsics) {
+      auto copy = AbstractCamera<double>::from_data(cam->name(), cam->data());
+      copy->width() = cam->width();
+      copy->height() = cam->height();
+      cam = copy;
+    }
+
+    thread_ = std::thread([this] { run(); });
+  }
+
+  ~MapOptimizer() { stop(); }
+
+  MapOptimizer(const MapOptimizer&) = delete;
+  MapOptimizer& operator=(const MapOptimizer&) = delete;
+
+  /// Queue the changes of a keyframe for the next optimization.
+  void push(MapDelta&& delta) {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      queue_.push_back(std::move(delta));
+    }
+    queue_cv_.notify_one();
+  }
+
+  /// number of deltas that are not yet applied to the worker's map
+  size_t numQueued() const {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    return queue_.size();
+  }
+
+  /// version of the newest published result
+  uint64_t version() const { return version_.load(std::memory_order_acquire); }
+
+  /// If a result newer than version is published, call f with it under the
+  /// publishing lock, set version to its version and return true.
+  template <class F>
+  bool consume(uint64_t& version, F&& f) {
+    if (this->version() <= version) return false;
+
+    std::lock_guard<std::mutex> lock(publish_mutex_);
+    const OptimizedMap& map = buffers_[front_];
+    f(map);
+    version = map.version;
+    return true;
+  }
+
+  /// Finish the running optimization, drop queued deltas and end the worker.
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      if (stop_) return;
+      stop_ = true;
+    }
+    queue_cv_.notify_one();
+    thread_.join();
+  }
+
+  /// durations of the optimizations; only valid after stop
+  const LatencyStats& latencies() const { return latencies_; }
+
+  /// number of deltas applied; only valid after stop
+  size_t numDeltas() const { return num_deltas_; }
+
+ private:
+  void run() {
+    while (true) {
+      std::deque<MapDelta> deltas;
+      {
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        queue_cv_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+        if (stop_) return;
+        deltas.swap(queue_);
+      }
+
+      for (const MapDelta& delta : deltas) apply(delta);
+
+      Timer timer;
+      optimize(deltas.back());
+      latencies_.add(timer.elapsed());
+
+      publish(deltas.size());
+    }
+  }
+
+  void apply(const MapDelta& delta) {
+    for (const auto& kv : delta.new_cameras) cameras_[kv.first] = kv.second;
+
+    for (const auto& kv : delta.new_corners) {
+      corners_[kv.first].corners = kv.second.corners;
+    }
+
+    for (const auto& [track_id, fcid, feature_id] : delta.new_observations) {
+      auto it = landmarks_.find(track_id);
+      if (it == landmarks_.end()) continue;
+      if (it->second.obs.emplace(fcid, feature_id).second) {
+        frame_landmarks_.add(fcid, track_id);
+      }
+    }
+
+    for (const auto& kv : delta.new_landmarks) {
+      if (!landmarks_.insert(kv).second) continue;
+      for (const auto& obs : kv.second.obs) {
+        frame_landmarks_.add(obs.first, kv.first);
+      }
+    }
+
+    for (const FrameId frame_id : delta.removed_frames) {
+      for (auto it = cameras_.lower_bound(FrameCamId(frame_id, 0));
+           it != cameras_.end() && it->first.frame_id == frame_id;) {
+        const FrameCamId fcid = it->first;
+        corners_.erase(fcid);
+        it = cameras_.erase(it);
+
+        for (const TrackId track_id : frame_landmarks_.take(fcid)) {
+          auto lm_it = landmarks_.find(track_id);
+          if (lm_it == landmarks_.end()) continue;
+
+          lm_it->second.obs.erase(fcid);
+          if (lm_it->second.obs.empty()) landmarks_.erase(lm_it);
+        }
+      }
+    }
+
+    if (delta.imu) {
+      states_ = delta.frame_states;
+
+      // keep only the measurements between the states in the window
+      for (const auto& kv : delta.imu_measurements) {
+        imu_measurements_.erase(kv.first);
+        imu_measurements_.emplace(kv);
+      }
+      if (!states_.empty()) {
+        imu_measurements_.erase(
+            imu_measurements_.begin(),
+            imu_measurements_.lower_bound(states_.begin()->first));
+      }
+    }
+
+    num_deltas_++;
+  }
+
+  void optimize(const MapDelta& delta) {
+    std::set<FrameCamId> fixed_cameras;
+    for (size_t i = 0; i < calib_.intrinsics.size(); i++) {
+      fixed_cameras.emplace(delta.fixed_frame, i);
+    }
+
+    if (delta.imu) {
+      Imu_Proj_bundle_adjustment(corners_, delta.options, fixed_cameras,
+                                 calib_, cameras_, landmarks_, states_,
+                                 imu_measurements_, timestamps_);
+    } else {
+      Proj_bundle_adjustment(corners_, delta.options, fixed_cameras, calib_,
+                             cameras_, landmarks_);
+    }
+  }
+
+  void publish(size_t num_deltas) {
+    // only the worker swaps the buffers, so it can read front_ unlocked
+    OptimizedMap& map = buffers_[1 - front_];
+
+    map.num_deltas = num_deltas;
+
+    map.camera_poses.clear();
+    for (const auto& kv : cameras_) {
+      map.camera_poses.emplace_back(kv.first, kv.second.T_w_c);
+    }
+
+    map.landmark_positions.clear();
+    for (const auto& kv : landmarks_) {
+      map.landmark_positions.emplace_back(kv.first, kv.second.p);
+    }
+
+    map.intrinsics.clear();
+    for (const auto& cam : calib_.intrinsics) {
+      map.intrinsics.push_back(cam->getParam());
+    }
+
+    map.frame_states = states_;
+
+    std::lock_guard<std::mutex> lock(publish_mutex_);
+    map.version = version_.load(std::memory_order_relaxed) + 1;
+    front_ = 1 - front_;
+    version_.store(map.version, std::memory_order_release);
+  }
+
+  // worker's copy of the map
+  Calibration calib_;
+  std::vector<Timestamp> timestamps_;
+  Cameras cameras_;
+  Landmarks landmarks_;
+  FrameLandmarkIndex frame_landmarks_;
+  Corners corners_;
+  Eigen::aligned_map<Timestamp, PoseVelState<double>> states_;
+  Eigen::aligned_map<Timestamp, IntegratedImuMeasurement<double>>
+      imu_measurements_;
+
+  mutable std::mutex queue_mutex_;
+  std::condition_variable queue_cv_;
+  std::deque<MapDelta> queue_;
+  bool stop_ = false;
+
+  std::mutex publish_mutex_;
+  OptimizedMap buffers_[2];
+  int front_ = 0;
+  std::atomic<uint64_t> version_{0};
+
+  LatencyStats latencies_;
+  size_t num_deltas_ = 0;
+
+  std::thread thread_;
+};
+
+}  // namespace visnav
@@ -33,6 +33,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #pragma once
 
 #include <fstream>
+#include <functional>
+#include <limits>
 #include <thread>
 
 #include <ceres/ceres.h>
@@ -331,6 +333,90 @@ void localize_camera(
       T_w_c = Sophus::SE3d(non_linear_transfomation.block<3,3>(0,0), non_linear_transfomation.block<3,1>(0,3));
 }
 
+// Compute reprojections for all inlier and outlier observations of landmarks
+// in the images of cameras. The observations are grouped by image and every
+// group is projected in one batch. Observations in images without a camera are
+// skipped. on_inlier_projection, if given, is called on every new inlier
+// projection before it is stored, e.g. to set outlier flags.
+void compute_image_projections(
+    const Landmarks& landmarks, const Cameras& cameras,
+    const Calibration& calib_cam, const Corners& feature_corners,
+    ImageProjections& image_projections,
+    const std::function<void(const FrameCamId&, const ProjectedLandmarkPtr&)>&
+        on_inlier_projection = nullptr) {
+  image_projections.clear();
+
+  struct ImageObservations {
+    std::vector<TrackId> track_ids;
+    std::vector<FeatureId> feature_ids;
+    std::vector<bool> outlier;
+    std::vector<Eigen::Vector3d, Eigen::aligned_allocator<Eigen::Vector3d>>
+        points;
+
+    void add(TrackId track_id, FeatureId feature_id, bool is_outlier,
+             const Eigen::Vector3d& p) {
+      track_ids.push_back(track_id);
+      feature_ids.push_back(feature_id);
+      outlier.push_back(is_outlier);
+      points.push_back(p);
+    }
+  };
+
+  std::map<FrameCamId, ImageObservations> image_observations;
+  for (const auto& kv_lm : landmarks) {
+    for (const auto& kv_obs : kv_lm.second.obs) {
+      if (!cameras.count(kv_obs.first)) continue;
+      image_observations[kv_obs.first].add(kv_lm.first, kv_obs.second, false,
+                                           kv_lm.second.p);
+    }
+    for (const auto& kv_obs : kv_lm.second.outlier_obs) {
+      if (!cameras.count(kv_obs.first)) continue;
+      image_observations[kv_obs.first].add(kv_lm.first, kv_obs.second, true,
+                                           kv_lm.second.p);
+    }
+  }
+
+  Eigen::Matrix<double, Eigen::Dynamic, 3> p_w, p_c;
+  Eigen::Matrix<double, Eigen::Dynamic, 2> p_2d;
+  std::vector<int> indices;
+
+  for (const auto& [fcid, io] : image_observations) {
+    const size_t num_obs = io.points.size();
+    p_w.resize(num_obs, 3);
+    for (size_t i = 0; i < num_obs; i++) p_w.row(i) = io.points[i].transpose();
+
+    // keep all points, also the ones behind the camera or outside the image;
+    // row k of the result belongs to observation indices[k] regardless
+    const size_t num_projected =
+        calib_cam.intrinsics.at(fcid.cam_id)
+            ->projectWorldBatch(cameras.at(fcid).T_w_c, p_w,
+                                std::numeric_limits<double>::lowest(), false,
+                                p_c, p_2d, indices);
+
+    const KeypointsData& kd = feature_corners.at(fcid);
+    ImageProjection& ip = image_projections[fcid];
+
+    for (size_t k = 0; k < num_projected; k++) {
+      const size_t i = indices[k];
+
+      ProjectedLandmarkPtr proj_lm(new ProjectedLandmark);
+      proj_lm->track_id = io.track_ids[i];
+      proj_lm->point_measured = kd.corners[io.feature_ids[i]];
+      proj_lm->point_reprojected = p_2d.row(k).transpose();
+      proj_lm->point_3d_c = p_c.row(k).transpose();
+      proj_lm->reprojection_error =
+          (proj_lm->point_measured - proj_lm->point_reprojected).norm();
+
+      if (io.outlier[i]) {
+        ip.outlier_obs.push_back(proj_lm);
+      } else {
+        if (on_inlier_projection) on_inlier_projection(fcid, proj_lm);
+        ip.obs.push_back(proj_lm);
+      }
+    }
+  }
+}
+
 struct BundleAdjustmentOptions {
   /// 0: silent, 1: ceres brief report (one line), 2: ceres full report
   int verbosity_level = 1;
@@ -349,6 +435,10 @@ struct BundleAdjustmentOptions {
 
   /// imu optimization weight
   double imu_optimization_weight = 0.4;
+
+  /// use the hand-derived reprojection Jacobians instead of automatic
+  /// differentiation
+  bool analytic_jacobians = true;
 };
 
 // Run bundle adjustment to optimize cameras, points, and optionally intrinsics
@@ -377,9 +467,9 @@ for (auto& [track_id, landmark] : landmarks) {
       std::string cam_model = calib_cam.intrinsics[fcid.cam_id]->name();
 
       // set up residuals blocks
-      BundleAdjustmentReprojectionCostFunctor* c = new BundleAdjustmentReprojectionCostFunctor(p_2d, cam_model);
-      ceres::CostFunction* cost_function = new ceres::AutoDiffCostFunction<
-      BundleAdjustmentReprojectionCostFunctor, 2, 7, 3, 8>(c);
+      ceres::CostFunction* cost_function =
+          createBundleAdjustmentReprojectionCostFunction(
+              p_2d, cam_model, options.analytic_jacobians);
 
       // add residuals blocks
       problem.AddResidualBlock(cost_function, 
@@ -460,12 +550,10 @@ void Imu_Proj_bundle_adjustment(
     for (auto& [fcid, feature_id] : landmark.obs) {
 
       const auto& p_2d = feature_corners.at(fcid).corners[feature_id];
-      BundleAdjustmentReprojectionCostFunctor* c =
-          new BundleAdjustmentReprojectionCostFunctor(
-              p_2d, calib_cam.intrinsics[fcid.cam_id]->name());
-      ceres::CostFunction* cost_function = new ceres::AutoDiffCostFunction<
-          BundleAdjustmentReprojectionCostFunctor, 2,
-          Sophus::SE3d::num_parameters, 3, 8>(c);
+      ceres::CostFunction* cost_function =
+          createBundleAdjustmentReprojectionCostFunction(
+              p_2d, calib_cam.intrinsics[fcid.cam_id]->name(),
+              options.analytic_jacobians);
 
       if (cameras.count(fcid)) { 
           // 'cameras list' has frame&camera id then optimize camera location
@@ -45,6 +45,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <visnav/camera_models.h>
 #include <visnav/common_types.h>
+#include <visnav/keypoints.h>
 
 namespace visnav {
 
@@ -91,6 +92,119 @@ void findInliersEssential(const KeypointsData& kd1, const KeypointsData& kd2,
    }
  }
 
+/// Match descriptors of a calibrated stereo pair, comparing every feature of
+/// the first image only with features of the second image that fulfill the
+/// epipolar constraint |p0^T E p1| <= epipolar_error_threshold (the same test
+/// as in findInliersEssential). Threshold, ratio test and mutual check are the
+/// ones of matchDescriptors, evaluated among these candidates.
+///
+/// With t the baseline direction and p1 rotated into the first camera,
+/// |p0^T E p1| = |t x p0| |t x p1| |sin(phi0 - phi1)|, where phi is the angle
+/// of the epipolar plane through t. Features of the second image are sorted
+/// by that angle, so the candidates of a feature are a small angular range
+/// found by binary search.
+void matchDescriptorsEpipolar(
+    const KeypointsData& kd1, const KeypointsData& kd2,
+    const std::shared_ptr<AbstractCamera<double>>& cam1,
+    const std::shared_ptr<AbstractCamera<double>>& cam2,
+    const Sophus::SE3d& T_0_1, int threshold, double dist_2_best,
+    double epipolar_error_threshold, MatchData& md) {
+  md.matches.clear();
+
+  const int n1 = kd1.corners.size();
+  const int n2 = kd2.corners.size();
+  if (n1 == 0 || n2 == 0) return;
+
+  Eigen::Matrix3d E;
+  computeEssential(T_0_1, E);
+
+  const Eigen::Vector3d t = T_0_1.translation().normalized();
+  const Eigen::Matrix3d R = T_0_1.rotationMatrix();
+  const Eigen::Vector3d e1 = t.unitOrthogonal();
+  const Eigen::Vector3d e2 = t.cross(e1);
+
+  // angle of the epipolar plane containing v in [0, pi) and |t x v|
+  auto plane_angle = [&](const Eigen::Vector3d& v, double& sin_norm) {
+    const Eigen::Vector3d n = t.cross(v);
+    sin_norm = n.norm();
+    double phi = std::atan2(n.dot(e2), n.dot(e1));
+    if (phi < 0) phi += M_PI;
+    return phi >= M_PI ? phi - M_PI : phi;
+  };
+
+  std::vector<Eigen::Vector3d, Eigen::aligned_allocator<Eigen::Vector3d>> p1(
+      n2);
+  std::vector<std::pair<double, int>> sorted;  // (plane angle, index)
+  std::vector<int> near_epipole;  // always checked, their angle is unstable
+  sorted.reserve(n2);
+  double min_sin_norm = std::numeric_limits<double>::max();
+  for (int j = 0; j < n2; j++) {
+    p1[j] = cam2->unproject(kd2.corners[j]);
+    double sin_norm;
+    const double phi = plane_angle(R * p1[j], sin_norm);
+    if (sin_norm < 1e-6) {
+      near_epipole.push_back(j);
+    } else {
+      sorted.emplace_back(phi, j);
+      min_sin_norm = std::min(min_sin_norm, sin_norm);
+    }
+  }
+  std::sort(sorted.begin(), sorted.end());
+
+  auto add_range = [&](double lo, double hi, std::vector<int>& candidates) {
+    auto it = std::lower_bound(sorted.begin(), sorted.end(),
+                               std::make_pair(lo, -1));
+    for (; it != sorted.end() && it->first <= hi; ++it) {
+      candidates.push_back(it->second);
+    }
+  };
+
+  std::vector<MatchCandidate> row_candidates(n1), col_candidates(n2);
+  std::vector<int> candidates;
+  candidates.reserve(n2);
+
+  for (int i = 0; i < n1; i++) {
+    const Eigen::Vector3d p0 = cam1->unproject(kd1.corners[i]);
+    double sin_norm;
+    const double phi = plane_angle(p0, sin_norm);
+
+    candidates.clear();
+    const double max_sin = epipolar_error_threshold / (sin_norm * min_sin_norm);
+    if (sorted.empty() || !(max_sin < 0.5)) {
+      for (const auto& kv : sorted) candidates.push_back(kv.second);
+    } else {
+      // small margin, the exact test below decides
+      const double delta = 1.01 * std::asin(max_sin) + 1e-9;
+      const double lo = phi - delta, hi = phi + delta;
+      add_range(std::max(lo, 0.0), std::min(hi, M_PI), candidates);
+      if (lo < 0) add_range(lo + M_PI, M_PI, candidates);
+      if (hi >= M_PI) add_range(0.0, hi - M_PI, candidates);
+    }
+    candidates.insert(candidates.end(), near_epipole.begin(),
+                      near_epipole.end());
+    std::sort(candidates.begin(), candidates.end());
+
+    for (const int j : candidates) {
+      const double epipolar_error = p0.transpose() * E * p1[j];
+      if (std::abs(epipolar_error) > epipolar_error_threshold) continue;
+
+      const int dist = hammingDistance(kd1.corner_descriptors[i],
+                                       kd2.corner_descriptors[j]);
+      row_candidates[i].update(dist, j);
+      col_candidates[j].update(dist, i);
+    }
+  }
+
+  for (int i = 0; i < n1; i++) {
+    const MatchCandidate& row = row_candidates[i];
+    if (!row.accepted(threshold, dist_2_best)) continue;
+    const MatchCandidate& col = col_candidates[row.best_idx];
+    if (col.accepted(threshold, dist_2_best) && col.best_idx == i) {
+      md.matches.emplace_back(i, row.best_idx);
+    }
+  }
+}
+
 void findInliersRansac(const KeypointsData& kd1, const KeypointsData& kd2,
                        const std::shared_ptr<AbstractCamera<double>>& cam1,
                        const std::shared_ptr<AbstractCamera<double>>& cam2,
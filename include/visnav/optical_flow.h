@@ -0,0 +1,260 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include <Eigen/Dense>
+#include <pangolin/image/managed_image.h>
+
+#include <visnav/common_types.h>
+
+namespace visnav {
+
+/// number of pyramid levels used for tracking (level 0 is the full image)
+const int OPTICAL_FLOW_LEVELS = 3;
+/// the tracked patch covers [-OPTICAL_FLOW_HALF_PATCH, OPTICAL_FLOW_HALF_PATCH)
+/// in both directions around the point
+const int OPTICAL_FLOW_HALF_PATCH = 4;
+const int OPTICAL_FLOW_PATCH_AREA =
+    4 * OPTICAL_FLOW_HALF_PATCH * OPTICAL_FLOW_HALF_PATCH;
+/// maximum number of Gauss-Newton iterations per pyramid level
+const int OPTICAL_FLOW_MAX_ITERATIONS = 10;
+/// maximum distance in pixels between a point and the result of tracking it
+/// forward and back again
+const double OPTICAL_FLOW_MAX_RECOVERED_DIST = 0.5;
+
+typedef std::vector<pangolin::ManagedImage<float>> ImagePyramid;
+
+typedef Eigen::Matrix<float, OPTICAL_FLOW_PATCH_AREA, 1> PatchVector;
+
+/// Build an image pyramid by repeated 2x2 averaging. Level 0 is the input
+/// image converted to float.
+void buildImagePyramid(const pangolin::Image<uint8_t>& img, int num_levels,
+                       ImagePyramid& pyramid) {
+  pyramid.resize(num_levels);
+
+  pyramid[0].Reinitialise(img.w, img.h);
+  for (size_t y = 0; y < img.h; y++) {
+    const uint8_t* src = img.RowPtr(y);
+    float* dst = pyramid[0].RowPtr(y);
+    for (size_t x = 0; x < img.w; x++) dst[x] = src[x];
+  }
+
+  for (int l = 1; l < num_levels; l++) {
+    const pangolin::ManagedImage<float>& prev = pyramid[l - 1];
+    pangolin::ManagedImage<float>& curr = pyramid[l];
+    curr.Reinitialise(prev.w / 2, prev.h / 2);
+
+    for (size_t y = 0; y < curr.h; y++) {
+      const float* src0 = prev.RowPtr(2 * y);
+      const float* src1 = prev.RowPtr(2 * y + 1);
+      float* dst = curr.RowPtr(y);
+      for (size_t x = 0; x < curr.w; x++) {
+        dst[x] = 0.25f * (src0[2 * x] + src0[2 * x + 1] + src1[2 * x] +
+                          src1[2 * x + 1]);
+      }
+    }
+  }
+}
+
+/// Check that the patch around pos (including the one pixel border needed for
+/// gradients) lies inside the image.
+inline bool patchInImage(const pangolin::Image<float>& img,
+                         const Eigen::Vector2f& pos) {
+  const float border = OPTICAL_FLOW_HALF_PATCH + 1;
+  return pos.x() >= border && pos.y() >= border &&
+         pos.x() < img.w - border - 1 && pos.y() < img.h - border - 1;
+}
+
+/// Bilinearly sample the size x size block of img whose top left corner is at
+/// pos into block (row major). All samples share the same interpolation
+/// weights, so the block is interpolated row by row. The caller guarantees that
+/// the block plus one pixel to the right and bottom lies inside the image.
+template <int size>
+inline void sampleBlock(const pangolin::Image<float>& img,
+                        const Eigen::Vector2f& pos, float* block) {
+  const int ix = int(pos.x());
+  const int iy = int(pos.y());
+  const float dx = pos.x() - ix;
+  const float dy = pos.y() - iy;
+
+  const float w00 = (1 - dx) * (1 - dy), w01 = dx * (1 - dy);
+  const float w10 = (1 - dx) * dy, w11 = dx * dy;
+
+  for (int y = 0; y < size; y++) {
+    const float* row0 = img.RowPtr(iy + y) + ix;
+    const float* row1 = img.RowPtr(iy + y + 1) + ix;
+    for (int x = 0; x < size; x++) {
+      block[y * size + x] = w00 * row0[x] + w01 * row0[x + 1] +
+                            w10 * row1[x] + w11 * row1[x + 1];
+    }
+  }
+}
+
+/// Sample the patch around pos into a vector and subtract its mean, which makes
+/// tracking invariant to additive brightness changes.
+inline void samplePatch(const pangolin::Image<float>& img,
+                        const Eigen::Vector2f& pos, PatchVector& data) {
+  sampleBlock<2 * OPTICAL_FLOW_HALF_PATCH>(
+      img, pos.array() - OPTICAL_FLOW_HALF_PATCH, data.data());
+  data.array() -= data.mean();
+}
+
+/// Template patch of the inverse compositional Lucas-Kanade tracker. The
+/// Jacobian and the inverse Hessian only depend on the template, so they are
+/// computed once per point and pyramid level.
+struct OpticalFlowPatch {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  PatchVector data;
+  Eigen::Matrix<float, 2, OPTICAL_FLOW_PATCH_AREA> J;
+  Eigen::Matrix2f H_inv;
+  bool valid = false;
+
+  OpticalFlowPatch(const pangolin::Image<float>& img,
+                   const Eigen::Vector2f& pos) {
+    if (!patchInImage(img, pos)) return;
+
+    // the patch with a one pixel border for central differences
+    const int size = 2 * OPTICAL_FLOW_HALF_PATCH;
+    Eigen::Matrix<float, size + 2, size + 2, Eigen::RowMajor> block;
+    sampleBlock<size + 2>(img, pos.array() - (OPTICAL_FLOW_HALF_PATCH + 1),
+                          block.data());
+
+    int i = 0;
+    for (int y = 1; y <= size; y++) {
+      for (int x = 1; x <= size; x++) {
+        data[i] = block(y, x);
+        J(0, i) = 0.5f * (block(y, x + 1) - block(y, x - 1));
+        J(1, i) = 0.5f * (block(y + 1, x) - block(y - 1, x));
+        i++;
+      }
+    }
+    data.array() -= data.mean();
+
+    // residuals are mean-free, so the Jacobian has to be as well
+    J.colwise() -= J.rowwise().mean();
+
+    const Eigen::Matrix2f H = J * J.transpose();
+    if (H.determinant() < 1e-6f) return;
+
+    H_inv = H.inverse();
+    valid = true;
+  }
+
+  /// Refine pos in img so that the patch there matches the template. Returns
+  /// false if the patch leaves the image.
+  bool track(const pangolin::Image<float>& img, Eigen::Vector2f& pos) const {
+    PatchVector res;
+    for (int iter = 0; iter < OPTICAL_FLOW_MAX_ITERATIONS; iter++) {
+      if (!patchInImage(img, pos)) return false;
+
+      samplePatch(img, pos, res);
+      res -= data;
+
+      const Eigen::Vector2f inc = H_inv * (J * res);
+      if (!inc.allFinite()) return false;
+
+      // inverse compositional update of a pure translation warp
+      pos -= inc;
+
+      if (inc.squaredNorm() < 1e-4f) break;
+    }
+
+    return patchInImage(img, pos);
+  }
+};
+
+/// Track a point from pyramid0 to pyramid1 coarse to fine, starting from the
+/// guess in pos1.
+bool trackPoint(const ImagePyramid& pyramid0, const ImagePyramid& pyramid1,
+                const Eigen::Vector2f& pos0, Eigen::Vector2f& pos1) {
+  for (int l = int(pyramid0.size()) - 1; l >= 0; l--) {
+    const float scale = 1.0f / (1 << l);
+
+    OpticalFlowPatch patch(pyramid0[l], pos0 * scale);
+    if (!patch.valid) return false;
+
+    Eigen::Vector2f pos = pos1 * scale;
+    if (!patch.track(pyramid1[l], pos)) return false;
+
+    pos1 = pos / scale;
+  }
+
+  return true;
+}
+
+/// Track points0 from the image of pyramid0 to the image of pyramid1 with
+/// pyramidal inverse compositional Lucas-Kanade. A point is accepted only if
+/// tracking it back ends up close to where it started.
+void trackPointsOpticalFlow(
+    const ImagePyramid& pyramid0, const ImagePyramid& pyramid1,
+    const std::vector<Eigen::Vector2d, Eigen::aligned_allocator<
+                                           Eigen::Vector2d>>& points0,
+    std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>>&
+        points1,
+    std::vector<bool>& tracked) {
+  points1.resize(points0.size());
+  // std::vector<bool> is not safe to write concurrently
+  std::vector<uint8_t> status(points0.size(), 0);
+
+  tbb::parallel_for(
+      tbb::blocked_range<size_t>(0, points0.size()),
+      [&](const tbb::blocked_range<size_t>& r) {
+        for (size_t i = r.begin(); i != r.end(); ++i) {
+          const Eigen::Vector2f p0 = points0[i].cast<float>();
+
+          Eigen::Vector2f p1 = p0;
+          if (!trackPoint(pyramid0, pyramid1, p0, p1)) continue;
+
+          Eigen::Vector2f p0_recovered = p1;
+          if (!trackPoint(pyramid1, pyramid0, p1, p0_recovered)) continue;
+
+          if ((p0_recovered - p0).norm() > OPTICAL_FLOW_MAX_RECOVERED_DIST)
+            continue;
+
+          points1[i] = p1.cast<double>();
+          status[i] = 1;
+        }
+      });
+
+  tracked.assign(status.begin(), status.end());
+}
+
+}  // namespace visnav
@@ -0,0 +1,286 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include <visnav/calibration.h>
+#include <visnav/common_types.h>
+
+namespace visnav {
+
+/// Reprojections of the landmark observations in the images of the map, kept
+/// between updates. The observations of every image are stored as a structure
+/// of arrays. update gathers and reprojects only the outdated images, in
+/// parallel across images: new images, images whose camera pose or intrinsics
+/// changed, and images invalidated since the last update, e.g. because a
+/// landmark they observe moved. The arrays of images that are replaced or
+/// dropped are recycled, so a map of steady size does not allocate.
+class ProjectionCache {
+ public:
+  using Vec2Batch = AbstractCamera<double>::Vec2Batch;
+  using Vec3Batch = AbstractCamera<double>::Vec3Batch;
+
+  /// Inlier and outlier observations of one image. The batches have at least
+  /// size rows; only the first size rows are valid.
+  struct Image {
+    size_t size = 0;
+    std::vector<TrackId> track_ids;
+    std::vector<FeatureId> feature_ids;
+    /// 1 for outlier observations
+    std::vector<uint8_t> outlier;
+    /// landmark positions in world coordinates
+    Vec3Batch p_w;
+    /// landmark positions in camera coordinates
+    Vec3Batch p_c;
+    /// detected feature locations
+    Vec2Batch measured;
+    /// landmarks projected into the image
+    Vec2Batch reprojected;
+    std::vector<double> reprojection_errors;
+
+    /// camera pose the projections were computed with
+    Sophus::SE3d T_w_c;
+
+    void clear() {
+      size = 0;
+      track_ids.clear();
+      feature_ids.clear();
+      outlier.clear();
+    }
+
+    void add(TrackId track_id, FeatureId feature_id, bool is_outlier,
+             const Eigen::Vector3d& p) {
+      if (Eigen::Index(size) == p_w.rows()) {
+        p_w.conservativeResize(std::max<Eigen::Index>(16, 2 * size), 3);
+      }
+      track_ids.push_back(track_id);
+      feature_ids.push_back(feature_id);
+      outlier.push_back(is_outlier);
+      p_w.row(size) = p.transpose();
+      size++;
+    }
+
+   private:
+    friend class ProjectionCache;
+    std::vector<int> indices;
+  };
+
+  /// projections of fcid, nullptr if it has none
+  const Image* find(const FrameCamId& fcid) const {
+    auto it = images_.find(fcid);
+    return it != images_.end() ? it->second.get() : nullptr;
+  }
+
+  /// number of images with projections
+  size_t size() const { return images_.size(); }
+
+  /// number of images that the last update recomputed
+  size_t numUpdated() const { return num_updated_; }
+
+  /// Recompute fcid on the next update, e.g. after observations were added to
+  /// or removed from it.
+  void invalidateImage(const FrameCamId& fcid) {
+    if (images_.count(fcid)) dirty_images_.insert(fcid);
+  }
+
+  /// Recompute the images observing track_id on the next update, e.g. after
+  /// its position changed.
+  void invalidateLandmark(TrackId track_id) {
+    // images that are not cached yet are gathered anyway
+    if (!images_.empty()) dirty_landmarks_.push_back(track_id);
+  }
+
+  void clear() {
+    for (auto& kv : images_) release(std::move(kv.second));
+    images_.clear();
+    dirty_images_.clear();
+    dirty_landmarks_.clear();
+    intrinsics_.clear();
+  }
+
+  /// Bring the projections of the images of cameras up to date. Only the
+  /// outdated images are gathered, from the landmarks that frame_landmarks
+  /// lists for them; it has to list every landmark with an inlier or outlier
+  /// observation in these images. Images without a camera are dropped.
+  void update(const Landmarks& landmarks, const Cameras& cameras,
+              const Calibration& calib_cam, const Corners& feature_corners,
+              const FrameLandmarkIndex& frame_landmarks) {
+    // images of the landmarks that moved
+    for (const TrackId track_id : dirty_landmarks_) {
+      auto it = landmarks.find(track_id);
+      if (it == landmarks.end()) continue;
+      for (const auto& kv_obs : it->second.obs) invalidateImage(kv_obs.first);
+      for (const auto& kv_obs : it->second.outlier_obs) {
+        invalidateImage(kv_obs.first);
+      }
+    }
+    dirty_landmarks_.clear();
+
+    // all images of cameras whose intrinsics changed
+    std::vector<bool> intrinsics_changed(calib_cam.intrinsics.size());
+    intrinsics_.resize(calib_cam.intrinsics.size(),
+                       AbstractCamera<double>::VecN::Constant(
+                           std::numeric_limits<double>::quiet_NaN()));
+    for (size_t i = 0; i < calib_cam.intrinsics.size(); i++) {
+      const auto& param = calib_cam.intrinsics[i]->getParam();
+      intrinsics_changed[i] = intrinsics_[i] != param;
+      intrinsics_[i] = param;
+    }
+
+    for (auto it = images_.begin(); it != images_.end();) {
+      if (!cameras.count(it->first)) {
+        release(std::move(it->second));
+        dirty_images_.erase(it->first);
+        it = images_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    // new images and images with a new pose
+    std::vector<std::pair<FrameCamId, Image*>> changed;
+    for (const auto& [fcid, cam] : cameras) {
+      auto it = images_.find(fcid);
+      if (it != images_.end() && !dirty_images_.count(fcid) &&
+          !intrinsics_changed.at(fcid.cam_id) &&
+          it->second->T_w_c.params() == cam.T_w_c.params()) {
+        continue;
+      }
+
+      std::unique_ptr<Image> image =
+          it != images_.end() ? std::move(it->second) : acquire();
+      image->clear();
+      image->T_w_c = cam.T_w_c;
+      gather(fcid, landmarks, frame_landmarks, *image);
+
+      if (image->size == 0) {
+        release(std::move(image));
+        if (it != images_.end()) images_.erase(it);
+        continue;
+      }
+
+      changed.emplace_back(fcid, image.get());
+      images_[fcid] = std::move(image);
+    }
+    dirty_images_.clear();
+
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, changed.size()),
+        [&](const tbb::blocked_range<size_t>& r) {
+          for (size_t i = r.begin(); i != r.end(); i++) {
+            project(*calib_cam.intrinsics.at(changed[i].first.cam_id),
+                    feature_corners.at(changed[i].first), *changed[i].second);
+          }
+        });
+    num_updated_ = changed.size();
+  }
+
+ private:
+  std::unique_ptr<Image> acquire() {
+    if (pool_.empty()) return std::unique_ptr<Image>(new Image);
+
+    std::unique_ptr<Image> image = std::move(pool_.back());
+    pool_.pop_back();
+    return image;
+  }
+
+  void release(std::unique_ptr<Image> image) {
+    pool_.push_back(std::move(image));
+  }
+
+  static void gather(const FrameCamId& fcid, const Landmarks& landmarks,
+                     const FrameLandmarkIndex& frame_landmarks, Image& image) {
+    for (const TrackId track_id : frame_landmarks.landmarks(fcid)) {
+      auto it = landmarks.find(track_id);
+      if (it == landmarks.end()) continue;
+
+      const Landmark& lm = it->second;
+      auto obs = lm.obs.find(fcid);
+      if (obs != lm.obs.end()) {
+        image.add(track_id, obs->second, false, lm.p);
+        continue;
+      }
+      auto outlier_obs = lm.outlier_obs.find(fcid);
+      if (outlier_obs != lm.outlier_obs.end()) {
+        image.add(track_id, outlier_obs->second, true, lm.p);
+      }
+    }
+  }
+
+  static void project(const AbstractCamera<double>& cam,
+                      const KeypointsData& kd, Image& image) {
+    const Eigen::Index n = image.size;
+
+    // keep all points, also the ones behind the camera or outside the image,
+    // so the rows stay aligned with the observations
+    const size_t num_projected = cam.projectWorldBatch(
+        image.T_w_c, image.p_w.topRows(n),
+        std::numeric_limits<double>::lowest(), false, image.p_c,
+        image.reprojected, image.indices);
+    assert(Eigen::Index(num_projected) == n);
+    UNUSED(num_projected);
+
+    if (image.measured.rows() < n) image.measured.resize(image.p_w.rows(), 2);
+    image.reprojection_errors.resize(n);
+    for (Eigen::Index i = 0; i < n; i++) {
+      image.measured.row(i) = kd.corners[image.feature_ids[i]].transpose();
+      image.reprojection_errors[i] =
+          (image.measured.row(i) - image.reprojected.row(i)).norm();
+    }
+  }
+
+  std::map<FrameCamId, std::unique_ptr<Image>> images_;
+  std::vector<std::unique_ptr<Image>> pool_;
+
+  /// outdated images and moved landmarks since the last update
+  std::set<FrameCamId> dirty_images_;
+  std::vector<TrackId> dirty_landmarks_;
+
+  /// intrinsics of every camera at the last update
+  Eigen::aligned_vector<AbstractCamera<double>::VecN> intrinsics_;
+
+  size_t num_updated_ = 0;
+};
+
+}  // namespace visnav
@@ -32,25 +32,82 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 
+#include <cstdlib>
+#include <iostream>
 #include <memory>
+#include <string>
 #include <visnav/preintegration_imu/preintegration.h>
 
 #include <Eigen/Dense>
+#include <ceres/autodiff_cost_function.h>
+#include <ceres/sized_cost_function.h>
 #include <sophus/se3.hpp>
 
+#include <visnav/camera_models.h>
 #include <visnav/common_types.h>
 
 namespace visnav {
 
-template <class T>
-class AbstractCamera;
+/// Tag type standing for the camera model template CamT
+template <template <class> class CamT>
+struct CameraModelTag {
+  template <class Scalar>
+  using Camera = CamT<Scalar>;
+};
+
+/// Resolve a camera model name to its type: calls f with the CameraModelTag of
+/// the model and returns the result.
+template <class F>
+auto dispatchCameraModel(const std::string& cam_model, F&& f) {
+  if (cam_model == DoubleSphereCamera<double>::getName()) {
+    return f(CameraModelTag<DoubleSphereCamera>());
+  } else if (cam_model == PinholeCamera<double>::getName()) {
+    return f(CameraModelTag<PinholeCamera>());
+  } else if (cam_model == KannalaBrandt4Camera<double>::getName()) {
+    return f(CameraModelTag<KannalaBrandt4Camera>());
+  } else if (cam_model == ExtendedUnifiedCamera<double>::getName()) {
+    return f(CameraModelTag<ExtendedUnifiedCamera>());
+  } else {
+    std::cerr << "Camera model " << cam_model << " is not implemented."
+              << std::endl;
+    std::abort();
+  }
+}
+
+/// Rotate v by the conjugate of the unit quaternion q, evaluated like Eigen's
+/// quaternion-vector product, i.e. p = R(q)^T v. If d_p_d_q is given it is set
+/// to the Jacobian of p with respect to the coefficients (x, y, z, w) of q,
+/// which is the parameter order of the quaternion part of Sophus::SE3d.
+inline Eigen::Vector3d rotateByConjugate(const Eigen::Quaterniond& q,
+                                         const Eigen::Vector3d& v,
+                                         Eigen::Matrix<double, 3, 4>* d_p_d_q) {
+  const Eigen::Vector3d u = -q.vec();
+  const Eigen::Vector3d uv = 2 * u.cross(v);
+  const Eigen::Vector3d p = v + q.w() * uv + u.cross(uv);
+
+  if (d_p_d_q) {
+    // p = v + 2 w (u x v) + 2 (u (u.v) - v (u.u)) with u = -q.vec()
+    Eigen::Matrix3d d_p_d_u = 2 * (u.dot(v) * Eigen::Matrix3d::Identity() +
+                                   u * v.transpose() - 2 * v * u.transpose());
+    d_p_d_u -= 2 * q.w() * Sophus::SO3d::hat(v);
+
+    d_p_d_q->leftCols<3>() = -d_p_d_u;
+    d_p_d_q->col(3) = uv;
+  }
+
+  return p;
+}
 
+/// Reprojection error of a calibration target point. The camera model is a
+/// template parameter, so evaluating the residual constructs the camera on
+/// the stack and the projection is inlined; use
+/// createReprojectionCostFunction to pick the model by name.
+template <template <class> class CamT>
 struct ReprojectionCostFunctor {
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
   ReprojectionCostFunctor(const Eigen::Vector2d& p_2d,
-                          const Eigen::Vector3d& p_3d,
-                          const std::string& cam_model)
-      : p_2d(p_2d), p_3d(p_3d), cam_model(cam_model) {}
+                          const Eigen::Vector3d& p_3d)
+      : p_2d(p_2d), p_3d(p_3d) {}
 
   template <class T>
   bool operator()(T const* const sT_w_i, T const* const sT_i_c,
@@ -60,16 +117,20 @@ struct ReprojectionCostFunctor {
    
 
     Eigen::Map<Eigen::Matrix<T, 2, 1>> residuals(sResiduals);
-    const std::shared_ptr<AbstractCamera<T>> cam =
-        AbstractCamera<T>::from_data(cam_model, sIntr);
+    const CamT<T> cam{Eigen::Map<Eigen::Matrix<T, 8, 1> const>(sIntr)};
 
 // TODO SHEET 2: implement the rest of the functor
 
     // Transform the 3D point from the world frame to the camera frame
-    Eigen::Matrix<T, 3, 1> p_c = T_i_c.inverse() * (T_w_i.inverse() * p_3d.cast<T>());
+    // (rotating with the conjugate quaternions avoids constructing the inverse
+    // poses and their normalization checks)
+    const Eigen::Matrix<T, 3, 1> p_i = T_w_i.unit_quaternion().conjugate() *
+                                       (p_3d.cast<T>() - T_w_i.translation());
+    Eigen::Matrix<T, 3, 1> p_c = T_i_c.unit_quaternion().conjugate() *
+                                 (p_i - T_i_c.translation());
 
     // Project the point to the image plane using the camera model
-    Eigen::Matrix<T, 2, 1> projected_p_2d = cam->project(p_c);
+    Eigen::Matrix<T, 2, 1> projected_p_2d = cam.project(p_c);
 
     // Compute the residuals
     residuals = projected_p_2d - p_2d.cast<T>();
@@ -80,14 +141,110 @@ struct ReprojectionCostFunctor {
 
   Eigen::Vector2d p_2d;
   Eigen::Vector3d p_3d;
-  std::string cam_model;
 };
 
+/// ReprojectionCostFunctor with hand-derived Jacobians instead of automatic
+/// differentiation. The pose Jacobians are with respect to the ambient
+/// quaternion and translation parameters; the SE3 local parameterization maps
+/// them to the tangent space.
+template <template <class> class CamT>
+class AnalyticReprojectionCostFunction
+    : public ceres::SizedCostFunction<2, Sophus::SE3d::num_parameters,
+                                      Sophus::SE3d::num_parameters, 8> {
+ public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  AnalyticReprojectionCostFunction(const Eigen::Vector2d& p_2d,
+                                   const Eigen::Vector3d& p_3d)
+      : p_2d(p_2d), p_3d(p_3d) {}
+
+  bool Evaluate(double const* const* parameters, double* sResiduals,
+                double** jacobians) const override {
+    Eigen::Map<Sophus::SE3d const> const T_w_i(parameters[0]);
+    Eigen::Map<Sophus::SE3d const> const T_i_c(parameters[1]);
+    const CamT<double> cam{
+        Eigen::Map<Eigen::Matrix<double, 8, 1> const>(parameters[2])};
+    Eigen::Map<Eigen::Vector2d> residuals(sResiduals);
+
+    const bool need_d_p = jacobians && (jacobians[0] || jacobians[1]);
+
+    Eigen::Matrix<double, 3, 4> d_p_i_d_q_w_i, d_p_c_d_q_i_c;
+    const Eigen::Vector3d p_i =
+        rotateByConjugate(T_w_i.unit_quaternion(), p_3d - T_w_i.translation(),
+                          jacobians && jacobians[0] ? &d_p_i_d_q_w_i : nullptr);
+    const Eigen::Vector3d p_c =
+        rotateByConjugate(T_i_c.unit_quaternion(), p_i - T_i_c.translation(),
+                          need_d_p ? &d_p_c_d_q_i_c : nullptr);
+
+    Eigen::Matrix<double, 2, 3> d_proj_d_p_c;
+    Eigen::Matrix<double, 2, 8> d_proj_d_param;
+    residuals = cam.project(p_c, need_d_p ? &d_proj_d_p_c : nullptr,
+                            jacobians && jacobians[2] ? &d_proj_d_param
+                                                      : nullptr) -
+                p_2d;
+
+    if (!jacobians) return true;
+
+    if (need_d_p) {
+      // p_c depends on p_i like on v in rotateByConjugate, i.e. via R_c_i
+      const Eigen::Matrix<double, 2, 3> d_proj_d_p_i =
+          d_proj_d_p_c *
+          T_i_c.unit_quaternion().conjugate().toRotationMatrix();
+
+      if (jacobians[0]) {
+        Eigen::Map<Eigen::Matrix<double, 2, 7, Eigen::RowMajor>> J(
+            jacobians[0]);
+        J.leftCols<4>() = d_proj_d_p_i * d_p_i_d_q_w_i;
+        J.rightCols<3>() =
+            -d_proj_d_p_i *
+            T_w_i.unit_quaternion().conjugate().toRotationMatrix();
+      }
+      if (jacobians[1]) {
+        Eigen::Map<Eigen::Matrix<double, 2, 7, Eigen::RowMajor>> J(
+            jacobians[1]);
+        J.leftCols<4>() = d_proj_d_p_c * d_p_c_d_q_i_c;
+        J.rightCols<3>() = -d_proj_d_p_i;
+      }
+    }
+    if (jacobians[2]) {
+      Eigen::Map<Eigen::Matrix<double, 2, 8, Eigen::RowMajor>> J(jacobians[2]);
+      J = d_proj_d_param;
+    }
+
+    return true;
+  }
+
+  Eigen::Vector2d p_2d;
+  Eigen::Vector3d p_3d;
+};
+
+/// Cost function of the reprojection error of a calibration target point for
+/// the camera model cam_model, with parameter blocks T_w_i, T_i_c and the
+/// intrinsics. Uses AnalyticReprojectionCostFunction if analytic_jacobians is
+/// set and automatic differentiation of ReprojectionCostFunctor otherwise.
+inline ceres::CostFunction* createReprojectionCostFunction(
+    const Eigen::Vector2d& p_2d, const Eigen::Vector3d& p_3d,
+    const std::string& cam_model, const bool analytic_jacobians) {
+  return dispatchCameraModel(
+      cam_model, [&](auto tag) -> ceres::CostFunction* {
+        if (analytic_jacobians) {
+          return new AnalyticReprojectionCostFunction<
+              decltype(tag)::template Camera>(p_2d, p_3d);
+        }
+        typedef ReprojectionCostFunctor<decltype(tag)::template Camera> Functor;
+        return new ceres::AutoDiffCostFunction<
+            Functor, 2, Sophus::SE3d::num_parameters,
+            Sophus::SE3d::num_parameters, 8>(new Functor(p_2d, p_3d));
+      });
+}
+
+/// Reprojection error of a landmark in bundle adjustment, templated on the
+/// camera model like ReprojectionCostFunctor; use
+/// createBundleAdjustmentReprojectionCostFunction to pick the model by name.
+template <template <class> class CamT>
 struct BundleAdjustmentReprojectionCostFunctor {
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-  BundleAdjustmentReprojectionCostFunctor(const Eigen::Vector2d& p_2d,
-                                          const std::string& cam_model)
-      : p_2d(p_2d), cam_model(cam_model) {}
+  BundleAdjustmentReprojectionCostFunctor(const Eigen::Vector2d& p_2d)
+      : p_2d(p_2d) {}
 
   template <class T>
   bool operator()(T const* const sT_w_c, T const* const sp_3d_w,
@@ -96,16 +253,18 @@ struct BundleAdjustmentReprojectionCostFunctor {
     Eigen::Map<Sophus::SE3<T> const> const T_w_c(sT_w_c);
     Eigen::Map<Eigen::Matrix<T, 3, 1> const> const p_3d_w(sp_3d_w);
     Eigen::Map<Eigen::Matrix<T, 2, 1>> residuals(sResiduals);
-    const std::shared_ptr<AbstractCamera<T>> cam =
-        AbstractCamera<T>::from_data(cam_model, sIntr);
+    const CamT<T> cam{Eigen::Map<Eigen::Matrix<T, 8, 1> const>(sIntr)};
 
     // TODO SHEET 4: Compute reprojection error
     
     // Transform 3D point from world coordinates to camera coordinates
-    Eigen::Matrix<T, 3, 1> p_3d_c = T_w_c.inverse() * p_3d_w;
+    // (rotating with the conjugate quaternion avoids constructing the inverse
+    // pose and its normalization checks)
+    Eigen::Matrix<T, 3, 1> p_3d_c = T_w_c.unit_quaternion().conjugate() *
+                                    (p_3d_w - T_w_c.translation());
 
     // Project the 3D point to 2D using the camera model
-    Eigen::Matrix<T, 2, 1> p_2d_proj = cam->project(p_3d_c);
+    Eigen::Matrix<T, 2, 1> p_2d_proj = cam.project(p_3d_c);
     // Compute the residuals (reprojection error)
     residuals = p_2d_proj - p_2d.cast<T>();
 
@@ -114,9 +273,92 @@ struct BundleAdjustmentReprojectionCostFunctor {
   }
 
   Eigen::Vector2d p_2d;
-  std::string cam_model;
 };
 
+/// BundleAdjustmentReprojectionCostFunctor with hand-derived Jacobians, with
+/// the same parameter conventions as AnalyticReprojectionCostFunction.
+template <template <class> class CamT>
+class AnalyticBundleAdjustmentReprojectionCostFunction
+    : public ceres::SizedCostFunction<2, Sophus::SE3d::num_parameters, 3, 8> {
+ public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  AnalyticBundleAdjustmentReprojectionCostFunction(const Eigen::Vector2d& p_2d)
+      : p_2d(p_2d) {}
+
+  bool Evaluate(double const* const* parameters, double* sResiduals,
+                double** jacobians) const override {
+    Eigen::Map<Sophus::SE3d const> const T_w_c(parameters[0]);
+    Eigen::Map<Eigen::Vector3d const> const p_3d_w(parameters[1]);
+    const CamT<double> cam{
+        Eigen::Map<Eigen::Matrix<double, 8, 1> const>(parameters[2])};
+    Eigen::Map<Eigen::Vector2d> residuals(sResiduals);
+
+    const bool need_d_p = jacobians && (jacobians[0] || jacobians[1]);
+
+    Eigen::Matrix<double, 3, 4> d_p_c_d_q;
+    const Eigen::Vector3d p_3d_c =
+        rotateByConjugate(T_w_c.unit_quaternion(), p_3d_w - T_w_c.translation(),
+                          jacobians && jacobians[0] ? &d_p_c_d_q : nullptr);
+
+    Eigen::Matrix<double, 2, 3> d_proj_d_p_c;
+    Eigen::Matrix<double, 2, 8> d_proj_d_param;
+    residuals = cam.project(p_3d_c, need_d_p ? &d_proj_d_p_c : nullptr,
+                            jacobians && jacobians[2] ? &d_proj_d_param
+                                                      : nullptr) -
+                p_2d;
+
+    if (!jacobians) return true;
+
+    if (need_d_p) {
+      const Eigen::Matrix<double, 2, 3> d_proj_d_p_w =
+          d_proj_d_p_c *
+          T_w_c.unit_quaternion().conjugate().toRotationMatrix();
+
+      if (jacobians[0]) {
+        Eigen::Map<Eigen::Matrix<double, 2, 7, Eigen::RowMajor>> J(
+            jacobians[0]);
+        J.leftCols<4>() = d_proj_d_p_c * d_p_c_d_q;
+        J.rightCols<3>() = -d_proj_d_p_w;
+      }
+      if (jacobians[1]) {
+        Eigen::Map<Eigen::Matrix<double, 2, 3, Eigen::RowMajor>> J(
+            jacobians[1]);
+        J = d_proj_d_p_w;
+      }
+    }
+    if (jacobians[2]) {
+      Eigen::Map<Eigen::Matrix<double, 2, 8, Eigen::RowMajor>> J(jacobians[2]);
+      J = d_proj_d_param;
+    }
+
+    return true;
+  }
+
+  Eigen::Vector2d p_2d;
+};
+
+/// Cost function of the reprojection error of a landmark for the camera model
+/// cam_model, with parameter blocks T_w_c, p_3d_w and the intrinsics. Uses
+/// AnalyticBundleAdjustmentReprojectionCostFunction if analytic_jacobians is
+/// set and automatic differentiation of
+/// BundleAdjustmentReprojectionCostFunctor otherwise.
+inline ceres::CostFunction* createBundleAdjustmentReprojectionCostFunction(
+    const Eigen::Vector2d& p_2d, const std::string& cam_model,
+    const bool analytic_jacobians) {
+  return dispatchCameraModel(
+      cam_model, [&](auto tag) -> ceres::CostFunction* {
+        if (analytic_jacobians) {
+          return new AnalyticBundleAdjustmentReprojectionCostFunction<
+              decltype(tag)::template Camera>(p_2d);
+        }
+        typedef BundleAdjustmentReprojectionCostFunctor<
+            decltype(tag)::template Camera>
+            Functor;
+        return new ceres::AutoDiffCostFunction<
+            Functor, 2, Sophus::SE3d::num_parameters, 3, 8>(new Functor(p_2d));
+      });
+}
+
 ///////////////////////////////////////////////
 struct BundleAdjustmentImuCamstateCostFunctor {
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
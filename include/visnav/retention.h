@@ -0,0 +1,277 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <visnav/common_types.h>
+#include <visnav/serialization.h>
+
+#include <visnav/preintegration_imu/preintegration.h>
+
+namespace visnav {
+
+using FrameStates = Eigen::aligned_map<Timestamp, PoseVelState<double>>;
+using ImuMeasurements =
+    Eigen::aligned_map<Timestamp, IntegratedImuMeasurement<double>>;
+
+/// Append-only file of odometry state that was evicted from memory. Every
+/// record is a RecordType tag followed by the record in cereal's binary
+/// format; read_state_archive loads them back.
+class StateArchive {
+ public:
+  enum RecordType : uint8_t { LANDMARK = 0, FRAME_STATE = 1, STEREO_MATCHES = 2 };
+
+  /// Start a new archive at path. Returns false if it cannot be created.
+  bool open(const std::string& path) {
+    close();
+    os_.open(path, std::ios::binary | std::ios::trunc);
+    if (!os_.is_open()) return false;
+    archive_.reset(new cereal::BinaryOutputArchive(os_));
+    return true;
+  }
+
+  bool isOpen() const { return bool(archive_); }
+
+  void close() {
+    archive_.reset();
+    if (os_.is_open()) os_.close();
+  }
+
+  void flush() { os_.flush(); }
+
+  /// number of records written
+  size_t numRecords() const { return num_records_; }
+
+  void write(TrackId track_id, const Landmark& lm) {
+    (*archive_)(uint8_t(LANDMARK), track_id, lm);
+    num_records_++;
+  }
+
+  void write(const PoseVelState<double>& state) {
+    (*archive_)(uint8_t(FRAME_STATE), state.t_ns, state.T_w_i, state.vel_w_i);
+    num_records_++;
+  }
+
+  void write(const std::pair<FrameCamId, FrameCamId>& fcids,
+             const MatchData& md) {
+    (*archive_)(uint8_t(STEREO_MATCHES), fcids, md);
+    num_records_++;
+  }
+
+ private:
+  std::ofstream os_;
+  std::unique_ptr<cereal::BinaryOutputArchive> archive_;
+  size_t num_records_ = 0;
+};
+
+/// Load all records of the archive at path. Returns false if it cannot be
+/// opened.
+bool read_state_archive(const std::string& path, Landmarks& landmarks,
+                        FrameStates& states, Matches& matches) {
+  std::ifstream is(path, std::ios::binary);
+  if (!is.is_open()) return false;
+
+  cereal::BinaryInputArchive archive(is);
+  while (is.peek() != std::ifstream::traits_type::eof()) {
+    uint8_t type;
+    archive(type);
+
+    if (type == StateArchive::LANDMARK) {
+      TrackId track_id;
+      Landmark lm;
+      archive(track_id, lm);
+      landmarks[track_id] = std::move(lm);
+    } else if (type == StateArchive::FRAME_STATE) {
+      PoseVelState<double> state;
+      archive(state.t_ns, state.T_w_i, state.vel_w_i);
+      states[state.t_ns] = state;
+    } else if (type == StateArchive::STEREO_MATCHES) {
+      std::pair<FrameCamId, FrameCamId> fcids;
+      MatchData md;
+      archive(fcids, md);
+      matches[fcids] = std::move(md);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// bytes allocated for the feature matches (without allocator overhead)
+size_t memory_usage(const Matches& matches) {
+  size_t bytes = 0;
+  for (const auto& kv : matches) {
+    bytes += sizeof(kv) +
+             kv.second.matches.capacity() * sizeof(kv.second.matches[0]) +
+             kv.second.inliers.capacity() * sizeof(kv.second.inliers[0]);
+  }
+  return bytes;
+}
+
+/// bytes allocated for a map of per-timestamp states, estimated with the size
+/// of a tree node per entry
+template <class T>
+size_t memory_usage(const Eigen::aligned_map<Timestamp, T>& map) {
+  return map.size() *
+         (sizeof(typename Eigen::aligned_map<Timestamp, T>::value_type) +
+          4 * sizeof(void*));
+}
+
+/// Counters of the odometry state evicted by a RetentionManager.
+struct RetentionStats {
+  size_t evicted_landmarks = 0;
+  size_t evicted_states = 0;
+  size_t evicted_imu_measurements = 0;
+  size_t evicted_matches = 0;
+
+  /// number of updates after which the state stayed above the memory limit,
+  /// because everything left was still in the window
+  size_t num_over_limit = 0;
+
+  /// bytes of the retained state after the last update, and their maximum
+  size_t memory_bytes = 0;
+  size_t peak_memory_bytes = 0;
+};
+
+/// Keeps the history of the odometry bounded. The stereo matches of keyframes
+/// and the IMU states and measurements are evicted once they are outside the
+/// window. The landmarks that dropped out of the map are only kept (e.g. for
+/// display) while the retained state fits into the memory limit; otherwise
+/// the oldest ones are evicted. The limit is soft: the window itself is never
+/// shrunk, so if it alone exceeds the limit the state stays above it (counted
+/// in RetentionStats::num_over_limit). If an archive is open, evicted matches,
+/// states and landmarks are written to it instead of being lost; the IMU
+/// measurements are not archived, since they are integrated from the IMU data.
+class RetentionManager {
+ public:
+  /// memory_limit is in bytes, 0 for no limit
+  explicit RetentionManager(size_t memory_limit = 0)
+      : memory_limit_(memory_limit) {}
+
+  void setMemoryLimit(size_t memory_limit) { memory_limit_ = memory_limit; }
+
+  StateArchive& archive() { return archive_; }
+
+  const RetentionStats& stats() const { return stats_; }
+
+  /// Evict the stereo matches of keyframe frame_id.
+  void evictKeyframe(FrameId frame_id, Matches& feature_matches) {
+    auto it = feature_matches.find(
+        std::make_pair(FrameCamId(frame_id, 0), FrameCamId(frame_id, 1)));
+    if (it == feature_matches.end()) return;
+
+    if (archive_.isOpen()) archive_.write(it->first, it->second);
+    feature_matches.unsafe_erase(it);
+    stats_.evicted_matches++;
+  }
+
+  /// Evict the IMU states and measurements before t_ns.
+  void evictStates(Timestamp t_ns, FrameStates& states,
+                   ImuMeasurements& imu_measurements) {
+    for (auto it = states.begin(); it != states.end() && it->first < t_ns;) {
+      if (archive_.isOpen()) archive_.write(it->second);
+      it = states.erase(it);
+      stats_.evicted_states++;
+    }
+
+    auto end = imu_measurements.lower_bound(t_ns);
+    stats_.evicted_imu_measurements +=
+        std::distance(imu_measurements.begin(), end);
+    imu_measurements.erase(imu_measurements.begin(), end);
+  }
+
+  /// Account for the retained state, which is window_bytes plus the old
+  /// landmarks, and evict the oldest landmarks from old_landmarks if it
+  /// exceeds the memory limit. TrackIds increase over time, so the oldest
+  /// landmarks are those with the smallest ids. To not evict on every call,
+  /// the landmarks are evicted down to 3/4 of the limit, and the memory of
+  /// old_landmarks is released right away. Only old_landmarks are evicted, so
+  /// the retained state can stay above the limit when window_bytes alone
+  /// exceeds it.
+  void update(size_t window_bytes, Landmarks& old_landmarks) {
+    size_t bytes = window_bytes + old_landmarks.memoryUsage();
+
+    if (memory_limit_ > 0 && bytes > memory_limit_ && !old_landmarks.empty()) {
+      old_landmarks.shrink_to_fit();
+      const size_t old_bytes = old_landmarks.memoryUsage();
+      bytes = window_bytes + old_bytes;
+
+      const size_t excess = bytes - std::min(bytes, memory_limit_ * 3 / 4);
+      const size_t bytes_per_landmark =
+          std::max<size_t>(1, old_bytes / old_landmarks.size());
+      evictOldest((excess + bytes_per_landmark - 1) / bytes_per_landmark,
+                  old_landmarks);
+
+      old_landmarks.shrink_to_fit();
+      bytes = window_bytes + old_landmarks.memoryUsage();
+    }
+
+    if (memory_limit_ > 0 && bytes > memory_limit_) stats_.num_over_limit++;
+
+    stats_.memory_bytes = bytes;
+    stats_.peak_memory_bytes = std::max(stats_.peak_memory_bytes, bytes);
+  }
+
+ private:
+  void evictOldest(size_t num_evict, Landmarks& landmarks) {
+    num_evict = std::min(num_evict, landmarks.size());
+    if (num_evict == 0) return;
+
+    std::vector<TrackId> track_ids;
+    track_ids.reserve(landmarks.size());
+    for (const auto& kv : landmarks) track_ids.push_back(kv.first);
+    std::nth_element(track_ids.begin(), track_ids.begin() + num_evict - 1,
+                     track_ids.end());
+
+    for (size_t i = 0; i < num_evict; i++) {
+      auto it = landmarks.find(track_ids[i]);
+      if (archive_.isOpen()) archive_.write(it->first, it->second);
+      landmarks.erase(it);
+    }
+    stats_.evicted_landmarks += num_evict;
+  }
+
+  size_t memory_limit_;
+  StateArchive archive_;
+  RetentionStats stats_;
+};
+
+}  // namespace visnav
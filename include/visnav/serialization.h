@@ -183,6 +183,21 @@ void serialize(Archive& ar, LandmarkMatchData& m) {
   ar(CEREAL_NVP(m.T_w_c), CEREAL_NVP(m.inliers), CEREAL_NVP(m.matches));
 }
 
+// Descriptors are stored exactly like std::bitset<256> to stay compatible with
+// existing files (keypoints, maps and the vocabulary).
+template <class Archive>
+void save(Archive& ar, const Descriptor& d) {
+  const std::bitset<256> bits = d;
+  cereal::save(ar, bits);
+}
+
+template <class Archive>
+void load(Archive& ar, Descriptor& d) {
+  std::bitset<256> bits;
+  cereal::load(ar, bits);
+  d = bits;
+}
+
 template <class Archive>
 void serialize(Archive& ar, KeypointsData& m) {
   ar(CEREAL_NVP(m.corners), CEREAL_NVP(m.corner_angles),
@@ -194,6 +209,69 @@ void serialize(Archive& ar, Camera& c) {
   ar(CEREAL_NVP(c.T_w_c));
 }
 
+// SmallFlatMap, DenseMap and FeatureStore are stored like std::map and
+// std::unordered_map, so that the existing map files stay readable.
+template <class Archive, class K, class V, size_t N>
+void save(Archive& ar, const SmallFlatMap<K, V, N>& map) {
+  ar(make_size_tag(static_cast<size_type>(map.size())));
+  for (const auto& kv : map) ar(make_map_item(kv.first, kv.second));
+}
+
+template <class Archive, class K, class V, size_t N>
+void load(Archive& ar, SmallFlatMap<K, V, N>& map) {
+  size_type size;
+  ar(make_size_tag(size));
+
+  map.clear();
+  for (size_type i = 0; i < size; i++) {
+    K key;
+    V value;
+    ar(make_map_item(key, value));
+    map.emplace(key, value);
+  }
+}
+
+template <class Archive, class K, class V, class H>
+void save(Archive& ar, const DenseMap<K, V, H>& map) {
+  ar(make_size_tag(static_cast<size_type>(map.size())));
+  for (const auto& kv : map) ar(make_map_item(kv.first, kv.second));
+}
+
+template <class Archive, class K, class V, class H>
+void load(Archive& ar, DenseMap<K, V, H>& map) {
+  size_type size;
+  ar(make_size_tag(size));
+
+  map.clear();
+  map.reserve(size);
+  for (size_type i = 0; i < size; i++) {
+    K key;
+    V value;
+    ar(make_map_item(key, value));
+    map.emplace(key, std::move(value));
+  }
+}
+
+template <class Archive>
+void save(Archive& ar, const FeatureStore& store) {
+  ar(make_size_tag(static_cast<size_type>(store.size())));
+  for (const auto& kv : store) ar(make_map_item(kv.first, kv.second));
+}
+
+template <class Archive>
+void load(Archive& ar, FeatureStore& store) {
+  size_type size;
+  ar(make_size_tag(size));
+
+  store.clear();
+  for (size_type i = 0; i < size; i++) {
+    FrameCamId fcid;
+    KeypointsData kd;
+    ar(make_map_item(fcid, kd));
+    store[fcid] = std::move(kd);
+  }
+}
+
 template <class Archive>
 void serialize(Archive& ar, Landmark& lm) {
   ar(CEREAL_NVP(lm.p), CEREAL_NVP(lm.obs), CEREAL_NVP(lm.outlier_obs));
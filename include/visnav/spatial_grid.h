@@ -0,0 +1,155 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <Eigen/Dense>
+
+namespace visnav {
+
+/// Uniform grid index over a set of 2D points for fixed-radius queries. The
+/// points are bucketed into square cells once; a query only visits the cells
+/// overlapping the bounding box of the query circle, which for a radius up to
+/// the cell size are at most 3x3 cells. The grid references the points, so
+/// they have to outlive it.
+class SpatialGrid2d {
+ public:
+  typedef std::vector<Eigen::Vector2d,
+                      Eigen::aligned_allocator<Eigen::Vector2d>>
+      Points;
+
+  /// upper bound on the number of cells along each axis; for widely spread
+  /// points the cells are enlarged instead
+  static constexpr int MAX_CELLS_PER_AXIS = 1024;
+
+  /// cell size used if neither the requested size nor the spread of the
+  /// points is positive
+  static constexpr double MIN_CELL_SIZE = 1.0;
+
+  SpatialGrid2d(const Points& points, double cell_size)
+      : points_(points), cell_size_(cell_size) {
+    if (points.empty()) return;
+
+    min_ = points[0];
+    Eigen::Vector2d max = points[0];
+    for (const auto& p : points) {
+      min_ = min_.cwiseMin(p);
+      max = max.cwiseMax(p);
+    }
+
+    cell_size_ = std::max(cell_size_,
+                          (max - min_).maxCoeff() / (MAX_CELLS_PER_AXIS - 1));
+
+    // non-positive cell sizes, e.g. a match radius of 0, give a single cell if
+    // all points coincide
+    if (!(cell_size_ > 0)) cell_size_ = MIN_CELL_SIZE;
+
+    num_cols_ = int((max.x() - min_.x()) / cell_size_) + 1;
+    num_rows_ = int((max.y() - min_.y()) / cell_size_) + 1;
+
+    // counting sort of the point indices by cell; indices stay in increasing
+    // order within each cell
+    cell_start_.assign(num_cols_ * num_rows_ + 1, 0);
+    std::vector<int> point_cell(points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+      point_cell[i] = cellIndex(col(points[i].x()), row(points[i].y()));
+      cell_start_[point_cell[i] + 1]++;
+    }
+    for (size_t c = 1; c < cell_start_.size(); c++) {
+      cell_start_[c] += cell_start_[c - 1];
+    }
+
+    cell_points_.resize(points.size());
+    std::vector<int> fill(cell_start_.begin(), cell_start_.end() - 1);
+    for (size_t i = 0; i < points.size(); i++) {
+      cell_points_[fill[point_cell[i]]++] = i;
+    }
+  }
+
+  /// Indices (in increasing order) of all points p with |p - center| <= radius.
+  void query(const Eigen::Vector2d& center, double radius,
+             std::vector<size_t>& indices) const {
+    indices.clear();
+    if (points_.empty()) return;
+
+    const int col_begin = std::max(col(center.x() - radius), 0);
+    const int col_end = std::min(col(center.x() + radius), num_cols_ - 1);
+    const int row_begin = std::max(row(center.y() - radius), 0);
+    const int row_end = std::min(row(center.y() + radius), num_rows_ - 1);
+
+    const double radius_sq = radius * radius;
+    for (int r = row_begin; r <= row_end; r++) {
+      for (int c = col_begin; c <= col_end; c++) {
+        const int cell = cellIndex(c, r);
+        for (int k = cell_start_[cell]; k < cell_start_[cell + 1]; k++) {
+          const size_t i = cell_points_[k];
+          if ((points_[i] - center).squaredNorm() <= radius_sq) {
+            indices.push_back(i);
+          }
+        }
+      }
+    }
+
+    // callers rely on the same order as a linear scan over all points
+    std::sort(indices.begin(), indices.end());
+  }
+
+ private:
+  // may be outside of [0, num_cols_) for query points outside the grid
+  int col(double x) const {
+    return int(std::floor((x - min_.x()) / cell_size_));
+  }
+  int row(double y) const {
+    return int(std::floor((y - min_.y()) / cell_size_));
+  }
+  int cellIndex(int c, int r) const { return r * num_cols_ + c; }
+
+  const Points& points_;
+  double cell_size_;
+
+  Eigen::Vector2d min_;
+  int num_cols_ = 0;
+  int num_rows_ = 0;
+
+  /// points of cell c are cell_points_[cell_start_[c] .. cell_start_[c + 1])
+  std::vector<int> cell_start_;
+  std::vector<size_t> cell_points_;
+
+ public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+}  // namespace visnav
@@ -0,0 +1,145 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace visnav {
+
+/// Bounded lock-free queue for exactly one producer thread and one consumer
+/// thread. The elements live in a ring whose size is rounded up to a power of
+/// two; the producer only writes the tail index and the consumer only the
+/// head index, each on its own cache line, and both keep a cached copy of the
+/// other index so they touch the shared one only when the ring looks full or
+/// empty.
+///
+/// push and pop wait while the queue is full or empty, first yielding and then
+/// sleeping for short intervals. Either side can close the queue: a closed
+/// queue rejects new elements and pop returns the remaining ones before
+/// reporting the end.
+template <class T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size *= 2;
+    buffer_.resize(size);
+    mask_ = size - 1;
+  }
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  size_t capacity() const { return buffer_.size(); }
+
+  /// Append value if there is space. Producer only.
+  bool tryPush(T&& value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_cache_ == buffer_.size()) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail - head_cache_ == buffer_.size()) return false;
+    }
+
+    buffer_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Remove the oldest element into value if there is one. Consumer only.
+  bool tryPop(T& value) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head == tail_cache_) return false;
+    }
+
+    value = std::move(buffer_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Append value, waiting while the queue is full. Returns false (and drops
+  /// value) if the queue is closed. Producer only.
+  bool push(T value) {
+    for (int spin = 0; !closed(); spin++) {
+      if (tryPush(std::move(value))) return true;
+      backoff(spin);
+    }
+    return false;
+  }
+
+  /// Remove the oldest element into value, waiting while the queue is empty.
+  /// Returns false once the queue is closed and empty. Consumer only.
+  bool pop(T& value) {
+    for (int spin = 0;; spin++) {
+      if (tryPop(value)) return true;
+      // elements pushed before close are still delivered
+      if (closed()) return tryPop(value);
+      backoff(spin);
+    }
+  }
+
+  /// Wake up and end both sides; see push and pop.
+  void close() { closed_.store(true, std::memory_order_release); }
+
+  bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+ private:
+  static void backoff(int spin) {
+    if (spin < 64) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+
+  std::vector<T> buffer_;
+  size_t mask_;
+
+  // consumer side: next element to pop and last seen tail
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t tail_cache_ = 0;
+
+  // producer side: next free element and last seen head
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t head_cache_ = 0;
+
+  alignas(64) std::atomic<bool> closed_{false};
+};
+
+}  // namespace visnav
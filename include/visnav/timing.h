@@ -0,0 +1,113 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace visnav {
+
+/// Wall-clock stopwatch started on construction.
+class Timer {
+ public:
+  Timer() : start_(std::chrono::steady_clock::now()) {}
+
+  void reset() { start_ = std::chrono::steady_clock::now(); }
+
+  /// seconds since construction or the last reset
+  double elapsed() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start_)
+        .count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+/// Latency samples (in seconds) of a processing stage. Not synchronized; each
+/// instance is meant to be written by a single thread.
+class LatencyStats {
+ public:
+  void add(double seconds) {
+    samples_.push_back(seconds);
+    total_ += seconds;
+  }
+
+  size_t count() const { return samples_.size(); }
+
+  double total() const { return total_; }
+
+  double mean() const { return samples_.empty() ? 0 : total_ / count(); }
+
+  double max() const {
+    return samples_.empty()
+               ? 0
+               : *std::max_element(samples_.begin(), samples_.end());
+  }
+
+  /// Nearest-rank percentile for p in [0, 100].
+  double percentile(double p) const {
+    if (samples_.empty()) return 0;
+
+    std::vector<double> sorted = samples_;
+    const size_t rank = std::min<size_t>(
+        std::max<double>(std::ceil(p / 100 * sorted.size()), 1),
+        sorted.size());
+    std::nth_element(sorted.begin(), sorted.begin() + rank - 1, sorted.end());
+    return sorted[rank - 1];
+  }
+
+ private:
+  std::vector<double> samples_;
+  double total_ = 0;
+};
+
+/// Peak resident set size of the process in bytes.
+inline size_t peak_rss_bytes() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return size_t(usage.ru_maxrss);
+#else
+  // reported in kilobytes on Linux
+  return size_t(usage.ru_maxrss) * 1024;
+#endif
+}
+
+}  // namespace visnav
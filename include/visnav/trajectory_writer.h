@@ -0,0 +1,88 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <fstream>
+#include <iomanip>
+#include <string>
+
+#include <sophus/se3.hpp>
+
+#include <visnav/common_types.h>
+
+namespace visnav {
+
+/// Writes a trajectory pose by pose while it is estimated, one line per pose
+/// in the format of the trajectories saved for tum_benchmark_tools:
+/// "timestamp tx ty tz qx qy qz qw". The file is flushed every flush_interval
+/// poses, so an interrupted run leaves all but the last few poses on disk.
+class TrajectoryWriter {
+ public:
+  explicit TrajectoryWriter(size_t flush_interval = 100)
+      : flush_interval_(flush_interval) {}
+
+  /// Create or truncate the file at path. Returns false if it cannot be
+  /// written.
+  bool open(const std::string& path) {
+    close();
+    os_.open(path, std::ios::trunc);
+    return os_.is_open();
+  }
+
+  bool isOpen() const { return os_.is_open(); }
+
+  void close() {
+    if (os_.is_open()) os_.close();
+    num_poses_ = 0;
+  }
+
+  void write(Timestamp t_ns, const Sophus::SE3d& T_w_i) {
+    const Eigen::Vector3d& t = T_w_i.translation();
+    const Eigen::Quaterniond& q = T_w_i.unit_quaternion();
+    os_ << std::scientific << std::setprecision(18) << t_ns << " " << t.x()
+        << " " << t.y() << " " << t.z() << " " << q.x() << " " << q.y() << " "
+        << q.z() << " " << q.w() << "\n";
+
+    if (++num_poses_ % flush_interval_ == 0) os_.flush();
+  }
+
+  /// number of poses written since the file was opened
+  size_t numPoses() const { return num_poses_; }
+
+ private:
+  std::ofstream os_;
+  size_t flush_interval_;
+  size_t num_poses_ = 0;
+};
+
+}  // namespace visnav
@@ -32,11 +32,13 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 
+#include <limits>
 #include <set>
 
 #include <visnav/common_types.h>
 
 #include <visnav/calibration.h>
+#include <visnav/spatial_grid.h>
 
 #include <opengv/absolute_pose/CentralAbsoluteAdapter.hpp>
 #include <opengv/absolute_pose/methods.hpp>
@@ -62,29 +64,28 @@ void project_landmarks(
 // projected_points and the corresponding id of the landmark into
 // projected_track_ids.
 
-  // Extract the rotation (R) and translation (T) from the current_pose
-
+  // gather the landmark positions into a structure of arrays and transform,
+  // cull and project them in one batch
+  Eigen::Matrix<double, Eigen::Dynamic, 3> p_w(landmarks.size(), 3);
+  std::vector<TrackId> track_ids;
+  track_ids.reserve(landmarks.size());
   for (const auto& [track_id, landmark] : landmarks) {
-      // Transform landmark to camera coordinates
-    Eigen::Vector3d P_c = current_pose.inverse() * landmark.p;
-      // Ignore points behind the camera
-      if (P_c.z() < cam_z_threshold) {
-          continue;
-      }
-
-      // Project the 3D point to 2D using the camera model
-      auto p_i = cam->project(P_c);
-      
-
-      auto image_width = cam->width();
-      auto image_height = cam->height();
-
-      // Store the valid projection
-      if (p_i.x() >= 0 && p_i.x() < image_width && p_i.y() >= 0 && p_i.y() < image_height) {
-      projected_points.push_back(p_i);
-      projected_track_ids.push_back(track_id);}
+    p_w.row(track_ids.size()) = landmark.p.transpose();
+    track_ids.push_back(track_id);
   }
 
+  Eigen::Matrix<double, Eigen::Dynamic, 3> p_c;
+  Eigen::Matrix<double, Eigen::Dynamic, 2> p_2d;
+  std::vector<int> indices;
+  const size_t num_projected = cam->projectWorldBatch(
+      current_pose, p_w, cam_z_threshold, true, p_c, p_2d, indices);
+
+  projected_points.reserve(num_projected);
+  projected_track_ids.reserve(num_projected);
+  for (size_t i = 0; i < num_projected; i++) {
+    projected_points.emplace_back(p_2d(i, 0), p_2d(i, 1));
+    projected_track_ids.push_back(track_ids[indices[i]]);
+  }
 }
 
 void find_matches_landmarks(
@@ -116,6 +117,11 @@ void find_matches_landmarks(
   // UNUSED(feature_match_threshold);
   // UNUSED(feature_match_dist_2_best);
 
+  // bucket the projections once so that each keypoint only looks at the
+  // landmarks in its neighbourhood
+  const SpatialGrid2d grid(projected_points, match_max_dist_2d);
+  std::vector<size_t> nearby;
+
    for (size_t i = 0; i < kdl.corners.size(); ++i) {
     const Eigen::Vector2d& keypoint = kdl.corners[i];
     const auto& descriptor = kdl.corner_descriptors[i];
@@ -125,38 +131,39 @@ void find_matches_landmarks(
 
     //std::cout << "Keypoint " << i << ": " << keypoint.transpose() << std::endl;
 
-    for (size_t j = 0; j < projected_points.size(); ++j) {
-      const Eigen::Vector2d& projected_point = projected_points[j];
+    grid.query(keypoint, match_max_dist_2d, nearby);
+
+    for (const size_t j : nearby) {
       TrackId track_id = projected_track_ids[j];
+      const Landmark& landmark = landmarks.at(track_id);
 
-      if ((keypoint - projected_point).norm() <= match_max_dist_2d) {
-          const Landmark& landmark = landmarks.at(track_id);
-
-          // Find the minimum distance for the current landmark
-          int min_landmark_dist = INT_MAX;
-          for (const auto& [frame_cam_id, feature_id] : landmark.obs) {
-            const KeypointsData& kd = feature_corners.at(frame_cam_id);
-            const auto& landmark_descriptor = kd.corner_descriptors[feature_id];
-            int dist = (descriptor ^ landmark_descriptor).count();
-            // std::cout << "  Projected point " << j << ": " << projected_point.transpose()
-            // << ", Distance: " << dist << ", Track ID: " << track_id 
-            // << " landmark's frame cam id: "<< frame_cam_id<< " feature id: "<< feature_id << std::endl;
-
-            if (dist < min_landmark_dist) {
-              min_landmark_dist = dist;
-            }
-          }
+      // Find the minimum distance for the current landmark. Landmarks
+      // created by add_new_landmarks carry a fixed-size descriptor cache; for
+      // all others every observation is compared.
+      int min_landmark_dist = INT_MAX;
+      if (landmark.hasDescriptorCache()) {
+        min_landmark_dist = landmark.descriptors.minDistance(descriptor);
+      } else {
+        for (const auto& [frame_cam_id, feature_id] : landmark.obs) {
+          const KeypointsData& kd = feature_corners.at(frame_cam_id);
+          const auto& landmark_descriptor = kd.corner_descriptors[feature_id];
+          int dist = hammingDistance(descriptor, landmark_descriptor);
 
-          if (min_landmark_dist < best_dist) {
-            second_best_dist = best_dist;
-            best_dist = min_landmark_dist;
-            best_track_id = track_id;
-          } else if (min_landmark_dist < second_best_dist) {
-            second_best_dist = min_landmark_dist;
+          if (dist < min_landmark_dist) {
+            min_landmark_dist = dist;
           }
         }
       }
 
+      if (min_landmark_dist < best_dist) {
+        second_best_dist = best_dist;
+        best_dist = min_landmark_dist;
+        best_track_id = track_id;
+      } else if (min_landmark_dist < second_best_dist) {
+        second_best_dist = min_landmark_dist;
+      }
+    }
+
     if(best_dist < feature_match_threshold &&
         second_best_dist >= best_dist * feature_match_dist_2_best) {
       md.matches.emplace_back(i, best_track_id);
@@ -252,19 +259,100 @@ void localize_camera(const Sophus::SE3d& current_pose,
   md.T_w_c = Sophus::SE3d(non_linear_transformation.block<3,3>(0,0), non_linear_transformation.block<3,1>(0,3));
 }
 
+// Add the observation of landmark lm by feature fid of image fcid, whose
+// keypoints are kd, and keep the descriptor cache of lm in sync. Returns false
+// if lm already has an observation in fcid.
+bool add_landmark_observation(Landmark& lm, const FrameCamId& fcid,
+                              const FeatureId fid, const KeypointsData& kd) {
+  if (lm.obs.empty()) lm.descriptors.clear();
+  const bool cached = lm.obs.empty() || lm.hasDescriptorCache();
+
+  if (!lm.obs.emplace(fcid, fid).second) return false;
+
+  if (cached) lm.descriptors.add(fcid, kd.corner_descriptors[fid]);
+  return true;
+}
+
+// Remove the observation of landmark lm in image fcid, if there is one. The
+// descriptor cache is updated if feature_corners is given and dropped
+// otherwise.
+void remove_landmark_observation(Landmark& lm, const FrameCamId& fcid,
+                                 const Corners* feature_corners) {
+  auto it = lm.obs.find(fcid);
+  if (it == lm.obs.end()) return;
+
+  if (feature_corners && lm.hasDescriptorCache()) {
+    lm.descriptors.remove(
+        fcid, feature_corners->at(fcid).corner_descriptors[it->second]);
+  } else {
+    lm.descriptors.clear();
+  }
+
+  lm.obs.erase(it);
+}
+
+/// minimal angle between the two viewing rays of a new stereo landmark; points
+/// with less parallax have an unreliable depth
+const double STEREO_MIN_PARALLAX = 0.01 * M_PI / 180;
+
+// Triangulate the points seen along the bearing vectors in the columns of f0
+// (in camera 0) and f1 (in camera 1) with the midpoint method, all columns in
+// one vectorized pass. T_0_1 is the pose of camera 1 in camera 0 and the points
+// are returned in camera 0. valid is false for points that are not in front of
+// both cameras or whose rays have less than min_parallax (in radians) between
+// them.
+void triangulate_midpoint_batch(const Sophus::SE3d& T_0_1,
+                                const Eigen::Matrix3Xd& f0,
+                                const Eigen::Matrix3Xd& f1,
+                                double min_parallax,
+                                Eigen::Matrix3Xd& points,
+                                std::vector<bool>& valid) {
+  const Eigen::Vector3d t = T_0_1.translation();
+
+  // ray i is d0 * f0_i from the origin and t + d1 * f1_i; the depths minimize
+  // the distance between the two points on the rays
+  const Eigen::Matrix3Xd f1_0 = T_0_1.so3().matrix() * f1;
+  const Eigen::ArrayXd a = f0.colwise().squaredNorm().transpose();
+  const Eigen::ArrayXd b = (f0.cwiseProduct(f1_0)).colwise().sum().transpose();
+  const Eigen::ArrayXd c = f1_0.colwise().squaredNorm().transpose();
+  const Eigen::ArrayXd d = (t.transpose() * f0).transpose().array();
+  const Eigen::ArrayXd e = (t.transpose() * f1_0).transpose().array();
+
+  const Eigen::ArrayXd denom = a * c - b * b;
+  const Eigen::ArrayXd d0 = (c * d - b * e) / denom;
+  const Eigen::ArrayXd d1 = (b * d - a * e) / denom;
+
+  points = 0.5 * (f0 * d0.matrix().asDiagonal() +
+                  f1_0 * d1.matrix().asDiagonal());
+  points.colwise() += 0.5 * t;
+
+  // cosine of the angle between the rays
+  const Eigen::ArrayXd cos_parallax = b / (a * c).sqrt();
+  const double max_cos_parallax = std::cos(min_parallax);
+
+  valid.resize(f0.cols());
+  for (Eigen::Index i = 0; i < f0.cols(); i++) {
+    valid[i] = d0[i] > 0 && d1[i] > 0 && cos_parallax[i] < max_cos_parallax;
+  }
+}
 
+// Add the observations of the current stereo keyframe to the map: the left
+// features matched to landmarks in md (and their stereo matches in the right
+// image) become observations of these landmarks, and the remaining stereo
+// inliers are triangulated into new landmarks. Stereo pairs that cannot be
+// triangulated reliably (see triangulate_midpoint_batch) are skipped. If
+// frame_landmarks is given, the added observations are recorded in it.
 void add_new_landmarks(const FrameCamId fcidl, const FrameCamId fcidr,
                        const KeypointsData& kdl, const KeypointsData& kdr,
                        const Calibration& calib_cam, const MatchData& md_stereo,
                        const LandmarkMatchData& md, Landmarks& landmarks,
-                       TrackId& next_landmark_id) {
+                       TrackId& next_landmark_id,
+                       FrameLandmarkIndex* frame_landmarks = nullptr) {
   // input should be stereo pair
   assert(fcidl.cam_id == 0);
   assert(fcidr.cam_id == 1);
 
   const Sophus::SE3d T_0_1 = calib_cam.T_i_c[0].inverse() * calib_cam.T_i_c[1];
-  const Eigen::Vector3d t_0_1 = T_0_1.translation();
-  const Eigen::Matrix3d R_0_1 = T_0_1.rotationMatrix();
 
   // TODO SHEET 5: Add new landmarks and observations. Here md_stereo contains
   // stereo matches for the current frame and md contains feature to landmark
@@ -275,65 +363,79 @@ void add_new_landmarks(const FrameCamId fcidl, const FrameCamId fcidr,
   // existing landmarks, triangulate and add new landmarks. Here
   // next_landmark_id is a running index of the landmarks, so after adding a new
   // landmark you should always increase next_landmark_id by 1.
-  for (auto& kv : md.inliers) {  // In this frame
-    const FeatureId& f_id = kv.first;
-    const TrackId& t_id = kv.second;
-    if (landmarks.count(t_id) > 0)  // landmark exists
-    {
-      landmarks.at(t_id).obs.emplace(std::make_pair(fcidl, f_id));
-
-      // Check if feature id also exist in stereo pair
-      for (auto& inlier_pair : md_stereo.inliers) {
-        if (inlier_pair.first == f_id) {
-          landmarks.at(t_id).obs.emplace(
-              std::make_pair(fcidr, inlier_pair.second));
-          break;
-        }
-      }
-    } else {
+
+  // stereo match of every left feature (NO_MATCH if there is none) and
+  // whether it is already matched to a landmark
+  constexpr FeatureId NO_MATCH = std::numeric_limits<FeatureId>::max();
+  std::vector<FeatureId> stereo_match(kdl.corners.size(), NO_MATCH);
+  for (const auto& kv : md_stereo.inliers) stereo_match[kv.first] = kv.second;
+
+  std::vector<bool> has_landmark(kdl.corners.size(), false);
+
+  for (const auto& [f_id, t_id] : md.inliers) {
+    has_landmark[f_id] = true;
+
+    auto it = landmarks.find(t_id);
+    if (it == landmarks.end()) continue;
+
+    if (add_landmark_observation(it->second, fcidl, f_id, kdl) &&
+        frame_landmarks) {
+      frame_landmarks->add(fcidl, t_id);
     }
-  }
-  for (auto& kv : md_stereo.inliers) {
-    const FeatureId& f_idl = kv.first;
-    const FeatureId& f_idr = kv.second;
-    int counter = 0;
-    for (auto& fid_tid : md.inliers) {
-      const FeatureId& fid = fid_tid.first;
-      if (fid == f_idl) {
-        // Already exist
-        counter++;
-        break;
-      } else {
-      }
+
+    const FeatureId f_idr = stereo_match[f_id];
+    if (f_idr != NO_MATCH &&
+        add_landmark_observation(it->second, fcidr, f_idr, kdr) &&
+        frame_landmarks) {
+      frame_landmarks->add(fcidr, t_id);
     }
-    if (counter == 0) {
-      // DO TRIANGULATION
-      opengv::bearingVectors_t bearingVectors1;
-      opengv::bearingVectors_t bearingVectors2;
-
-      bearingVectors1.push_back(
-          calib_cam.intrinsics[fcidl.cam_id]->unproject(kdl.corners.at(f_idl)));
-      bearingVectors2.push_back(
-          calib_cam.intrinsics[fcidr.cam_id]->unproject(kdr.corners.at(f_idr)));
-
-      opengv::relative_pose::CentralRelativeAdapter adapter(
-          bearingVectors1, bearingVectors2, t_0_1, R_0_1);
-      opengv::point_t point =
-          md.T_w_c * opengv::triangulation::triangulate(adapter, 0);
-      Landmark l;
-      l.p = point;
-      l.obs.emplace(std::make_pair(fcidl, f_idl));
-      l.obs.emplace(std::make_pair(fcidr, f_idr));
-      landmarks.emplace(std::make_pair(next_landmark_id++, l));
+  }
+
+  // triangulate all stereo inliers without a landmark in one batch
+  std::vector<std::pair<FeatureId, FeatureId>> new_pairs;
+  for (const auto& kv : md_stereo.inliers) {
+    if (!has_landmark[kv.first]) new_pairs.push_back(kv);
+  }
+
+  Eigen::Matrix3Xd f0(3, new_pairs.size()), f1(3, new_pairs.size());
+  for (size_t i = 0; i < new_pairs.size(); i++) {
+    f0.col(i) = calib_cam.intrinsics[fcidl.cam_id]->unproject(
+        kdl.corners.at(new_pairs[i].first));
+    f1.col(i) = calib_cam.intrinsics[fcidr.cam_id]->unproject(
+        kdr.corners.at(new_pairs[i].second));
+  }
+
+  Eigen::Matrix3Xd points;
+  std::vector<bool> valid;
+  triangulate_midpoint_batch(T_0_1, f0, f1, STEREO_MIN_PARALLAX, points,
+                             valid);
+
+  for (size_t i = 0; i < new_pairs.size(); i++) {
+    if (!valid[i]) continue;
+
+    const auto& [f_idl, f_idr] = new_pairs[i];
+
+    Landmark l;
+    l.p = md.T_w_c * points.col(i);
+    add_landmark_observation(l, fcidl, f_idl, kdl);
+    add_landmark_observation(l, fcidr, f_idr, kdr);
+    if (frame_landmarks) {
+      frame_landmarks->add(fcidl, next_landmark_id);
+      frame_landmarks->add(fcidr, next_landmark_id);
     }
+    landmarks.emplace(next_landmark_id++, std::move(l));
   }
 }
 
+// If frame_landmarks is given, it must index all observations of landmarks;
+// then only the landmarks observed in the removed keyframes are visited.
 bool delete_oldframes(const FrameCamId fcidl, const int max_num_kfs,
                           Cameras& cameras, Landmarks& landmarks,
                           Landmarks& old_landmarks,
                           std::set<FrameId>& kf_frames, Camera& removed_camera,
-                          FrameId& removed_fid) {
+                          FrameId& removed_fid,
+                          const Corners* feature_corners = nullptr,
+                          FrameLandmarkIndex* frame_landmarks = nullptr) {
   kf_frames.emplace(fcidl.frame_id);
   
   bool removed = false;   // remove elements from three containers : 1landmarks; 2cameras ; 3kf_frames;
@@ -370,10 +472,27 @@ bool delete_oldframes(const FrameCamId fcidl, const int max_num_kfs,
     cameras.erase(left_cam_id);
     cameras.erase(right_cam_id);
 
+    if (frame_landmarks) {
+      // only visit the landmarks observed in the removed keyframe
+      for (const FrameCamId& fcid : {left_cam_id, right_cam_id}) {
+        for (const TrackId track_id : frame_landmarks->take(fcid)) {
+          auto it = landmarks.find(track_id);
+          if (it == landmarks.end()) continue;
+
+          remove_landmark_observation(it->second, fcid, feature_corners);
+          if (it->second.obs.empty()) {
+            old_landmarks[it->first] = std::move(it->second);
+            landmarks.erase(it);
+          }
+        }
+      }
+      continue;
+    }
+
     // traverse landmarks and delete obervation
     for (auto it = landmarks.begin(); it != landmarks.end();) {
-      it->second.obs.erase(left_cam_id);
-      it->second.obs.erase(right_cam_id);
+      remove_landmark_observation(it->second, left_cam_id, feature_corners);
+      remove_landmark_observation(it->second, right_cam_id, feature_corners);
 
       if (it->second.obs.empty()) {
         // move landmarks with no oberservation into old_landmarks
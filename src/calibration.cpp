@@ -95,6 +95,10 @@ pangolin::Var<bool> show_opt("ui.show_opt", true, true);
 std::string dataset_path;
 std::string cam_model = "ds";
 
+// use the hand-derived reprojection Jacobians instead of automatic
+// differentiation
+pangolin::Var<bool> analytic_jacobians("ui.analytic_jacobians", true, true);
+
 int main(int argc, char** argv) {
   const int UI_WIDTH = 200;
   const int NUM_CAMS = 2;
@@ -382,11 +386,11 @@ void optimize() {
           
         for (size_t i = 0; i < corner.corner_ids.size(); i++){
               auto& corner_id = corner.corner_ids[i];
-              ReprojectionCostFunctor* c = 
-                    new ReprojectionCostFunctor(corner.corners[i], aprilgrid.aprilgrid_corner_pos_3d[corner_id], cam_model);
-              ceres::CostFunction* cost_function = 
-                  new ceres::AutoDiffCostFunction<ReprojectionCostFunctor, 2,
-                   Sophus::SE3d::num_parameters, Sophus::SE3d::num_parameters, 8>(c);
+              ceres::CostFunction* cost_function =
+                  createReprojectionCostFunction(
+                      corner.corners[i],
+                      aprilgrid.aprilgrid_corner_pos_3d[corner_id], cam_model,
+                      analytic_jacobians);
 
               problem.AddResidualBlock(cost_function, new ceres::CauchyLoss(0.5),
                             T_w_i.data(), T_i_c.data(), calib_cam.intrinsics.at(id.cam_id)->data());
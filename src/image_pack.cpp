@@ -0,0 +1,127 @@
+/**
+BSD 3-Clause License
+
+Copyright (c) 2018, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <CLI/CLI.hpp>
+
+#include <tbb/parallel_for.h>
+
+#include <pangolin/image/image_io.h>
+
+#include <visnav/dataset_images.h>
+#include <visnav/image_pack.h>
+
+using namespace visnav;
+
+// Converts the images of a dataset into an image pack (see image_pack.h), so
+// that odometry and sfm can map them instead of decoding them on every run.
+
+constexpr int NUM_CAMS = 2;
+
+// number of images decoded in parallel before they are written
+constexpr size_t DECODE_BATCH_SIZE = 64;
+
+int main(int argc, char** argv) {
+  std::string dataset_path = "data/V1_01_easy/mav0";
+  std::string output_path;
+
+  CLI::App app{"Convert the images of a dataset into an image pack."};
+
+  app.add_option("--dataset-path", dataset_path,
+                 "Dataset path, either with cam0/data.csv (odometry) or "
+                 "timestamps.txt (sfm).");
+  app.add_option("--output", output_path,
+                 "Output file. Default: <dataset-path>/images.pack");
+
+  try {
+    app.parse(argc, argv);
+  } catch (const CLI::ParseError& e) {
+    return app.exit(e);
+  }
+
+  if (output_path.empty()) output_path = dataset_path + "/images.pack";
+
+  std::vector<DatasetImage> images;
+  if (std::ifstream(dataset_path + "/cam0/data.csv")) {
+    list_euroc_images(dataset_path, NUM_CAMS, images);
+  } else if (std::ifstream(dataset_path + "/timestamps.txt")) {
+    list_sfm_images(dataset_path, NUM_CAMS, 0, images);
+  } else {
+    std::cerr << "Found neither cam0/data.csv nor timestamps.txt in "
+              << dataset_path << std::endl;
+    return 1;
+  }
+
+  ImagePackWriter writer;
+  if (!writer.open(output_path)) return 1;
+
+  size_t num_bytes = 0;
+  std::vector<pangolin::TypedImage> decoded;
+  for (size_t begin = 0; begin < images.size(); begin += DECODE_BATCH_SIZE) {
+    const size_t end = std::min(begin + DECODE_BATCH_SIZE, images.size());
+
+    decoded.clear();
+    decoded.resize(end - begin);
+    tbb::parallel_for(begin, end, [&](size_t i) {
+      decoded[i - begin] = pangolin::LoadImage(images[i].path);
+    });
+
+    for (size_t i = begin; i < end; i++) {
+      const pangolin::TypedImage& img = decoded[i - begin];
+      if (img.fmt.channels != 1 || img.fmt.bpp != 8) {
+        std::cerr << images[i].path << " is not an 8-bit grayscale image"
+                  << std::endl;
+        return 1;
+      }
+      if (!writer.add(images[i].fcid, images[i].timestamp, img)) {
+        std::cerr << "Writing " << output_path << " failed." << std::endl;
+        return 1;
+      }
+      num_bytes += img.w * img.h;
+    }
+
+    std::cout << "\rPacked " << end << " / " << images.size() << " images"
+              << std::flush;
+  }
+  std::cout << std::endl;
+
+  if (!writer.finish()) return 1;
+
+  std::cout << "Wrote " << images.size() << " images (" << num_bytes / 1048576
+            << " MiB) to " << output_path << std::endl;
+
+  return 0;
+}
@@ -34,6 +34,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <iomanip>
 #include <iostream>
 #include <queue>
 #include <sophus/se3.hpp>
@@ -43,6 +44,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <time.h>
 
 #include <tbb/concurrent_unordered_map.h>
+#include <tbb/parallel_for.h>
 #include <pangolin/display/image_view.h>
 #include <pangolin/display/default_font.h>
 #include <pangolin/image/image.h>
@@ -52,17 +54,28 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
 
+#include <visnav/bearing_lut_camera.h>
 #include <visnav/common_types.h>
+#include <visnav/dataset_images.h>
 
 #include <visnav/calibration.h>
 
 #include <visnav/keypoints.h>
 #include <visnav/map_utils.h>
 #include <visnav/matching_utils.h>
+#include <visnav/optical_flow.h>
 #include <visnav/vo_utils.h>
 
 #include <visnav/gui_helper.h>
+#include <visnav/image_pack.h>
+#include <visnav/image_prefetcher.h>
+#include <visnav/map_optimizer.h>
+#include <visnav/projection_cache.h>
+#include <visnav/retention.h>
+#include <visnav/spsc_queue.h>
+#include <visnav/timing.h>
 #include <visnav/tracks.h>
+#include <visnav/trajectory_writer.h>
 
 #include <visnav/serialization.h>
 #include <visnav/imudata_load.h>
@@ -80,10 +93,28 @@ using namespace visnav;
 void draw_image_overlay(pangolin::View& v, size_t view_id);
 void change_display_to_image(const FrameCamId& fcid);
 void draw_scene();
-void load_data(const std::string& path, const std::string& calib_path);
+void load_data(const std::string& path, const std::string& calib_path,
+               const std::string& image_pack_path);
 bool next_step();
-void optimize();
+DetectorMethod detector_method();
+DescriptorMethod descriptor_method();
+void start_pipeline();
+void stop_pipeline();
+void track_landmarks(const ImagePyramid& pyramid, KeypointsData& kd,
+                     LandmarkMatchData& md);
+void set_tracked_landmarks(
+    const KeypointsData& kd,
+    const std::vector<std::pair<FeatureId, TrackId>>& observations);
+void optimize(MapDelta& delta);
+void merge_optimized_map();
 void compute_projections();
+void update_bearing_luts();
+void print_prefetch_stats();
+void print_pipeline_stats();
+void print_memory_stats();
+void print_run_stats(int num_frames, double seconds);
+void release_features(FrameId frame_id);
+void evict_history(const std::vector<FrameId>& removed_frames);
 
 ///////////////////////////////////////////////////////////////////////////////
 /// Declarations for IMU 
@@ -111,6 +142,49 @@ double SVD_APPLY();
 constexpr int UI_WIDTH = 200;
 constexpr int NUM_CAMS = 2;
 
+/// views of the images of all cameras of a frame
+typedef std::array<pangolin::Image<uint8_t>, NUM_CAMS> FrameImageViews;
+
+FrameImageViews frame_images(FrameId frame_id);
+
+/// settings of the feature extraction; fixed while the extraction thread runs,
+/// which must not read the GUI variables
+struct FeatureExtractionOptions {
+  int num_features = 1500;
+  bool rotate_features = true;
+  DetectorMethod detector_method = DetectorMethod::GoodFeatures;
+  DescriptorMethod descriptor_method = DescriptorMethod::Exact;
+  bool klt_tracking = false;
+};
+
+/// output of the feature extraction stage for a frame: the keypoints of the
+/// cameras detected so far, the images of the other cameras so they can be
+/// detected on demand, and in KLT mode the pyramid of the left image; the
+/// images are views into the image pack or into image_copies
+struct ExtractedFrame {
+  FrameId frame_id = -1;
+  bool klt_tracking = false;
+  std::array<bool, NUM_CAMS> detected{};
+  std::array<KeypointsData, NUM_CAMS> keypoints;
+  std::array<pangolin::Image<uint8_t>, NUM_CAMS> images;
+  std::array<pangolin::ManagedImage<uint8_t>, NUM_CAMS> image_copies;
+  ImagePyramid pyramid;
+};
+
+/// latencies of the pipeline stages: image acquisition and feature extraction
+/// (both on the extraction thread, or inline without it) and tracking on the
+/// main thread; the bundle adjustment worker keeps its own
+struct PipelineStats {
+  LatencyStats acquisition;
+  LatencyStats extraction;
+  LatencyStats tracking;
+  LatencyStats tracking_wait;
+};
+
+void extract_features(FrameId frame_id, ExtractedFrame& frame);
+void detect_keypoints(ExtractedFrame& frame);
+void track_frame(ExtractedFrame& frame);
+
 ///////////////////////////////////////////////////////////////////////////////
 /// Variables
 ///////////////////////////////////////////////////////////////////////////////
@@ -118,14 +192,17 @@ constexpr int NUM_CAMS = 2;
 int current_frame = 0;
 Sophus::SE3d current_pose;
 bool take_keyframe = true;
+size_t num_keyframes = 0;
 TrackId next_landmark_id = 0;
 
-std::atomic<bool> opt_running{false};
-std::atomic<bool> opt_finished{false};
-
 std::set<FrameId> kf_frames;
 
-std::shared_ptr<std::thread> opt_thread;
+/// bundle adjustment worker, fed with the changes of every keyframe; started
+/// with the first keyframe
+std::unique_ptr<MapOptimizer> map_optimizer;
+
+/// version of the last optimization result merged into the map
+uint64_t map_version = 0;
 
 ///the num that is allowed to exist in the map (default size: 11)
 size_t num_latest_frames = 11; 
@@ -133,7 +210,6 @@ std::vector<FrameCamId> removed_fcid_buffer;
 
 /// intrinsic calibration
 Calibration calib_cam;
-Calibration calib_cam_opt;
 CalibAccelBias<double> calib_acc;
 CalibGyroBias<double> calib_gyro;
 
@@ -162,30 +238,60 @@ Eigen::aligned_map<Timestamp, PoseVelState<double>> frame_states_kf;
 /// loaded images
 tbb::concurrent_unordered_map<FrameCamId, std::string> images;
 
+/// decodes the stereo images of the next frames in a background thread
+std::unique_ptr<ImagePrefetcher> image_prefetcher;
+
+/// pre-decoded images of the dataset; used instead of the prefetcher if given
+ImagePack image_pack;
+
+/// extracted features of the next frames, filled by extraction_thread while
+/// the current frame is tracked; null if the pipeline is not running
+std::unique_ptr<SpscQueue<ExtractedFrame>> extracted_frames;
+std::thread extraction_thread;
+std::exception_ptr extraction_error;
+FeatureExtractionOptions extraction_options;
+
+PipelineStats pipeline_stats;
+
 /// timestamps for all stereo pairs
 std::vector<Timestamp> timestamps;
 
 /// detected feature locations and descriptors
 Corners feature_corners;
 
+/// last tracked non-keyframe, whose features are kept for display until the
+/// next one is tracked
+FrameId last_tracked_frame = -1;
+
 /// pairwise feature matches
 Matches feature_matches;
 
+/// image pyramid of the previous left image and the landmark observations in
+/// it; tracked with optical flow into the next frame if klt_tracking is on
+ImagePyramid prev_pyramid;
+std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>>
+    prev_tracked_points;
+std::vector<TrackId> prev_tracked_ids;
+
 /// camera poses in the current map
 Cameras cameras;
 
-/// copy of cameras for optimization in parallel thread
-Cameras cameras_opt;
-
 /// landmark positions and feature observations in current map
 Landmarks landmarks;
 
-/// copy of landmarks for optimization in parallel thread
-Landmarks landmarks_opt;
+/// landmarks observed in every image of the current map
+FrameLandmarkIndex frame_landmarks;
 
 /// landmark positions that were removed from the current map
 Landmarks old_landmarks;
 
+/// evicts the history outside the window (stereo matches, IMU states and old
+/// landmarks), optionally into an archive file
+RetentionManager retention;
+
+/// writes the IMU pose of every tracked frame, if a trajectory file is given
+TrajectoryWriter trajectory_writer;
+
 // initialize recent cameras for imu's state update 
 Cameras recent_kf_cameras;
 
@@ -211,10 +317,14 @@ std::vector<Timestamp> vio_t_ns;
 Camera delete_camera;
 FrameId delete_fid;
 
-/// cashed info on reprojected landmarks; recomputed every time time from
-/// cameras, landmarks, and feature_tracks; used for visualization and
-/// determining outliers; indexed by images
-ImageProjections image_projections;
+/// cashed info on reprojected landmarks; updated from cameras, landmarks, and
+/// feature_corners for the images whose state changed (camera poses are
+/// compared, moved landmarks are invalidated when merging the optimized map);
+/// only used for visualization, so it stays empty without GUI
+ProjectionCache projection_cache;
+
+/// whether the GUI is shown; headless runs skip all visualization state
+bool show_gui = true;
 std::string dataset_type = "euroc"; ///////////////
 std::string imu_dataset_path =   ////////////
     "../data/euro_data/MH_01_easy";  // This should be set as a argument ...
@@ -258,6 +368,12 @@ pangolin::Var<bool> show_vio_pt("hidden.show_vio_pt", false, true);
 pangolin::Var<int> num_features_per_image("hidden.num_features", 1500, 10,
                                           5000);
 pangolin::Var<bool> rotate_features("hidden.rotate_features", true, true);
+pangolin::Var<bool> quantized_descriptors("hidden.quantized_descriptors", true,
+                                          true);
+pangolin::Var<bool> fast_grid_detector("hidden.fast_grid_detector", false,
+                                       true);
+pangolin::Var<bool> guided_stereo_matching("hidden.guided_stereo_matching",
+                                           true, true);
 pangolin::Var<int> feature_match_max_dist("hidden.match_max_dist", 70, 1, 255);
 pangolin::Var<double> feature_match_test_next_best("hidden.match_next_best",
                                                    1.2, 1, 4);
@@ -271,6 +387,36 @@ pangolin::Var<int> max_num_kfs("hidden.max_num_kfs", 10, 5, 20);
 
 pangolin::Var<double> cam_z_threshold("hidden.cam_z_threshold", 0.1, 1.0, 0.0);
 
+// track landmarks with optical flow in non-keyframes instead of detecting and
+// matching features; detection then only runs on keyframes
+pangolin::Var<bool> klt_tracking("hidden.klt_tracking", false, true);
+
+// number of frames decoded ahead of the tracking (including the current one)
+pangolin::Var<int> prefetch_frames("hidden.prefetch_frames", 4, 1, 16);
+
+// extract the features of the next frames on a separate thread while the
+// current one is tracked; the extraction settings are fixed once it started
+pangolin::Var<bool> pipeline_extraction("hidden.pipeline_extraction", true,
+                                        true);
+
+// number of extracted frames buffered ahead of the tracking
+pangolin::Var<int> pipeline_queue_size("hidden.pipeline_queue_size", 2, 1, 16);
+
+// answer unprojections of cameras with an iterative unprojection
+// (Kannala-Brandt) from a per-pixel bearing table; only used while the
+// intrinsics are fixed
+pangolin::Var<bool> bearing_lut("hidden.bearing_lut", true, true);
+
+// features of past frames kept in memory: 0 keeps everything, 1 keeps only the
+// corners (for display) and 2 drops them; keyframes are released once they
+// left the window
+pangolin::Var<int> feature_retention("hidden.feature_retention", 2, 0, 2);
+
+// soft memory limit in MiB for the retained state; above it the oldest
+// landmarks that left the map are evicted, but the optimization window is kept
+// even if it alone is larger (0 for no limit)
+pangolin::Var<int> max_memory_mb("hidden.max_memory_mb", 512, 0, 4096);
+
 //////////////////////////////////////////////
 /// Adding cameras and landmarks options
 
@@ -283,6 +429,8 @@ pangolin::Var<double> reprojection_error_pnp_inlier_threshold_pixel(
 pangolin::Var<bool> ba_optimize_intrinsics("hidden.ba_opt_intrinsics", false,
                                            true);  
 pangolin::Var<int> ba_verbose("hidden.ba_verbose", 1, 0, 2);
+pangolin::Var<bool> ba_analytic_jacobians("hidden.ba_analytic_jacobians",
+                                          true, true);
 
 pangolin::Var<double> reprojection_error_huber_pixel("hidden.ba_huber_width",
                                                      1.0, 0.1, 10);
@@ -308,9 +456,11 @@ Button SVD_btn("ui.svd", &SVD_APPLY);
 // Parse parameters, load data, and create GUI window and event loop (or
 // process everything in non-gui mode).
 int main(int argc, char** argv) {
-  bool show_gui = true;
   std::string dataset_path = "data/V1_01_easy/mav0";
   std::string cam_calib = "opt_calib.json";
+  std::string image_pack_path;
+  std::string state_archive_path;
+  std::string trajectory_path;
 
   CLI::App app{"Visual odometry."};
 
@@ -320,13 +470,33 @@ int main(int argc, char** argv) {
   app.add_option("--cam-calib", cam_calib,
                  "Path to camera calibration. Default: " + cam_calib);
   app.add_option("--imu", imu, "VIO");
+  app.add_option("--image-pack", image_pack_path,
+                 "Image pack of the dataset (see image_pack) to map instead "
+                 "of decoding the images.");
+  app.add_option("--state-archive", state_archive_path,
+                 "File to which the state evicted from memory (old landmarks, "
+                 "keyframe matches and IMU states) is written.");
+  app.add_option("--trajectory", trajectory_path,
+                 "File to which the pose of every frame is written while the "
+                 "sequence is processed.");
   try {
     app.parse(argc, argv);
   } catch (const CLI::ParseError& e) {
     return app.exit(e);
   }
 
-  load_data(dataset_path, cam_calib);
+  load_data(dataset_path, cam_calib, image_pack_path);
+
+  if (!state_archive_path.empty() &&
+      !retention.archive().open(state_archive_path)) {
+    std::cerr << "Could not create " << state_archive_path << std::endl;
+    std::abort();
+  }
+
+  if (!trajectory_path.empty() && !trajectory_writer.open(trajectory_path)) {
+    std::cerr << "Could not create " << trajectory_path << std::endl;
+    std::abort();
+  }
 
   
 
@@ -465,6 +635,9 @@ int main(int argc, char** argv) {
           end = std::chrono::high_resolution_clock::now();
           std::chrono::duration<double> elapsed = end - start;
           std::cout << "Total execution time gui: " << elapsed.count() << " seconds" << std::endl;
+          print_prefetch_stats();
+          print_pipeline_stats();
+          print_memory_stats();
         }
       } else {
         // if the gui is just idling, make sure we don't burn too much CPU
@@ -473,14 +646,21 @@ int main(int argc, char** argv) {
       }
     }
   } else {
-    // non-gui mode: Process all frames, then exit
-
+    // non-gui mode: Process all frames as fast as possible, then exit
+    Timer timer;
     while (next_step()) {
       // Continue processing frames
     }
+    const double seconds = timer.elapsed();
 
-
+    print_run_stats(current_frame, seconds);
+    print_prefetch_stats();
+    print_pipeline_stats();
+    print_memory_stats();
   }
+  stop_pipeline();
+  retention.archive().close();
+  trajectory_writer.close();
   saveTrajectoryButton();
   SVD_APPLY();
   return 0;
@@ -620,51 +800,45 @@ void draw_image_overlay(pangolin::View& v, size_t view_id) {
   }
 
   if (show_reprojections) {
-    if (image_projections.count(fcid) > 0) {
+    if (const ProjectionCache::Image* image = projection_cache.find(fcid)) {
       glLineWidth(1.0);
       glColor3f(1.0, 0.0, 0.0);  // red
       glEnable(GL_BLEND);
       glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-      const size_t num_points = image_projections.at(fcid).obs.size();
+      size_t num_points = 0;
       double error_sum = 0;
-      size_t num_outliers = 0;
 
-      // count up and draw all inlier projections
-      for (const auto& lm_proj : image_projections.at(fcid).obs) {
-        error_sum += lm_proj->reprojection_error;
+      for (size_t i = 0; i < image->size; i++) {
+        const Eigen::Vector2d measured = image->measured.row(i).transpose();
+        const Eigen::Vector2d reprojected =
+            image->reprojected.row(i).transpose();
 
-        if (lm_proj->outlier_flags != OutlierNone) {
-          // outlier point
+        if (image->outlier[i]) {
+          // only draw outlier projections
+          if (!show_outlier_observations) continue;
           glColor3f(1.0, 0.0, 0.0);  // red
-          ++num_outliers;
-        } else if (lm_proj->reprojection_error >
-                   reprojection_error_huber_pixel) {
-          // close to outlier point
-          glColor3f(1.0, 0.5, 0.0);  // orange
         } else {
-          // clear inlier point
-          glColor3f(1.0, 1.0, 0.0);  // yellow
-        }
-        pangolin::glDrawCirclePerimeter(lm_proj->point_reprojected, 3.0);
-        pangolin::glDrawLine(lm_proj->point_measured,
-                             lm_proj->point_reprojected);
-      }
-
-      // only draw outlier projections
-      if (show_outlier_observations) {
-        glColor3f(1.0, 0.0, 0.0);  // red
-        for (const auto& lm_proj : image_projections.at(fcid).outlier_obs) {
-          pangolin::glDrawCirclePerimeter(lm_proj->point_reprojected, 3.0);
-          pangolin::glDrawLine(lm_proj->point_measured,
-                               lm_proj->point_reprojected);
+          // count up and draw all inlier projections
+          error_sum += image->reprojection_errors[i];
+          ++num_points;
+
+          if (image->reprojection_errors[i] > reprojection_error_huber_pixel) {
+            // close to outlier point
+            glColor3f(1.0, 0.5, 0.0);  // orange
+          } else {
+            // clear inlier point
+            glColor3f(1.0, 1.0, 0.0);  // yellow
+          }
         }
+        pangolin::glDrawCirclePerimeter(reprojected, 3.0);
+        pangolin::glDrawLine(measured, reprojected);
       }
 
       glColor3f(1.0, 0.0, 0.0);  // red
       pangolin::default_font()
-          .Text("Average repr. error (%u points, %u new outliers): %.2f",
-                num_points, num_outliers, error_sum / num_points)
+          .Text("Average repr. error (%u points): %.2f", num_points,
+                error_sum / num_points)
           .Draw(5, text_row);
       text_row += 20;
     }
@@ -828,43 +1002,18 @@ void draw_scene() {
 }
 
 // Load images, calibration, imu, and features / matches if available
-void load_data(const std::string& dataset_path, const std::string& calib_path) {
-  const std::string timestams_path = dataset_path + "/cam0/data.csv";
-
+void load_data(const std::string& dataset_path, const std::string& calib_path,
+               const std::string& image_pack_path) {
   {
-    std::ifstream times(timestams_path); // ifstream: read file
-
-    int id = 0;
-
-    while (times) {
-      std::string line;
-      std::getline(times, line); // line by line read files
-
-      if (line.size() < 20 || line[0] == '#') continue;  // length of line is less than 20 or # or id>2700 skip it 
-
-      {
-        std::string timestamp_str = line.substr(0, 19); //from line the 19 front str extraht and then - > timestamp_str -> timestamps
-        std::istringstream ss(timestamp_str);
-        Timestamp timestamp;
-        ss >> timestamp;
-        timestamps.push_back(timestamp);
-      }
-
-      std::string img_name = line.substr(20, line.size() - 21); //from 21 read the info about images
-
-      for (int i = 0; i < NUM_CAMS; i++) {
-        FrameCamId fcid(id, i);
-
-        std::stringstream ss;
-        ss << dataset_path << "/cam" << i << "/data/" << img_name;
+    std::vector<DatasetImage> dataset_images;
+    list_euroc_images(dataset_path, NUM_CAMS, dataset_images);
 
-        images[fcid] = ss.str();  // through framd and camera id to store ' str ' camera data and images info 
-      }
-
-      id++;
+    for (const DatasetImage& img : dataset_images) {
+      if (img.fcid.cam_id == 0) timestamps.push_back(img.timestamp);
+      images[img.fcid] = img.path;
     }
 
-    std::cerr << "Loaded " << id << " image pairs" << std::endl; // id means frames id
+    std::cerr << "Loaded " << timestamps.size() << " image pairs" << std::endl;
   }
 
   {
@@ -882,12 +1031,36 @@ void load_data(const std::string& dataset_path, const std::string& calib_path) {
         std::cout << cam->name() << " ";
       }
       std::cout << std::endl;
+
+      update_bearing_luts();
     } else {
       std::cerr << "could not load camera calibration " << calib_path
                 << std::endl;
       std::abort();
     }
   }
+  if (!image_pack_path.empty()) {
+    if (!image_pack.open(image_pack_path)) std::abort();
+
+    for (const auto& kv : images) {
+      const int64_t i = image_pack.find(kv.first);
+      if (i < 0 ||
+          image_pack.entry(i).timestamp != timestamps[kv.first.frame_id]) {
+        std::cerr << "Image pack " << image_pack_path
+                  << " does not match the dataset at image " << kv.first
+                  << std::endl;
+        std::abort();
+      }
+    }
+    std::cout << "Mapped " << image_pack.size() << " images from "
+              << image_pack_path << std::endl;
+  } else {
+    image_prefetcher.reset(new ImagePrefetcher(
+        images.size() / NUM_CAMS, NUM_CAMS,
+        [](const FrameCamId& fcid) { return images.at(fcid); },
+        prefetch_frames));
+  }
+
  // 更新 GUI 显示范围
   show_frame1.Meta().range[1] = images.size() / NUM_CAMS - 1;
   show_frame1.Meta().gui_changed = true;
@@ -926,13 +1099,56 @@ void load_data(const std::string& dataset_path, const std::string& calib_path) {
 // until it returns false for automatic execution.
 bool next_step() {
 
-  if (current_frame >= int(images.size()) / NUM_CAMS) return false;// one frame two cameras
+  if (current_frame >= int(images.size()) / NUM_CAMS) {// one frame two cameras
+    stop_pipeline();
+    return false;
+  }
+
+  if (pipeline_extraction && !extracted_frames) start_pipeline();
+
+  ExtractedFrame frame;
+  Timer timer;
+  if (extracted_frames) {
+    // the extraction thread only stops before the last frame on errors
+    if (!extracted_frames->pop(frame)) {
+      if (extraction_error) std::rethrow_exception(extraction_error);
+      stop_pipeline();
+      return false;
+    }
+    pipeline_stats.tracking_wait.add(timer.elapsed());
+  } else {
+    extraction_options.num_features = num_features_per_image;
+    extraction_options.rotate_features = rotate_features;
+    extraction_options.detector_method = detector_method();
+    extraction_options.descriptor_method = descriptor_method();
+    extraction_options.klt_tracking = klt_tracking;
+
+    extract_features(current_frame, frame);
+  }
+
+  timer.reset();
+  track_frame(frame);
+  pipeline_stats.tracking.add(timer.elapsed());
 
+  if (trajectory_writer.isOpen()) {
+    trajectory_writer.write(timestamps[current_frame],
+                            current_pose * calib_cam.T_i_c[0].inverse());
+  }
+
+  current_frame++;
+  return true;
+}
+
+// Localize the current frame from its extracted features. Keyframes are
+// matched in stereo, add new landmarks to the map and start the bundle
+// adjustment.
+void track_frame(ExtractedFrame& frame) {
   const Sophus::SE3d T_0_1 = calib_cam.T_i_c[0].inverse() * calib_cam.T_i_c[1];
 
 
   if (take_keyframe) {
     take_keyframe = false;
+    num_keyframes++;
 
     if (imu) {
       const Vec3 accel_cov = (calib_cam.accel_noise_std).array().square();
@@ -1029,24 +1245,27 @@ bool next_step() {
     //           << std::endl;
 
     MatchData md_stereo;
-    KeypointsData kdl, kdr;
-
-    pangolin::ManagedImage<uint8_t> imgl = pangolin::LoadImage(images[fcidl]);
-    pangolin::ManagedImage<uint8_t> imgr = pangolin::LoadImage(images[fcidr]);
 
-    detectKeypointsAndDescriptors(imgl, kdl, num_features_per_image,
-                                  rotate_features);
-    detectKeypointsAndDescriptors(imgr, kdr, num_features_per_image,
-                                  rotate_features);
+    // in KLT mode or without the pipeline not all cameras are detected yet
+    detect_keypoints(frame);
+    const KeypointsData& kdl = frame.keypoints[0];
+    const KeypointsData& kdr = frame.keypoints[1];
 
     md_stereo.T_i_j = T_0_1;
 
     Eigen::Matrix3d E;
     computeEssential(T_0_1, E);
 
-    matchDescriptors(kdl.corner_descriptors, kdr.corner_descriptors,
-                     md_stereo.matches, feature_match_max_dist,
-                     feature_match_test_next_best);
+    if (guided_stereo_matching) {
+      matchDescriptorsEpipolar(kdl, kdr, calib_cam.intrinsics[0],
+                               calib_cam.intrinsics[1], T_0_1,
+                               feature_match_max_dist,
+                               feature_match_test_next_best, 1e-3, md_stereo);
+    } else {
+      matchDescriptors(kdl.corner_descriptors, kdr.corner_descriptors,
+                       md_stereo.matches, feature_match_max_dist,
+                       feature_match_test_next_best);
+    }
 
     findInliersEssential(kdl, kdr, calib_cam.intrinsics[0],
                          calib_cam.intrinsics[1], E, 1e-3, md_stereo); // through epipolar constraint to get inliers
@@ -1100,12 +1319,49 @@ bool next_step() {
     }
 
 
+    const TrackId first_new_landmark = next_landmark_id;
     add_new_landmarks(fcidl, fcidr, kdl, kdr, calib_cam, md_stereo, md,
-                      landmarks, next_landmark_id);
+                      landmarks, next_landmark_id, &frame_landmarks);
+
+    // send the changes of this keyframe to the optimizer instead of the map
+    MapDelta delta;
+    delta.new_cameras[fcidl] = cameras[fcidl];
+    delta.new_cameras[fcidr] = cameras[fcidr];
+    delta.new_corners.resize(2);
+    delta.new_corners[0].first = fcidl;
+    delta.new_corners[0].second.corners = kdl.corners;
+    delta.new_corners[1].first = fcidr;
+    delta.new_corners[1].second.corners = kdr.corners;
+
+    for (const FrameCamId& fcid : {fcidl, fcidr}) {
+      for (const TrackId track_id : frame_landmarks.landmarks(fcid)) {
+        const Landmark& lm = landmarks.at(track_id);
+        if (track_id < first_new_landmark) {
+          delta.new_observations.emplace_back(track_id, fcid, lm.obs.at(fcid));
+        } else if (!delta.new_landmarks.count(track_id)) {
+          Landmark& new_lm = delta.new_landmarks[track_id];
+          new_lm.p = lm.p;
+          new_lm.obs = lm.obs;
+        }
+      }
+    }
+
+    if (frame.klt_tracking) {
+      prev_pyramid = std::move(frame.pyramid);
 
+      std::vector<std::pair<FeatureId, TrackId>> observations;
+      for (const TrackId track_id : frame_landmarks.landmarks(fcidl)) {
+        observations.emplace_back(landmarks.at(track_id).obs.at(fcidl),
+                                  track_id);
+      }
+      set_tracked_landmarks(kdl, observations);
+    }
+
+    const std::set<FrameId> prev_kf_frames = kf_frames;
     bool removed_old_keyframes = delete_oldframes(fcidl, max_num_kfs, cameras, landmarks,
                                         old_landmarks, kf_frames,
-                                        delete_camera, delete_fid);
+                                        delete_camera, delete_fid,
+                                        &feature_corners, &frame_landmarks);
 
     // Ducument the removed keyframe
     if (removed_old_keyframes) {
@@ -1115,9 +1371,15 @@ bool next_step() {
       vio_points.push_back(T_w_i.translation());    
     }
 
-    optimize();
+    for (const FrameId fid : prev_kf_frames) {
+      if (kf_frames.count(fid) == 0) {
+        delta.removed_frames.push_back(fid);
+        release_features(fid);
+      }
+    }
+    evict_history(delta.removed_frames);
 
-    current_pose = cameras[fcidl].T_w_c;
+    optimize(delta);
 
     // update image views
     change_display_to_image(fcidl);
@@ -1125,39 +1387,34 @@ bool next_step() {
 
     compute_projections();
 
-    current_frame++;
-    return true;
-
   } else {
     FrameCamId fcidl(current_frame, 0), fcidr(current_frame, 1);
 
-    std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>>
-        projected_points;
-    std::vector<TrackId> projected_track_ids;
-
-    project_landmarks(current_pose, calib_cam.intrinsics[0], landmarks,
-                      cam_z_threshold, projected_points, projected_track_ids);
-
-    // std::cout << "(no KF)Projected " << projected_track_ids.size() << " points."
-    //           << std::endl;
-
-
     ///  only take and handle left camera only in (no take key frame) this frame 
-    KeypointsData kdl;
+    KeypointsData& kdl = frame.keypoints[0];
+    LandmarkMatchData md;
 
-    pangolin::ManagedImage<uint8_t> imgl = pangolin::LoadImage(images[fcidl]);
+    if (frame.klt_tracking) {
+      track_landmarks(frame.pyramid, kdl, md);
 
-    detectKeypointsAndDescriptors(imgl, kdl, num_features_per_image,
-                                  rotate_features);
+      prev_pyramid = std::move(frame.pyramid);
+    } else {
+      std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>>
+          projected_points;
+      std::vector<TrackId> projected_track_ids;
+
+      project_landmarks(current_pose, calib_cam.intrinsics[0], landmarks,
+                        cam_z_threshold, projected_points,
+                        projected_track_ids);
+
+      find_matches_landmarks(kdl, landmarks, feature_corners, projected_points,
+                             projected_track_ids, match_max_dist_2d,
+                             feature_match_max_dist,
+                             feature_match_test_next_best, md);
+    }
 
     feature_corners[fcidl] = kdl;
 
-    LandmarkMatchData md;
-    find_matches_landmarks(kdl, landmarks, feature_corners, projected_points,
-                           projected_track_ids, match_max_dist_2d,
-                           feature_match_max_dist, feature_match_test_next_best,
-                           md);
-
     //std::cout << "Found " << md.matches.size() << " matches." << std::endl;
 
     localize_camera(current_pose, calib_cam.intrinsics[0], kdl, landmarks,
@@ -1165,160 +1422,68 @@ bool next_step() {
 
     current_pose = md.T_w_c;
 
-    if (int(md.inliers.size()) < new_kf_min_inliers && !opt_running &&
-        !opt_finished) {
-      take_keyframe = true;
-    }
-
-    if (!opt_running && opt_finished) {
-      opt_thread->join();  // wait for results from BA in optimization
-
-      landmarks = landmarks_opt;
-      removed_fcid_buffer.clear();
-
-      cameras = cameras_opt;
-
-      if(imu){
-        // update kf cameras
-        for(auto& cam : cameras){
-          for(auto& cam_imu : recent_kf_cameras){
-            if(cam.first == cam_imu.first){
-              //std::cout << " update key_cam !" << std::endl;
-              cam_imu.second.T_w_c = cam.second.T_w_c;
-            }
-          }
-        }
-      }
+    // only PnP inliers are tracked further, so outliers do not accumulate
+    if (frame.klt_tracking) set_tracked_landmarks(kdl, md.inliers);
 
-      calib_cam = calib_cam_opt;
+    if (last_tracked_frame >= 0) release_features(last_tracked_frame);
+    last_tracked_frame = current_frame;
 
-       if (imu) {
-          update_framestates(calib_cam, cameras, timestamps,frame_states, frame_states_opt);
-          //update the framestate from optimization
-      } else {}
-      opt_finished = false;
+    // a keyframe may be taken while the optimizer works on the previous one,
+    // but not while one is still waiting for it
+    if (int(md.inliers.size()) < new_kf_min_inliers &&
+        (!map_optimizer || map_optimizer->numQueued() == 0)) {
+      take_keyframe = true;
     }
 
+    merge_optimized_map();
+
     // update image views
     change_display_to_image(fcidl);
     change_display_to_image(fcidr);
-
-    current_frame++;
-    return true;
   }
-
 }
 
-// Compute reprojections for all landmark observations for visualization and
-// outlier removal.
+// Update the reprojections of the landmark observations in the images whose
+// state changed, for visualization.
 void compute_projections() {
-  image_projections.clear();
-
-  for (const auto& kv_lm : landmarks) {
-    const TrackId track_id = kv_lm.first;
-
-    for (const auto& kv_obs : kv_lm.second.obs) {
-      const FrameCamId& fcid = kv_obs.first;
-      const Eigen::Vector2d p_2d_corner =
-          feature_corners.at(fcid).corners[kv_obs.second];
-      if (cameras.count(fcid)) {
-        const Eigen::Vector3d p_c =
-            cameras.at(fcid).T_w_c.inverse() * kv_lm.second.p;
-        const Eigen::Vector2d p_2d_repoj =
-            calib_cam.intrinsics.at(fcid.cam_id)->project(p_c);
-
-
-        ProjectedLandmarkPtr proj_lm(new ProjectedLandmark);
-        proj_lm->track_id = track_id;
-        proj_lm->point_measured = p_2d_corner;
-        proj_lm->point_reprojected = p_2d_repoj;
-        proj_lm->point_3d_c = p_c;
-        proj_lm->reprojection_error = (p_2d_corner - p_2d_repoj).norm();
-
-        image_projections[fcid].obs.push_back(proj_lm);
-      }
-    }
+  // the projections only feed the visualization
+  if (!show_gui) return;
 
-    for (const auto& kv_obs : kv_lm.second.outlier_obs) {
-      const FrameCamId& fcid = kv_obs.first;
-      const Eigen::Vector2d p_2d_corner =
-          feature_corners.at(fcid).corners[kv_obs.second];
-
-      if (cameras.count(fcid)) {
-        const Eigen::Vector3d p_c =
-            cameras.at(fcid).T_w_c.inverse() * kv_lm.second.p;
-        const Eigen::Vector2d p_2d_repoj =
-            calib_cam.intrinsics.at(fcid.cam_id)->project(p_c);
-
-        ProjectedLandmarkPtr proj_lm(new ProjectedLandmark);
-        proj_lm->track_id = track_id;
-        proj_lm->point_measured = p_2d_corner;
-        proj_lm->point_reprojected = p_2d_repoj;
-        proj_lm->point_3d_c = p_c;
-        proj_lm->reprojection_error = (p_2d_corner - p_2d_repoj).norm();
-
-        image_projections[fcid].outlier_obs.push_back(proj_lm);
-      }  
-    }
-  }
+  projection_cache.update(landmarks, cameras, calib_cam, feature_corners,
+                          frame_landmarks);
 }
 
-// Optimize the active map with bundle adjustment
-void optimize() {
-  size_t num_obs = 0;
-  for (const auto& kv : landmarks) {
-    num_obs += kv.second.obs.size();
-  }
-
-  // std::cerr << "Optimizing map with " << cameras.size() << " cameras, " << "kf_frames size: " << kf_frames.size() << " , " 
-  //           << landmarks.size() << " points " << num_obs << " observations, "
-  //           << frame_states_opt.size() << " imu state for optimization!"
-  //           << std::endl;
-
+// Send the changes of the new keyframe in delta to the bundle adjustment
+// worker, together with the options and the IMU states of the window.
+void optimize(MapDelta& delta) {
   // Fix oldest two cameras to fix SE3 and scale gauge. Making the whole second
   // camera constant is a bit suboptimal, since we only need 1 DoF, but it's
   // simple and the initial poses should be good from calibration.
-  FrameId fid = *(kf_frames.begin());
-  // std::cout << "fixed fid: " << fid << std::endl;
+  delta.fixed_frame = *(kf_frames.begin());
 
   // Prepare bundle adjustment
-  BundleAdjustmentOptions ba_options;
+  BundleAdjustmentOptions& ba_options = delta.options;
   ba_options.optimize_intrinsics = ba_optimize_intrinsics;
   ba_options.use_huber = true;
   ba_options.huber_parameter = reprojection_error_huber_pixel;
   ba_options.max_num_iterations = 20;
   ba_options.verbosity_level = ba_verbose;
-
-  calib_cam_opt = calib_cam;
-  cameras_opt = cameras;
-  landmarks_opt = landmarks;
+  ba_options.analytic_jacobians = ba_analytic_jacobians;
 
   if (imu) {
-    take_framestates(calib_cam,recent_kf_cameras,timestamps, frame_state,frame_states,frame_states_opt);  //size (frame_states_opt) = size(keyframes cameras)
-    // std::cout<< "get frame states optimization !"<<std::endl;
-  } else {
-    // Do nothing here
+    delta.imu = true;
+    take_framestates(calib_cam, recent_kf_cameras, timestamps, frame_state,
+                     frame_states, delta.frame_states);
+    for (const auto& kv : delta.frame_states) {
+      auto it = imu_measurements.find(kv.first);
+      if (it != imu_measurements.end()) delta.imu_measurements.emplace(*it);
+    }
+  }
+
+  if (!map_optimizer) {
+    map_optimizer.reset(new MapOptimizer(calib_cam, timestamps));
   }
-   //std::cout<<"optimize !"<<std::endl;
-  opt_running = true;
-
-  opt_thread.reset(new std::thread([fid, ba_options] {
-
-  std::set<FrameCamId> fixed_cameras = {{fid, 0}, {fid, 1}};
-  if(imu){  // optimize poses landmarks and intrisics
-      //std::cout << "start imu projection BA..." << std::endl;
-      Imu_Proj_bundle_adjustment(feature_corners, ba_options, fixed_cameras, calib_cam_opt,
-                                cameras_opt, landmarks_opt, frame_states_opt, imu_measurements,
-                                timestamps);
-      // std::cout << "imu projection BA end..." << std::endl;
-      }  
-  else{                  
-      Proj_bundle_adjustment(feature_corners, ba_options, fixed_cameras, calib_cam_opt,
-                          cameras_opt, landmarks_opt);}
-
-    opt_finished = true;
-    opt_running = false;
-  }));
+  map_optimizer->push(std::move(delta));
 
   // Update project info cache
   compute_projections();
@@ -1486,4 +1651,357 @@ void saveTrajectoryButton() {
     std::cout << "Saved trajectory in Euroc Dataset format in trajectory.txt"
               << std::endl;
 
-}
\ No newline at end of file
+}
+
+// detector and descriptor variants selected in the GUI
+DetectorMethod detector_method() {
+  return fast_grid_detector ? DetectorMethod::FastGrid
+                            : DetectorMethod::GoodFeatures;
+}
+
+DescriptorMethod descriptor_method() {
+  return quantized_descriptors ? DescriptorMethod::Quantized
+                               : DescriptorMethod::Exact;
+}
+
+// Track the landmark observations of the previous frame into the image of
+// pyramid. The tracked points become the corners of kd and are matched to
+// their landmarks in md, ready for localize_camera.
+void track_landmarks(const ImagePyramid& pyramid, KeypointsData& kd,
+                     LandmarkMatchData& md) {
+  kd.corners.clear();
+  kd.corner_angles.clear();
+  kd.corner_descriptors.clear();
+  md.matches.clear();
+
+  if (prev_tracked_points.empty()) return;
+
+  std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>>
+      tracked_points;
+  std::vector<bool> tracked;
+  trackPointsOpticalFlow(prev_pyramid, pyramid, prev_tracked_points,
+                         tracked_points, tracked);
+
+  for (size_t i = 0; i < tracked_points.size(); i++) {
+    // landmarks might have been removed by the optimization in the meantime
+    if (!tracked[i] || landmarks.count(prev_tracked_ids[i]) == 0) continue;
+
+    md.matches.emplace_back(kd.corners.size(), prev_tracked_ids[i]);
+    kd.corners.push_back(tracked_points[i]);
+    kd.corner_angles.push_back(0);
+  }
+}
+
+// Remember the observed landmarks in kd as starting points for tracking into
+// the next frame.
+void set_tracked_landmarks(
+    const KeypointsData& kd,
+    const std::vector<std::pair<FeatureId, TrackId>>& observations) {
+  prev_tracked_points.clear();
+  prev_tracked_ids.clear();
+
+  for (const auto& obs : observations) {
+    prev_tracked_points.push_back(kd.corners[obs.first]);
+    prev_tracked_ids.push_back(obs.second);
+  }
+}
+
+// Wrap the cameras with an iterative unprojection in a BearingLutCamera while
+// the intrinsics are fixed, and put the plain cameras back once they are
+// optimized (or the tables are switched off), since every optimization step
+// would otherwise rebuild the tables. The closed-form models unproject faster
+// than the table lookups, so they are left as they are.
+void update_bearing_luts() {
+  for (auto& cam : calib_cam.intrinsics) {
+    auto* lut_cam = dynamic_cast<BearingLutCamera<double>*>(cam.get());
+    if (lut_cam) {
+      if (!bearing_lut || ba_optimize_intrinsics) {
+        cam = lut_cam->camera();
+      } else {
+        lut_cam->update();
+      }
+    } else if (bearing_lut && !ba_optimize_intrinsics &&
+               cam->name() == KannalaBrandt4Camera<double>::getName()) {
+      cam = std::make_shared<BearingLutCamera<double>>(cam);
+    }
+  }
+}
+
+// Views of the images of frame_id, from the image pack if one is mapped and
+// from the prefetcher otherwise. They stay valid until the next call.
+FrameImageViews frame_images(FrameId frame_id) {
+  FrameImageViews views;
+
+  if (image_pack.isOpen()) {
+    for (int i = 0; i < NUM_CAMS; i++) {
+      views[i] = image_pack.image(image_pack.find(FrameCamId(frame_id, i)));
+
+      // let the kernel read the next frame while this one is processed
+      const int64_t next = image_pack.find(FrameCamId(frame_id + 1, i));
+      if (next >= 0) image_pack.prefetch(next);
+    }
+  } else {
+    const ImagePrefetcher::FrameImages& decoded =
+        image_prefetcher->acquire(frame_id);
+    for (int i = 0; i < NUM_CAMS; i++) views[i] = decoded[i];
+  }
+
+  return views;
+}
+
+// Report how much the tracking waited for image decoding.
+void print_prefetch_stats() {
+  if (!image_prefetcher) return;
+
+  const ImagePrefetcher::Stats stats = image_prefetcher->stats();
+  std::cout << "Image prefetch: decoded " << stats.num_loaded << " frames in "
+            << stats.load_time_s << " s, tracking stalled in "
+            << stats.num_stalls << " of " << stats.num_acquired
+            << " frames for " << stats.stall_time_s << " s, loader blocked for "
+            << stats.blocked_time_s << " s" << std::endl;
+}
+
+// Start extracting the features of the remaining frames on a separate thread
+// with the current GUI settings.
+void start_pipeline() {
+  extraction_options.num_features = num_features_per_image;
+  extraction_options.rotate_features = rotate_features;
+  extraction_options.detector_method = detector_method();
+  extraction_options.descriptor_method = descriptor_method();
+  extraction_options.klt_tracking = klt_tracking;
+
+  extraction_error = nullptr;
+  extracted_frames.reset(new SpscQueue<ExtractedFrame>(pipeline_queue_size));
+
+  const FrameId first_frame = current_frame;
+  const FrameId num_frames = images.size() / NUM_CAMS;
+  extraction_thread = std::thread([first_frame, num_frames] {
+    try {
+      for (FrameId frame_id = first_frame; frame_id < num_frames; frame_id++) {
+        // the right keypoints are only needed on keyframes; the tracking
+        // detects them when a frame becomes one
+        ExtractedFrame frame;
+        extract_features(frame_id, frame);
+        if (!extracted_frames->push(std::move(frame))) break;
+      }
+    } catch (...) {
+      extraction_error = std::current_exception();
+    }
+    extracted_frames->close();
+  });
+}
+
+// Stop the extraction thread and wait for a running bundle adjustment.
+void stop_pipeline() {
+  if (extracted_frames) {
+    extracted_frames->close();
+    extraction_thread.join();
+    extracted_frames.reset();
+  }
+
+  if (map_optimizer) map_optimizer->stop();
+}
+
+// Acquire the images of frame_id and extract what the tracking of every frame
+// needs: the image pyramid of the left camera in KLT mode, and otherwise the
+// keypoints of the left camera. The images of the cameras that are not
+// detected are kept in frame, so detect_keypoints can detect them if the frame
+// becomes a keyframe. Views into the image pack stay valid as long as the pack
+// is open; decoded images are copied if the frame is queued for the tracking,
+// since the prefetcher reuses their buffers for later frames.
+void extract_features(FrameId frame_id, ExtractedFrame& frame) {
+  Timer timer;
+  const FrameImageViews imgs = frame_images(frame_id);
+  pipeline_stats.acquisition.add(timer.elapsed());
+  timer.reset();
+
+  frame.frame_id = frame_id;
+  frame.klt_tracking = extraction_options.klt_tracking;
+
+  if (frame.klt_tracking) {
+    buildImagePyramid(imgs[0], OPTICAL_FLOW_LEVELS, frame.pyramid);
+  }
+
+  tbb::parallel_for(0, NUM_CAMS, [&](int i) {
+    frame.detected[i] = i == 0 && !frame.klt_tracking;
+    if (frame.detected[i]) {
+      detectKeypointsAndDescriptors(
+          imgs[i], frame.keypoints[i], extraction_options.num_features,
+          extraction_options.rotate_features,
+          extraction_options.detector_method,
+          extraction_options.descriptor_method);
+    } else if (image_pack.isOpen() || !extracted_frames) {
+      frame.images[i] = imgs[i];
+    } else {
+      frame.image_copies[i].Reinitialise(imgs[i].w, imgs[i].h);
+      frame.image_copies[i].CopyFrom(imgs[i]);
+      frame.images[i] = frame.image_copies[i];
+    }
+  });
+
+  pipeline_stats.extraction.add(timer.elapsed());
+}
+
+// Detect the keypoints of the cameras of frame that the extraction left out.
+void detect_keypoints(ExtractedFrame& frame) {
+  tbb::parallel_for(0, NUM_CAMS, [&](int i) {
+    if (frame.detected[i]) return;
+
+    detectKeypointsAndDescriptors(
+        frame.images[i], frame.keypoints[i], extraction_options.num_features,
+        extraction_options.rotate_features, extraction_options.detector_method,
+        extraction_options.descriptor_method);
+    frame.detected[i] = true;
+  });
+}
+
+// Report the per-frame latencies of the pipeline stages. With the extraction
+// thread, the frame rate is bounded by the slowest stage; the tracking waits
+// for features if the extraction is the bottleneck.
+void print_pipeline_stats() {
+  const auto print = [](const std::string& name, const LatencyStats& stats) {
+    if (stats.count() == 0) return;
+    std::cout << "  " << std::left << std::setw(18) << name << std::right
+              << std::setw(6) << stats.count() << " runs, mean "
+              << std::setw(8) << 1e3 * stats.mean() << " ms, p99 "
+              << std::setw(8) << 1e3 * stats.percentile(99) << " ms, max "
+              << std::setw(8) << 1e3 * stats.max() << " ms" << std::endl;
+  };
+
+  std::cout << "Pipeline stage latencies:" << std::endl;
+  print("acquisition", pipeline_stats.acquisition);
+  print("extraction", pipeline_stats.extraction);
+  print("tracking", pipeline_stats.tracking);
+  print("tracking wait", pipeline_stats.tracking_wait);
+  if (map_optimizer) {
+    print("bundle adjustment", map_optimizer->latencies());
+    std::cout << "  " << map_optimizer->numDeltas()
+              << " keyframes sent to the bundle adjustment" << std::endl;
+  }
+}
+
+// Report the throughput of a run over num_frames frames that took seconds.
+void print_run_stats(int num_frames, double seconds) {
+  constexpr double MiB = 1024.0 * 1024.0;
+
+  std::cout << "Processed " << num_frames << " frames in " << seconds
+            << " s (" << num_frames / seconds << " frames/s), "
+            << num_keyframes << " keyframes, peak RSS "
+            << peak_rss_bytes() / MiB << " MiB" << std::endl;
+  if (trajectory_writer.isOpen()) {
+    std::cout << "Wrote " << trajectory_writer.numPoses() << " poses"
+              << std::endl;
+  }
+}
+
+// Report the memory held by the features of past frames and the history
+// evicted from the odometry state.
+void print_memory_stats() {
+  constexpr double MiB = 1024.0 * 1024.0;
+  const RetentionStats& stats = retention.stats();
+
+  std::cout << "Feature store: " << feature_corners.size() << " images, "
+            << feature_corners.memoryUsage() / MiB << " MiB" << std::endl;
+  std::cout << "Retained state: " << stats.memory_bytes / MiB << " MiB, peak "
+            << stats.peak_memory_bytes / MiB << " MiB, above the limit after "
+            << stats.num_over_limit << " keyframes" << std::endl;
+  std::cout << "Evicted " << stats.evicted_matches << " stereo matches, "
+            << stats.evicted_states << " IMU states, "
+            << stats.evicted_imu_measurements << " IMU measurements and "
+            << stats.evicted_landmarks << " old landmarks";
+  if (retention.archive().isOpen()) {
+    std::cout << " (" << retention.archive().numRecords() << " archived)";
+  }
+  std::cout << std::endl;
+}
+
+// Evict the history that is outside the window after a keyframe: the stereo
+// matches of the removed keyframes, the IMU states before the oldest state the
+// IMU constraints still use, and old landmarks beyond the memory limit.
+void evict_history(const std::vector<FrameId>& removed_frames) {
+  for (const FrameId fid : removed_frames) {
+    retention.evictKeyframe(fid, feature_matches);
+  }
+
+  if (imu && initialized) {
+    Timestamp oldest = last_state_t_ns;
+    for (const FrameId fid : kf_frames) {
+      oldest = std::min(oldest, timestamps[fid]);
+    }
+    for (const auto& kv : recent_kf_cameras) {
+      oldest = std::min(oldest, timestamps[kv.first.frame_id]);
+    }
+    retention.evictStates(oldest, frame_states, imu_measurements);
+  }
+
+  const size_t window_bytes =
+      feature_corners.memoryUsage() + landmarks.memoryUsage() +
+      memory_usage(feature_matches) + memory_usage(frame_states) +
+      memory_usage(imu_measurements);
+  retention.setMemoryLimit(size_t(max_memory_mb) * 1024 * 1024);
+  retention.update(window_bytes, old_landmarks);
+}
+
+// Apply the feature retention policy to the images of frame_id once the
+// tracking is done with them: non-keyframes after they were tracked and
+// keyframes after they left the window and their observations were removed.
+void release_features(FrameId frame_id) {
+  if (feature_retention == 0) return;
+
+  for (CamId cam_id = 0; cam_id < NUM_CAMS; cam_id++) {
+    const FrameCamId fcid(frame_id, cam_id);
+    if (feature_retention == 1) {
+      feature_corners.compact(fcid);
+    } else {
+      feature_corners.erase(fcid);
+    }
+  }
+}
+
+// Take the poses, landmark positions and intrinsics of the newest result of
+// the bundle adjustment. Landmarks and cameras that were added or removed by
+// keyframes in the meantime are left as they are, and so are all observations.
+void merge_optimized_map() {
+  const bool merged =
+      map_optimizer &&
+      map_optimizer->consume(map_version, [](const OptimizedMap& map) {
+        for (const auto& [fcid, T_w_c] : map.camera_poses) {
+          auto it = cameras.find(fcid);
+          if (it != cameras.end()) it->second.T_w_c = T_w_c;
+        }
+
+        for (const auto& [track_id, p] : map.landmark_positions) {
+          auto it = landmarks.find(track_id);
+          if (it == landmarks.end() || it->second.p == p) continue;
+          it->second.p = p;
+          projection_cache.invalidateLandmark(track_id);
+        }
+
+        for (size_t i = 0; i < map.intrinsics.size(); i++) {
+          Eigen::Map<AbstractCamera<double>::VecN>(
+              calib_cam.intrinsics[i]->data()) = map.intrinsics[i];
+        }
+
+        frame_states_opt = map.frame_states;
+      });
+  if (!merged) return;
+
+  removed_fcid_buffer.clear();
+
+  if (imu) {
+    // update kf cameras
+    for (auto& cam_imu : recent_kf_cameras) {
+      auto it = cameras.find(cam_imu.first);
+      if (it != cameras.end()) cam_imu.second.T_w_c = it->second.T_w_c;
+    }
+
+    //update the framestate from optimization
+    update_framestates(calib_cam, cameras, timestamps, frame_states,
+                       frame_states_opt);
+  }
+
+  update_bearing_luts();
+
+  // only the images with optimized poses or landmarks are reprojected
+  compute_projections();
+}
@@ -50,6 +50,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <CLI/CLI.hpp>
 
 #include <visnav/common_types.h>
+#include <visnav/dataset_images.h>
 
 #include <visnav/calibration.h>
 
@@ -58,6 +59,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <visnav/matching_utils.h>
 
 #include <visnav/gui_helper.h>
+#include <visnav/image_pack.h>
 #include <visnav/tracks.h>
 
 #include <visnav/bow_db.h>
@@ -76,7 +78,7 @@ void draw_image_overlay(pangolin::View& v, size_t view_id);
 void change_display_to_image(const FrameCamId& fcid);
 void draw_scene();
 void load_data(const std::string& path, const std::string& calib_path,
-               int max_frames = 0);
+               int max_frames = 0, const std::string& image_pack_path = "");
 void save_map();
 void load_map();
 void clear_keypoints();
@@ -118,9 +120,15 @@ const std::string map_path = "map.cereal";
 /// intrinsic calibration
 Calibration calib_cam;
 
-/// loaded images
+/// loaded images; views into decoded_images or into image_pack
+tbb::concurrent_unordered_map<FrameCamId, pangolin::Image<uint8_t>> images;
+
+/// decoded images if no image pack is used
 tbb::concurrent_unordered_map<FrameCamId, pangolin::ManagedImage<uint8_t>>
-    images;
+    decoded_images;
+
+/// pre-decoded images of the dataset
+ImagePack image_pack;
 
 /// timestamps for all stereo pairs
 std::vector<Timestamp> timestamps;
@@ -242,6 +250,8 @@ pangolin::Var<double> reprojection_error_pnp_inlier_threshold_pixel(
 pangolin::Var<bool> ba_optimize_intrinsics("hidden.ba_opt_intrinsics", false,
                                            true);
 pangolin::Var<int> ba_verbose("hidden.ba_verbose", 1, 0, 2);
+pangolin::Var<bool> ba_analytic_jacobians("hidden.ba_analytic_jacobians",
+                                          true, true);
 
 pangolin::Var<double> reprojection_error_huber_pixel("hidden.ba_huber_width",
                                                      1.0, 0.1, 10);
@@ -319,6 +329,7 @@ int main(int argc, char** argv) {
   std::string voc_path;
   std::string cam_calib = "opt_calib.json";
   int max_frames = 0;
+  std::string image_pack_path;
 
   CLI::App app{"App description"};
 
@@ -330,6 +341,9 @@ int main(int argc, char** argv) {
   app.add_option(
       "--max-frames", max_frames,
       "Maximum number of frames to load. 0 means load all. Default: 0.");
+  app.add_option("--image-pack", image_pack_path,
+                 "Image pack of the dataset (see image_pack) to map instead "
+                 "of decoding the images.");
 
   try {
     app.parse(argc, argv);
@@ -342,7 +356,7 @@ int main(int argc, char** argv) {
     bow_db.reset(new BowDatabase);
   }
 
-  load_data(dataset_path, cam_calib, max_frames);
+  load_data(dataset_path, cam_calib, max_frames, image_pack_path);
 
   if (show_gui) {
     pangolin::CreateWindowAndBind("Main", 1800, 1000);
@@ -890,47 +904,37 @@ void draw_scene() {
 // If max_frames > 0, load at most that many frames (each frame consists of
 // NUM_CAMS images)
 void load_data(const std::string& dataset_path, const std::string& calib_path,
-               const int max_frames) {
-  const std::string timestams_path = dataset_path + "/timestamps.txt";
+               const int max_frames, const std::string& image_pack_path) {
+  if (!image_pack_path.empty()) {
+    if (!image_pack.open(image_pack_path)) std::abort();
+  }
 
   {
-    std::ifstream times(timestams_path);
-
-    int64_t timestamp;
-
-    int id = 0;
-
-    while (times && (max_frames <= 0 || id < max_frames)) {
-      times >> timestamp;
-
-      // ensure that we actually read a new timestamp (and not e.g. just newline
-      // at the end of the file)
-      if (times.fail()) {
-        times.clear();
-        std::string temp;
-        times >> temp;
-        if (temp.size() > 0) {
-          std::cerr << "Skipping '" << temp << "' while reading times."
+    std::vector<DatasetImage> dataset_images;
+    list_sfm_images(dataset_path, NUM_CAMS, max_frames, dataset_images);
+
+    for (const DatasetImage& img : dataset_images) {
+      const FrameCamId& fcid = img.fcid;
+      if (fcid.cam_id == 0) timestamps.push_back(img.timestamp);
+
+      if (image_pack.isOpen()) {
+        const int64_t idx = image_pack.find(fcid);
+        if (idx < 0 || image_pack.entry(idx).timestamp != img.timestamp) {
+          std::cerr << "Image pack " << image_pack_path
+                    << " does not match the dataset at image " << fcid
                     << std::endl;
+          std::abort();
         }
+        images[fcid] = image_pack.image(idx);
         continue;
       }
 
-      timestamps.push_back(timestamp);
-
-      for (int i = 0; i < NUM_CAMS; i++) {
-        FrameCamId fcid(id, i);
-
-        std::stringstream ss;
-        ss << dataset_path << "/" << timestamp << "_" << i << ".jpg";
-        pangolin::TypedImage img = pangolin::LoadImage(ss.str());
-        images[fcid] = std::move(img);
-      }
-
-      id++;
+      pangolin::TypedImage decoded = pangolin::LoadImage(img.path);
+      decoded_images[fcid] = std::move(decoded);
+      images[fcid] = decoded_images[fcid];
     }
 
-    std::cerr << "Loaded " << id << " image pairs" << std::endl;
+    std::cerr << "Loaded " << timestamps.size() << " image pairs" << std::endl;
   }
 
   {
@@ -1241,11 +1245,13 @@ void match_stereo() {
     MatchData md;
     md.T_i_j = T_0_1;
 
-    const KeypointsData& kd1 = feature_corners[fcid1];
-    const KeypointsData& kd2 = feature_corners[fcid2];
+    const KeypointsData& kd1 = feature_corners.at(fcid1);
+    const KeypointsData& kd2 = feature_corners.at(fcid2);
 
-    matchDescriptors(kd1.corner_descriptors, kd2.corner_descriptors, md.matches,
-                     feature_match_max_dist, feature_match_test_next_best);
+    matchDescriptorsEpipolar(kd1, kd2, calib_cam.intrinsics[0],
+                             calib_cam.intrinsics[1], T_0_1,
+                             feature_match_max_dist,
+                             feature_match_test_next_best, 1e-3, md);
 
     num_matches += md.matches.size();
 
@@ -1302,8 +1308,8 @@ void match_all() {
           const FrameCamId& id1 = keys[ids_to_match[j].first];
           const FrameCamId& id2 = keys[ids_to_match[j].second];
 
-          const KeypointsData& f1 = feature_corners[id1];
-          const KeypointsData& f2 = feature_corners[id2];
+          const KeypointsData& f1 = feature_corners.at(id1);
+          const KeypointsData& f2 = feature_corners.at(id2);
 
           MatchData md;
 
@@ -1403,8 +1409,8 @@ void match_bow() {
           const FrameCamId& id1 = keys[ids_to_match[j].first];
           const FrameCamId& id2 = keys[ids_to_match[j].second];
 
-          const KeypointsData& f1 = feature_corners[id1];
-          const KeypointsData& f2 = feature_corners[id2];
+          const KeypointsData& f1 = feature_corners.at(id1);
+          const KeypointsData& f2 = feature_corners.at(id2);
 
           MatchData md;
 
@@ -1913,6 +1919,7 @@ void optimize() {
   ba_options.huber_parameter = reprojection_error_huber_pixel;
   ba_options.max_num_iterations = 20;
   ba_options.verbosity_level = ba_verbose;
+  ba_options.analytic_jacobians = ba_analytic_jacobians;
   bundle_adjustment(feature_corners, ba_options, fixed_cameras, calib_cam,
                     cameras, landmarks);
 
@@ -1959,55 +1966,14 @@ void set_outlier_flags(ProjectedLandmark& lm_proj) {
 // Compute reprojections for all landmark observations for visualization and
 // outlier removal.
 void compute_projections() {
-  image_projections.clear();
   track_projections.clear();
 
-  for (const auto& kv_lm : landmarks) {
-    const TrackId track_id = kv_lm.first;
-
-    for (const auto& kv_obs : kv_lm.second.obs) {
-      const FrameCamId& fcid = kv_obs.first;
-      const Eigen::Vector2d p_2d_corner =
-          feature_corners.at(fcid).corners[kv_obs.second];
-
-      const Eigen::Vector3d p_c =
-          cameras.at(fcid).T_w_c.inverse() * kv_lm.second.p;
-      const Eigen::Vector2d p_2d_repoj =
-          calib_cam.intrinsics.at(fcid.cam_id)->project(p_c);
-
-      ProjectedLandmarkPtr proj_lm(new ProjectedLandmark);
-      proj_lm->track_id = track_id;
-      proj_lm->point_measured = p_2d_corner;
-      proj_lm->point_reprojected = p_2d_repoj;
-      proj_lm->point_3d_c = p_c;
-      proj_lm->reprojection_error = (p_2d_corner - p_2d_repoj).norm();
-
-      set_outlier_flags(*proj_lm);
-
-      image_projections[fcid].obs.push_back(proj_lm);
-      track_projections[track_id][fcid] = proj_lm;
-    }
-
-    for (const auto& kv_obs : kv_lm.second.outlier_obs) {
-      const FrameCamId& fcid = kv_obs.first;
-      const Eigen::Vector2d p_2d_corner =
-          feature_corners.at(fcid).corners[kv_obs.second];
-
-      const Eigen::Vector3d p_c =
-          cameras.at(fcid).T_w_c.inverse() * kv_lm.second.p;
-      const Eigen::Vector2d p_2d_repoj =
-          calib_cam.intrinsics.at(fcid.cam_id)->project(p_c);
-
-      ProjectedLandmarkPtr proj_lm(new ProjectedLandmark);
-      proj_lm->track_id = track_id;
-      proj_lm->point_measured = p_2d_corner;
-      proj_lm->point_reprojected = p_2d_repoj;
-      proj_lm->point_3d_c = p_c;
-      proj_lm->reprojection_error = (p_2d_corner - p_2d_repoj).norm();
-
-      image_projections[fcid].outlier_obs.push_back(proj_lm);
-    }
-  }
+  compute_image_projections(
+      landmarks, cameras, calib_cam, feature_corners, image_projections,
+      [](const FrameCamId& fcid, const ProjectedLandmarkPtr& proj_lm) {
+        set_outlier_flags(*proj_lm);
+        track_projections[proj_lm->track_id][fcid] = proj_lm;
+      });
 }
 
 // Check if a given landmark is an outlier.
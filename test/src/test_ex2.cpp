@@ -32,6 +32,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <gtest/gtest.h>
 
+#include "visnav/bearing_lut_camera.h"
 #include "visnav/camera_models.h"
 
 using namespace visnav;
@@ -73,3 +74,164 @@ TEST(Ex2TestSuite, DoubleSphereProjectUnproject) {
 TEST(Ex2TestSuite, KannalaBrandt4ProjectUnproject) {
   test_project_unproject<KannalaBrandt4Camera<double>>();
 }
+
+template <typename CamT>
+void test_project_batch() {
+  CamT cam = CamT::getTestProjections();
+
+  typedef typename CamT::Vec2 Vec2;
+  typedef typename CamT::Vec3 Vec3;
+
+  // includes a point on the optical axis
+  typename CamT::Vec3Batch p(21 * 21, 3);
+  int i = 0;
+  for (int x = -10; x <= 10; x++) {
+    for (int y = -10; y <= 10; y++) {
+      p.row(i++) = Vec3(x, y, 5).transpose();
+    }
+  }
+
+  typename CamT::Vec2Batch res(p.rows(), 2);
+  cam.projectBatch(p, res);
+
+  for (i = 0; i < p.rows(); i++) {
+    const Vec2 res_ref = cam.project(p.row(i).transpose());
+    ASSERT_TRUE(res_ref.isApprox(res.row(i).transpose()))
+        << "res_ref " << res_ref.transpose() << " res " << res.row(i);
+  }
+}
+
+TEST(Ex2TestSuite, PinholeProjectBatch) {
+  test_project_batch<PinholeCamera<double>>();
+}
+
+TEST(Ex2TestSuite, ExtendedUnifiedProjectBatch) {
+  test_project_batch<ExtendedUnifiedCamera<double>>();
+}
+
+TEST(Ex2TestSuite, DoubleSphereProjectBatch) {
+  test_project_batch<DoubleSphereCamera<double>>();
+}
+
+TEST(Ex2TestSuite, KannalaBrandt4ProjectBatch) {
+  test_project_batch<KannalaBrandt4Camera<double>>();
+}
+
+template <template <class> class CamT>
+void test_project_jacobians() {
+  typedef ceres::Jet<double, 3 + 8> Jet;
+
+  const CamT<double> cam = CamT<double>::getTestProjections();
+
+  typename CamT<Jet>::VecN param_jet;
+  for (int k = 0; k < 8; k++) param_jet[k] = Jet(cam.getParam()[k], 3 + k);
+  const CamT<Jet> cam_jet(param_jet);
+
+  // the optical axis is skipped, there autodiff only sees the constant
+  // principal point of the Kannala-Brandt model
+  typename CamT<double>::Vec3Batch p(21 * 21 - 1, 3);
+  int i = 0;
+  for (int x = -10; x <= 10; x++) {
+    for (int y = -10; y <= 10; y++) {
+      if (x != 0 || y != 0) p.row(i++) << x, y, 5;
+    }
+  }
+
+  for (i = 0; i < p.rows(); i++) {
+    const typename CamT<Jet>::Vec3 p_jet(Jet(p(i, 0), 0), Jet(p(i, 1), 1),
+                                         Jet(p(i, 2), 2));
+    const typename CamT<Jet>::Vec2 res_jet = cam_jet.project(p_jet);
+
+    typename CamT<double>::Mat23 d_proj_d_p3d;
+    typename CamT<double>::Mat2N d_proj_d_param;
+    const typename CamT<double>::Vec2 res = cam.project(
+        p.row(i).transpose(), &d_proj_d_p3d, &d_proj_d_param);
+
+    for (int r = 0; r < 2; r++) {
+      ASSERT_NEAR(res_jet[r].a, res[r], 1e-10);
+      ASSERT_TRUE(d_proj_d_p3d.row(r).transpose().isApprox(
+          res_jet[r].v.template head<3>(), 1e-10))
+          << "d_proj_d_p3d " << d_proj_d_p3d.row(r) << " ref "
+          << res_jet[r].v.template head<3>().transpose();
+      ASSERT_TRUE(d_proj_d_param.row(r).transpose().isApprox(
+          res_jet[r].v.template tail<8>(), 1e-10))
+          << "d_proj_d_param " << d_proj_d_param.row(r) << " ref "
+          << res_jet[r].v.template tail<8>().transpose();
+    }
+  }
+
+  // batch variant through the abstract interface
+  const AbstractCamera<double>& abstract_cam = cam;
+  typename CamT<double>::Vec2Batch res(p.rows(), 2);
+  typename CamT<double>::Mat23Batch d_proj_d_p3d;
+  typename CamT<double>::Mat2NBatch d_proj_d_param;
+  abstract_cam.projectBatch(p, res, &d_proj_d_p3d, &d_proj_d_param);
+
+  ASSERT_EQ(d_proj_d_p3d.rows(), p.rows());
+  ASSERT_EQ(d_proj_d_param.rows(), p.rows());
+  for (i = 0; i < p.rows(); i++) {
+    typename CamT<double>::Mat23 d_p3d_ref;
+    typename CamT<double>::Mat2N d_param_ref;
+    const typename CamT<double>::Vec2 res_ref =
+        cam.project(p.row(i).transpose(), &d_p3d_ref, &d_param_ref);
+
+    ASSERT_TRUE(res_ref.isApprox(res.row(i).transpose()));
+    ASSERT_TRUE(d_p3d_ref.row(0).isApprox(
+        d_proj_d_p3d.row(i).template head<3>()));
+    ASSERT_TRUE(d_p3d_ref.row(1).isApprox(
+        d_proj_d_p3d.row(i).template tail<3>()));
+    ASSERT_TRUE(d_param_ref.row(0).isApprox(
+        d_proj_d_param.row(i).template head<8>()));
+    ASSERT_TRUE(d_param_ref.row(1).isApprox(
+        d_proj_d_param.row(i).template tail<8>()));
+  }
+}
+
+TEST(Ex2TestSuite, PinholeProjectJacobians) {
+  test_project_jacobians<PinholeCamera>();
+}
+
+TEST(Ex2TestSuite, ExtendedUnifiedProjectJacobians) {
+  test_project_jacobians<ExtendedUnifiedCamera>();
+}
+
+TEST(Ex2TestSuite, DoubleSphereProjectJacobians) {
+  test_project_jacobians<DoubleSphereCamera>();
+}
+
+TEST(Ex2TestSuite, KannalaBrandt4ProjectJacobians) {
+  test_project_jacobians<KannalaBrandt4Camera>();
+}
+
+TEST(Ex2TestSuite, BearingLutUnproject) {
+  auto cam = std::make_shared<ExtendedUnifiedCamera<double>>(
+      ExtendedUnifiedCamera<double>::getTestProjections());
+  cam->width() = 640;
+  cam->height() = 480;
+
+  BearingLutCamera<double> lut_cam(cam);
+  ASSERT_EQ(lut_cam.name(), cam->name());
+  ASSERT_FALSE(lut_cam.update());
+
+  // subpixel positions inside the image and a few outside, which fall back to
+  // the wrapped camera
+  for (double y = -2.5; y < 482; y += 3.7) {
+    for (double x = -2.5; x < 642; x += 4.3) {
+      const Eigen::Vector2d p(x, y);
+      const Eigen::Vector3d bearing = lut_cam.unproject(p);
+      const Eigen::Vector3d bearing_ref = cam->unproject(p);
+      ASSERT_NEAR(bearing.norm(), 1.0, 1e-9);
+      ASSERT_LT((bearing - bearing_ref).norm(), 1e-5)
+          << "p " << p.transpose() << " bearing " << bearing.transpose()
+          << " bearing_ref " << bearing_ref.transpose();
+    }
+  }
+
+  // changed intrinsics (e.g. in bundle adjustment) bypass the stale table
+  // until it is rebuilt
+  lut_cam.data()[0] *= 1.1;
+  const Eigen::Vector2d p(100.3, 200.7);
+  ASSERT_TRUE(lut_cam.unproject(p).isApprox(cam->unproject(p)));
+  ASSERT_TRUE(lut_cam.update());
+  ASSERT_LT((lut_cam.unproject(p) - cam->unproject(p)).norm(), 1e-5);
+}
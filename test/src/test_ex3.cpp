@@ -36,15 +36,21 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <pangolin/image/image_io.h>
 #include <pangolin/image/typed_image.h>
 
+#include "visnav/image_pack.h"
+#include "visnav/image_prefetcher.h"
 #include "visnav/keypoints.h"
 #include "visnav/matching_utils.h"
+#include "visnav/optical_flow.h"
 
 #include "visnav/serialization.h"
 
 #include "visnav/bow_db.h"
 #include "visnav/bow_voc.h"
 
+#include <algorithm>
 #include <fstream>
+#include <future>
+#include <memory>
 #include <random>
 #include <chrono>
 
@@ -108,6 +114,57 @@ TEST(Ex3TestSuite, KeypointAngles) {
   }
 }
 
+TEST(Ex3TestSuite, KeypointAnglesPatchMoments) {
+  pangolin::ManagedImage<uint8_t> img0 = pangolin::LoadImage(img0_path);
+
+  KeypointsData kd0_loaded;
+
+  {
+    std::ifstream os(kd0_path, std::ios::binary);
+    cereal::JSONInputArchive archive(os);
+    archive(kd0_loaded);
+  }
+
+  // the detected corners and a grid of points covering the whole image
+  KeypointsData kd;
+  kd.corners = kd0_loaded.corners;
+  for (int y = EDGE_THRESHOLD; y < int(img0.h) - EDGE_THRESHOLD; y += 7) {
+    for (int x = EDGE_THRESHOLD; x < int(img0.w) - EDGE_THRESHOLD; x += 7) {
+      kd.corners.emplace_back(x, y);
+    }
+  }
+
+  computeAngles(img0, kd, true);
+  ASSERT_EQ(kd.corners.size(), kd.corner_angles.size());
+
+  for (size_t i = 0; i < kd.corners.size(); i++) {
+    const int cx = kd.corners[i][0];
+    const int cy = kd.corners[i][1];
+
+    // previous computation, pixel by pixel over the square around the patch
+    double m_01 = 0;
+    double m_10 = 0;
+    for (int u = -HALF_PATCH_SIZE; u <= HALF_PATCH_SIZE; ++u) {
+      for (int v = -HALF_PATCH_SIZE; v <= HALF_PATCH_SIZE; ++v) {
+        if (u * u + v * v <= HALF_PATCH_SIZE * HALF_PATCH_SIZE) {
+          const double pixel = img0(cx + u, cy + v);
+          m_01 += v * pixel;
+          m_10 += u * pixel;
+        }
+      }
+    }
+    const double angle = (m_01 != 0 || m_10 != 0) ? std::atan2(m_01, m_10) : 0;
+
+    int patch_m_01, patch_m_10;
+    computePatchMoments(img0.RowPtr(cy) + cx, img0.pitch, patch_m_01,
+                        patch_m_10);
+    ASSERT_EQ(m_01, patch_m_01) << "corner " << cx << " " << cy;
+    ASSERT_EQ(m_10, patch_m_10) << "corner " << cx << " " << cy;
+    ASSERT_NEAR(angle, kd.corner_angles[i], 1e-8)
+        << "corner " << cx << " " << cy;
+  }
+}
+
 TEST(Ex3TestSuite, KeypointDescriptors) {
   pangolin::ManagedImage<uint8_t> img0 = pangolin::LoadImage(img0_path);
   pangolin::ManagedImage<uint8_t> img1 = pangolin::LoadImage(img1_path);
@@ -146,6 +203,228 @@ TEST(Ex3TestSuite, KeypointDescriptors) {
   }
 }
 
+TEST(Ex3TestSuite, KeypointDescriptorsQuantized) {
+  pangolin::ManagedImage<uint8_t> img0 = pangolin::LoadImage(img0_path);
+
+  KeypointsData kd0;
+  detectKeypointsAndDescriptors(img0, kd0, NUM_FEATURES, true);
+
+  // corner angles at the centers of the 0 and 180 degree bins give integer
+  // pattern offsets, so both variants have to sample the same pixels
+  for (const double angle : {0.0, M_PI}) {
+    KeypointsData kd_exact = kd0, kd_quantized = kd0;
+    std::fill(kd_exact.corner_angles.begin(), kd_exact.corner_angles.end(),
+              angle);
+    kd_quantized.corner_angles = kd_exact.corner_angles;
+
+    computeDescriptors(img0, kd_exact, DescriptorMethod::Exact);
+    computeDescriptors(img0, kd_quantized, DescriptorMethod::Quantized);
+
+    ASSERT_EQ(kd_exact.corner_descriptors.size(),
+              kd_quantized.corner_descriptors.size());
+
+    for (size_t i = 0; i < kd_exact.corner_descriptors.size(); i++) {
+      ASSERT_TRUE((kd_exact.corner_descriptors[i] ^
+                   kd_quantized.corner_descriptors[i])
+                      .count() == 0);
+    }
+  }
+}
+
+TEST(Ex3TestSuite, KeypointsFastGrid) {
+  pangolin::ManagedImage<uint8_t> img0 = pangolin::LoadImage(img0_path);
+
+  KeypointsData kd0;
+  detectKeypoints(img0, kd0, NUM_FEATURES, DetectorMethod::FastGrid);
+
+  ASSERT_GT(kd0.corners.size(), 0u);
+  ASSERT_LE(int(kd0.corners.size()), NUM_FEATURES);
+
+  std::set<std::pair<int, int>> unique_corners;
+  for (const auto& p : kd0.corners) {
+    EXPECT_TRUE(img0.InBounds(p[0], p[1], EDGE_THRESHOLD));
+    unique_corners.emplace(p[0], p[1]);
+  }
+  EXPECT_EQ(unique_corners.size(), kd0.corners.size());
+}
+
+TEST(Ex3TestSuite, OpticalFlowShift) {
+  pangolin::ManagedImage<uint8_t> img0 = pangolin::LoadImage(img0_path);
+
+  // img1 shows the content of img0 moved by (shift_x, shift_y)
+  const int shift_x = 5, shift_y = -3;
+  pangolin::ManagedImage<uint8_t> img1(img0.w, img0.h);
+  for (int y = 0; y < int(img1.h); y++) {
+    for (int x = 0; x < int(img1.w); x++) {
+      const int x0 = std::clamp(x - shift_x, 0, int(img0.w) - 1);
+      const int y0 = std::clamp(y - shift_y, 0, int(img0.h) - 1);
+      img1(x, y) = img0(x0, y0);
+    }
+  }
+
+  KeypointsData kd0;
+  detectKeypoints(img0, kd0, NUM_FEATURES);
+
+  ImagePyramid pyramid0, pyramid1;
+  buildImagePyramid(img0, OPTICAL_FLOW_LEVELS, pyramid0);
+  buildImagePyramid(img1, OPTICAL_FLOW_LEVELS, pyramid1);
+
+  std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>>
+      points1;
+  std::vector<bool> tracked;
+  trackPointsOpticalFlow(pyramid0, pyramid1, kd0.corners, points1, tracked);
+
+  ASSERT_EQ(kd0.corners.size(), tracked.size());
+
+  size_t num_tracked = 0;
+  for (size_t i = 0; i < kd0.corners.size(); i++) {
+    if (!tracked[i]) continue;
+    num_tracked++;
+
+    const Eigen::Vector2d expected =
+        kd0.corners[i] + Eigen::Vector2d(shift_x, shift_y);
+    EXPECT_LT((points1[i] - expected).norm(), 0.1);
+  }
+
+  EXPECT_GT(num_tracked, kd0.corners.size() * 9 / 10);
+}
+
+TEST(Ex3TestSuite, ImagePackRoundTrip) {
+  const std::string pack_path = "test_image_pack.pack";
+
+  // images with odd sizes, the second one with a row padding
+  std::vector<uint8_t> buffer(20 * 9);
+  for (size_t i = 0; i < buffer.size(); i++) buffer[i] = i % 251;
+  const pangolin::Image<uint8_t> img0(buffer.data(), 13, 7, 13);
+  const pangolin::Image<uint8_t> img1(buffer.data(), 17, 9, 20);
+
+  ImagePackWriter writer;
+  ASSERT_TRUE(writer.open(pack_path));
+  ASSERT_TRUE(writer.add(FrameCamId(0, 0), 100, img0));
+  ASSERT_TRUE(writer.add(FrameCamId(0, 1), 100, img1));
+  ASSERT_TRUE(writer.add(FrameCamId(1, 0), 200, img1));
+  ASSERT_TRUE(writer.finish());
+
+  ImagePack pack;
+  ASSERT_TRUE(pack.open(pack_path));
+  ASSERT_EQ(pack.size(), 3u);
+  ASSERT_EQ(pack.find(FrameCamId(1, 1)), -1);
+
+  const std::vector<std::pair<FrameCamId, const pangolin::Image<uint8_t>*>>
+      expected = {{FrameCamId(0, 0), &img0},
+                  {FrameCamId(0, 1), &img1},
+                  {FrameCamId(1, 0), &img1}};
+  for (const auto& [fcid, img_ref] : expected) {
+    const int64_t i = pack.find(fcid);
+    ASSERT_GE(i, 0);
+    ASSERT_EQ(pack.entry(i).timestamp, fcid.frame_id == 0 ? 100 : 200);
+
+    const pangolin::Image<uint8_t> img = pack.image(i);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(img.ptr) % IMAGE_PACK_ALIGNMENT, 0u);
+    ASSERT_EQ(img.w, img_ref->w);
+    ASSERT_EQ(img.h, img_ref->h);
+    for (size_t y = 0; y < img.h; y++) {
+      for (size_t x = 0; x < img.w; x++) {
+        ASSERT_EQ(img(x, y), (*img_ref)(x, y));
+      }
+    }
+  }
+
+  pack.close();
+
+  // an entry whose pitch times height wraps around is rejected
+  {
+    std::fstream fs(pack_path,
+                    std::ios::in | std::ios::out | std::ios::binary);
+    ImagePackHeader header;
+    fs.read(reinterpret_cast<char*>(&header), sizeof(header));
+    ImagePackEntry e;
+    fs.seekg(header.index_offset);
+    fs.read(reinterpret_cast<char*>(&e), sizeof(e));
+    e.height = 2;
+    e.pitch = (uint64_t(1) << 63) + 1;
+    fs.seekp(header.index_offset);
+    fs.write(reinterpret_cast<const char*>(&e), sizeof(e));
+  }
+  ASSERT_FALSE(pack.open(pack_path));
+
+  std::remove(pack_path.c_str());
+}
+
+TEST(Ex3TestSuite, ImagePrefetcher) {
+  const FrameId num_frames = 20;
+  const CamId num_cams = 2;
+
+  // small PGM images whose pixels encode frame, camera and position
+  auto pixel = [](FrameId frame_id, CamId cam_id, int x, int y) {
+    return uint8_t(frame_id * 7 + cam_id * 3 + x + 2 * y);
+  };
+  auto path = [](const FrameCamId& fcid) {
+    return "test_prefetch_" + std::to_string(fcid.frame_id) + "_" +
+           std::to_string(fcid.cam_id) + ".pgm";
+  };
+  const int w = 11, h = 5;
+  for (FrameId frame_id = 0; frame_id < num_frames; frame_id++) {
+    for (CamId cam_id = 0; cam_id < num_cams; cam_id++) {
+      std::ofstream os(path(FrameCamId(frame_id, cam_id)), std::ios::binary);
+      os << "P5\n" << w << " " << h << "\n255\n";
+      for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) os.put(pixel(frame_id, cam_id, x, y));
+      }
+    }
+  }
+
+  // path functions that share token, which is released with them
+  auto token = std::make_shared<int>(0);
+  auto counted_path = [&token, &path] {
+    return ImagePrefetcher::PathFunction(
+        [token, path](const FrameCamId& fcid) { return path(fcid); });
+  };
+
+  {
+    ImagePrefetcher prefetcher(num_frames, num_cams, counted_path(), 4);
+    for (FrameId frame_id = 0; frame_id < num_frames; frame_id++) {
+      const ImagePrefetcher::FrameImages& images =
+          prefetcher.acquire(frame_id);
+      ASSERT_EQ(size_t(num_cams), images.size());
+      for (CamId cam_id = 0; cam_id < num_cams; cam_id++) {
+        ASSERT_EQ(size_t(w), images[cam_id].w);
+        ASSERT_EQ(size_t(h), images[cam_id].h);
+        for (int y = 0; y < h; y++) {
+          for (int x = 0; x < w; x++) {
+            ASSERT_EQ(pixel(frame_id, cam_id, x, y), images[cam_id](x, y))
+                << "frame " << frame_id << " cam " << cam_id;
+          }
+        }
+      }
+    }
+
+    const ImagePrefetcher::Stats stats = prefetcher.stats();
+    EXPECT_EQ(size_t(num_frames), stats.num_acquired);
+    EXPECT_EQ(size_t(num_frames), stats.num_loaded);
+  }
+  EXPECT_EQ(1, token.use_count());
+
+  // stopping with a full ring and frames left to load does not wait for them
+  {
+    auto prefetcher = std::make_unique<ImagePrefetcher>(
+        num_frames, num_cams, counted_path(), 2);
+    ASSERT_EQ(pixel(0, 1, 0, 0), prefetcher->acquire(0)[1](0, 0));
+
+    auto stopped = std::async(std::launch::async,
+                              [&prefetcher] { prefetcher.reset(); });
+    ASSERT_EQ(std::future_status::ready,
+              stopped.wait_for(std::chrono::seconds(10)));
+  }
+  EXPECT_EQ(1, token.use_count());
+
+  for (FrameId frame_id = 0; frame_id < num_frames; frame_id++) {
+    for (CamId cam_id = 0; cam_id < num_cams; cam_id++) {
+      std::remove(path(FrameCamId(frame_id, cam_id)).c_str());
+    }
+  }
+}
+
 TEST(Ex3TestSuite, DescriptorMatching) {
   MatchData md, md_loaded;
   KeypointsData kd0_loaded, kd1_loaded;
@@ -185,6 +464,83 @@ TEST(Ex3TestSuite, DescriptorMatching) {
   }
 }
 
+// Mutual best matches with ratio test, one descriptor pair after the other.
+void match_descriptors_reference(const std::vector<Descriptor>& descriptors_1,
+                                 const std::vector<Descriptor>& descriptors_2,
+                                 std::vector<std::pair<int, int>>& matches) {
+  matches.clear();
+
+  auto best_match = [](const Descriptor& d,
+                       const std::vector<Descriptor>& descriptors) {
+    int best_idx = -1;
+    int best_dist = std::numeric_limits<int>::max();
+    int second_best_dist = std::numeric_limits<int>::max();
+    for (size_t j = 0; j < descriptors.size(); j++) {
+      const int dist = hammingDistance(d, descriptors[j]);
+      if (dist < best_dist) {
+        second_best_dist = best_dist;
+        best_dist = dist;
+        best_idx = j;
+      } else if (dist < second_best_dist) {
+        second_best_dist = dist;
+      }
+    }
+    const bool accepted = best_dist < MATCH_THRESHOLD &&
+                          second_best_dist >= best_dist * DIST_2_BEST;
+    return accepted ? best_idx : -1;
+  };
+
+  for (size_t i = 0; i < descriptors_1.size(); i++) {
+    const int j = best_match(descriptors_1[i], descriptors_2);
+    if (j >= 0 && best_match(descriptors_2[j], descriptors_1) == int(i)) {
+      matches.emplace_back(i, j);
+    }
+  }
+}
+
+TEST(Ex3TestSuite, DescriptorMatchingTiled) {
+  KeypointsData kd0_loaded, kd1_loaded;
+
+  {
+    std::ifstream os(kd0_path, std::ios::binary);
+    cereal::JSONInputArchive archive(os);
+    archive(kd0_loaded);
+  }
+
+  {
+    std::ifstream os(kd1_path, std::ios::binary);
+    cereal::JSONInputArchive archive(os);
+    archive(kd1_loaded);
+  }
+
+  const int n0 = kd0_loaded.corner_descriptors.size();
+  const int n1 = kd1_loaded.corner_descriptors.size();
+
+  // full sets and subsets that end inside a tile of rows or columns
+  const std::vector<std::pair<int, int>> sizes = {
+      {n0, n1},
+      {1, n1},
+      {n0, 1},
+      {MATCH_TILE_ROWS - 1, MATCH_TILE_COLS + 1},
+      {MATCH_TILE_ROWS + 1, MATCH_TILE_COLS - 1},
+      {3 * MATCH_TILE_ROWS + 17, 2 * MATCH_TILE_COLS + 5},
+      {n0 - 7, n1 - 13}};
+
+  for (const auto& [s0, s1] : sizes) {
+    ASSERT_TRUE(s0 <= n0 && s1 <= n1);
+    const auto& all0 = kd0_loaded.corner_descriptors;
+    const auto& all1 = kd1_loaded.corner_descriptors;
+    const std::vector<Descriptor> d0(all0.begin(), all0.begin() + s0);
+    const std::vector<Descriptor> d1(all1.begin(), all1.begin() + s1);
+
+    std::vector<std::pair<int, int>> matches, matches_ref;
+    matchDescriptors(d0, d1, matches, MATCH_THRESHOLD, DIST_2_BEST);
+    match_descriptors_reference(d0, d1, matches_ref);
+
+    ASSERT_EQ(matches_ref, matches) << "sizes " << s0 << " " << s1;
+  }
+}
+
 TEST(Ex3TestSuite, KeypointsAll) {
   pangolin::ManagedImage<uint8_t> img0 = pangolin::LoadImage(img0_path);
   pangolin::ManagedImage<uint8_t> img1 = pangolin::LoadImage(img1_path);
@@ -278,6 +634,76 @@ TEST(Ex3TestSuite, EpipolarInliers) {
   }
 }
 
+TEST(Ex3TestSuite, DescriptorMatchingEpipolar) {
+  Calibration calib;
+  KeypointsData kd0_loaded, kd1_loaded;
+
+  {
+    std::ifstream os(calib_path, std::ios::binary);
+
+    if (os.is_open()) {
+      cereal::JSONInputArchive archive(os);
+      archive(calib);
+    } else {
+      ASSERT_TRUE(false) << "could not load camera ";
+    }
+  }
+
+  {
+    std::ifstream os(kd0_path, std::ios::binary);
+    cereal::JSONInputArchive archive(os);
+    archive(kd0_loaded);
+  }
+
+  {
+    std::ifstream os(kd1_path, std::ios::binary);
+    cereal::JSONInputArchive archive(os);
+    archive(kd1_loaded);
+  }
+
+  const double epipolar_error_threshold = 1e-3;
+
+  Eigen::Matrix3d E;
+  Sophus::SE3d T_0_1 = calib.T_i_c[0].inverse() * calib.T_i_c[1];
+  computeEssential(T_0_1, E);
+
+  auto epipolar_error = [&](const std::pair<int, int>& match) {
+    const Eigen::Vector3d p0 =
+        calib.intrinsics[0]->unproject(kd0_loaded.corners[match.first]);
+    const Eigen::Vector3d p1 =
+        calib.intrinsics[1]->unproject(kd1_loaded.corners[match.second]);
+    return std::abs(p0.transpose() * E * p1);
+  };
+
+  MatchData md;
+  matchDescriptorsEpipolar(kd0_loaded, kd1_loaded, calib.intrinsics[0],
+                           calib.intrinsics[1], T_0_1, MATCH_THRESHOLD,
+                           DIST_2_BEST, epipolar_error_threshold, md);
+  ASSERT_FALSE(md.matches.empty());
+
+  // every match fulfills the epipolar constraint
+  for (const auto& match : md.matches) {
+    ASSERT_LE(epipolar_error(match), epipolar_error_threshold)
+        << "match " << match.first << " " << match.second;
+  }
+
+  // matches of the unconstrained matching that violate it are not returned
+  MatchData md_all;
+  matchDescriptors(kd0_loaded.corner_descriptors,
+                   kd1_loaded.corner_descriptors, md_all.matches,
+                   MATCH_THRESHOLD, DIST_2_BEST);
+
+  size_t num_violating = 0;
+  for (const auto& match : md_all.matches) {
+    if (epipolar_error(match) <= epipolar_error_threshold) continue;
+    num_violating++;
+    ASSERT_TRUE(std::find(md.matches.begin(), md.matches.end(), match) ==
+                md.matches.end())
+        << "match " << match.first << " " << match.second;
+  }
+  ASSERT_GT(num_violating, 0u);
+}
+
 TEST(Ex3TestSuite, RansacInliers) {
   Calibration calib;
 
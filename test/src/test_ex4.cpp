@@ -30,6 +30,8 @@ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <random>
+
 #include <gtest/gtest.h>
 
 #include "visnav/map_utils.h"
@@ -543,3 +545,94 @@ TEST(Ex4TestSuite, BundleAdjustmentIntrinsics) {
   //  test_cameras_equal(cameras_ref, cameras);
   //  test_landmarks_equal(landmarks_ref, landmarks);
 }
+
+template <template <class> class CamT>
+void test_analytic_reprojection_jacobians() {
+  const CamT<double> cam = CamT<double>::getTestProjections();
+  const std::string cam_model = cam.name();
+  Eigen::Matrix<double, 8, 1> intr = cam.getParam();
+
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+
+  for (int i = 0; i < 100; i++) {
+    Sophus::SE3d T_w_i = Sophus::SE3d::exp(Sophus::Vector6d::Random());
+    Sophus::SE3d T_i_c =
+        Sophus::SE3d::exp(0.2 * Sophus::Vector6d::Random());
+    const Sophus::SE3d T_w_c = T_w_i * T_i_c;
+
+    const double z = 1.0 + 4.0 * (uniform(gen) + 1.0) / 2.0;
+    const Eigen::Vector3d p_c(0.7 * z * uniform(gen), 0.7 * z * uniform(gen),
+                              z);
+    Eigen::Vector3d p_w = T_w_c * p_c;
+    const Eigen::Vector2d p_2d =
+        cam.project(p_c) + Eigen::Vector2d(uniform(gen), uniform(gen));
+
+    // bundle adjustment residual
+    {
+      std::unique_ptr<ceres::CostFunction> analytic(
+          createBundleAdjustmentReprojectionCostFunction(p_2d, cam_model,
+                                                         true));
+      std::unique_ptr<ceres::CostFunction> autodiff(
+          createBundleAdjustmentReprojectionCostFunction(p_2d, cam_model,
+                                                         false));
+
+      Sophus::SE3d T = T_w_c;
+      double const* parameters[3] = {T.data(), p_w.data(), intr.data()};
+      Eigen::Vector2d res, res_ref;
+      Eigen::Matrix<double, 2, 7, Eigen::RowMajor> J_T, J_T_ref;
+      Eigen::Matrix<double, 2, 3, Eigen::RowMajor> J_p, J_p_ref;
+      Eigen::Matrix<double, 2, 8, Eigen::RowMajor> J_i, J_i_ref;
+      double* jacobians[3] = {J_T.data(), J_p.data(), J_i.data()};
+      double* jacobians_ref[3] = {J_T_ref.data(), J_p_ref.data(),
+                                  J_i_ref.data()};
+
+      ASSERT_TRUE(analytic->Evaluate(parameters, res.data(), jacobians));
+      ASSERT_TRUE(
+          autodiff->Evaluate(parameters, res_ref.data(), jacobians_ref));
+
+      EXPECT_TRUE(res.isApprox(res_ref, 1e-10)) << cam_model;
+      EXPECT_TRUE(J_T.isApprox(J_T_ref, 1e-8)) << cam_model;
+      EXPECT_TRUE(J_p.isApprox(J_p_ref, 1e-8)) << cam_model;
+      EXPECT_TRUE(J_i.isApprox(J_i_ref, 1e-8)) << cam_model;
+
+      // residual only
+      Eigen::Vector2d res_only;
+      ASSERT_TRUE(analytic->Evaluate(parameters, res_only.data(), nullptr));
+      EXPECT_TRUE(res_only.isApprox(res_ref, 1e-10)) << cam_model;
+    }
+
+    // calibration residual
+    {
+      std::unique_ptr<ceres::CostFunction> analytic(
+          createReprojectionCostFunction(p_2d, p_w, cam_model, true));
+      std::unique_ptr<ceres::CostFunction> autodiff(
+          createReprojectionCostFunction(p_2d, p_w, cam_model, false));
+
+      double const* parameters[3] = {T_w_i.data(), T_i_c.data(), intr.data()};
+      Eigen::Vector2d res, res_ref;
+      Eigen::Matrix<double, 2, 7, Eigen::RowMajor> J_w_i, J_w_i_ref;
+      Eigen::Matrix<double, 2, 7, Eigen::RowMajor> J_i_c, J_i_c_ref;
+      Eigen::Matrix<double, 2, 8, Eigen::RowMajor> J_i, J_i_ref;
+      double* jacobians[3] = {J_w_i.data(), J_i_c.data(), J_i.data()};
+      double* jacobians_ref[3] = {J_w_i_ref.data(), J_i_c_ref.data(),
+                                  J_i_ref.data()};
+
+      ASSERT_TRUE(analytic->Evaluate(parameters, res.data(), jacobians));
+      ASSERT_TRUE(
+          autodiff->Evaluate(parameters, res_ref.data(), jacobians_ref));
+
+      EXPECT_TRUE(res.isApprox(res_ref, 1e-10)) << cam_model;
+      EXPECT_TRUE(J_w_i.isApprox(J_w_i_ref, 1e-8)) << cam_model;
+      EXPECT_TRUE(J_i_c.isApprox(J_i_c_ref, 1e-8)) << cam_model;
+      EXPECT_TRUE(J_i.isApprox(J_i_ref, 1e-8)) << cam_model;
+    }
+  }
+}
+
+TEST(Ex4TestSuite, AnalyticReprojectionJacobians) {
+  test_analytic_reprojection_jacobians<PinholeCamera>();
+  test_analytic_reprojection_jacobians<ExtendedUnifiedCamera>();
+  test_analytic_reprojection_jacobians<DoubleSphereCamera>();
+  test_analytic_reprojection_jacobians<KannalaBrandt4Camera>();
+}
@@ -32,9 +32,15 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <cstdio>
 #include <fstream>
+#include <random>
 
 #include "visnav/map_utils.h"
+#include "visnav/projection_cache.h"
+#include "visnav/retention.h"
+#include "visnav/spatial_grid.h"
 #include "visnav/vo_utils.h"
 
 using namespace visnav;
@@ -268,6 +274,106 @@ TEST(Ex5TestSuite, FindMatchesLandmarks) {
   }
 }
 
+TEST(Ex5TestSuite, SpatialGridQuery) {
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<double> dist_x(0, 752), dist_y(0, 480);
+
+  SpatialGrid2d::Points points;
+  for (int i = 0; i < 2000; i++) {
+    points.emplace_back(dist_x(gen), dist_y(gen));
+  }
+
+  const double cell_size = 20;
+  SpatialGrid2d grid(points, cell_size);
+
+  std::vector<size_t> indices;
+  for (int i = 0; i < 500; i++) {
+    // also query outside of the grid and with radii larger than a cell
+    const Eigen::Vector2d center(dist_x(gen) * 1.2 - 50,
+                                 dist_y(gen) * 1.2 - 50);
+    const double radius = (i % 3 + 1) * 0.75 * cell_size;
+
+    std::vector<size_t> indices_ref;
+    for (size_t j = 0; j < points.size(); j++) {
+      if ((points[j] - center).squaredNorm() <= radius * radius) {
+        indices_ref.push_back(j);
+      }
+    }
+
+    grid.query(center, radius, indices);
+    ASSERT_EQ(indices_ref, indices);
+  }
+
+  // coinciding points with a cell size of 0
+  const SpatialGrid2d::Points same_points(3, Eigen::Vector2d(5, 7));
+  const SpatialGrid2d same_grid(same_points, 0);
+  same_grid.query(Eigen::Vector2d(5, 7), 0, indices);
+  EXPECT_EQ(std::vector<size_t>({0, 1, 2}), indices);
+  same_grid.query(Eigen::Vector2d(6, 7), 0.5, indices);
+  EXPECT_TRUE(indices.empty());
+}
+
+TEST(Ex5TestSuite, LandmarkDescriptorCache) {
+  std::mt19937_64 gen(7);
+
+  // one observation in each of 6 keyframes, all noisy copies of one descriptor
+  Descriptor base;
+  for (auto& w : base.words) w = gen();
+
+  Corners feature_corners;
+  Landmark lm;
+  for (FrameId fid = 0; fid < 6; fid++) {
+    const FrameCamId fcid(fid, 0);
+    KeypointsData& kd = feature_corners[fcid];
+    kd.corner_descriptors.resize(fid + 1);
+
+    Descriptor d = base;
+    for (int k = 0; k < 20; k++) d.set(gen() % 256, gen() & 1);
+    kd.corner_descriptors[fid] = d;
+
+    add_landmark_observation(lm, fcid, fid, kd);
+    ASSERT_TRUE(lm.hasDescriptorCache());
+  }
+
+  // the median is computed per bit over all observations, matching uses it
+  // and the num_recent most recent ones
+  auto check_cache = [&](const size_t num_recent) {
+    std::vector<Descriptor> descriptors;
+    for (const auto& [fcid, fid] : lm.obs) {
+      descriptors.push_back(feature_corners.at(fcid).corner_descriptors[fid]);
+    }
+
+    Descriptor median;
+    for (int n = 0; n < 256; n++) {
+      int count = 0;
+      for (const auto& d : descriptors) count += d.test(n);
+      median.set(n, 2 * count > int(descriptors.size()));
+    }
+    EXPECT_EQ(median, lm.descriptors.median);
+
+    EXPECT_EQ(int(num_recent), lm.descriptors.num_recent);
+
+    int min_dist = hammingDistance(base, median);
+    for (size_t i = descriptors.size() - num_recent; i < descriptors.size();
+         i++) {
+      min_dist = std::min(min_dist, hammingDistance(base, descriptors[i]));
+    }
+    EXPECT_EQ(min_dist, lm.descriptors.minDistance(base));
+  };
+
+  check_cache(LANDMARK_NUM_RECENT_DESCRIPTORS);
+
+  // removing a recent observation does not bring back older ones
+  remove_landmark_observation(lm, FrameCamId(0, 0), &feature_corners);
+  remove_landmark_observation(lm, FrameCamId(5, 0), &feature_corners);
+  ASSERT_TRUE(lm.hasDescriptorCache());
+  check_cache(LANDMARK_NUM_RECENT_DESCRIPTORS - 1);
+
+  // without the descriptors of the removed observation the cache is dropped
+  remove_landmark_observation(lm, FrameCamId(1, 0), nullptr);
+  EXPECT_FALSE(lm.hasDescriptorCache());
+}
+
 TEST(Ex5TestSuite, LocalizeCamera) {
   Calibration calib_cam;
   Corners feature_corners;
@@ -337,6 +443,43 @@ TEST(Ex5TestSuite, LocalizeCamera) {
   test_pose_equal(cameras.at(fcid).T_w_c, md.T_w_c, 2e-2);
 }
 
+TEST(Ex5TestSuite, TriangulateMidpointBatch) {
+  Calibration calib_cam;
+  load_calib(calib_path, calib_cam);
+
+  const Sophus::SE3d T_0_1 = calib_cam.T_i_c[0].inverse() * calib_cam.T_i_c[1];
+
+  std::mt19937 gen(0);
+  std::uniform_real_distribution<double> xy(-2, 2), z(1, 10);
+
+  const int num_points = 100;
+  Eigen::Matrix3Xd p_0(3, num_points), f0(3, num_points), f1(3, num_points);
+  for (int i = 0; i < num_points; i++) {
+    p_0.col(i) = Eigen::Vector3d(xy(gen), xy(gen), z(gen));
+    f0.col(i) = p_0.col(i).normalized();
+    f1.col(i) = (T_0_1.inverse() * p_0.col(i)).normalized();
+  }
+
+  // point behind both cameras
+  f0.col(0) *= -1;
+  f1.col(0) *= -1;
+  // parallel rays
+  f1.col(1) = T_0_1.so3().inverse() * f0.col(1);
+
+  Eigen::Matrix3Xd points;
+  std::vector<bool> valid;
+  triangulate_midpoint_batch(T_0_1, f0, f1, STEREO_MIN_PARALLAX, points,
+                             valid);
+
+  ASSERT_EQ(size_t(num_points), valid.size());
+  EXPECT_FALSE(valid[0]);
+  EXPECT_FALSE(valid[1]);
+  for (int i = 2; i < num_points; i++) {
+    EXPECT_TRUE(valid[i]);
+    EXPECT_TRUE(points.col(i).isApprox(p_0.col(i), 1e-6)) << "point " << i;
+  }
+}
+
 TEST(Ex5TestSuite, AddNewLandmarks) {
   Calibration calib_cam;
   Corners feature_corners;
@@ -425,10 +568,15 @@ TEST(Ex5TestSuite, AddNewLandmarks) {
 
   test_landmarks_equal(old_landmarks_ref, old_landmarks);
 
-  // Don't test these (empirically determined) inaccurate landmarks to make sure
-  // implementations using both opengv::triangulation::triangulate() and
-  // opengv::triangulation::triangulate2() pass the test.
+  // These (empirically determined) inaccurate landmarks of the reference are
+  // triangulated behind the cameras, so add_new_landmarks rejects them.
   std::set<TrackId> skip_landmarks = {100257, 100250, 100246};
+  new_landmarks_ref.erase(
+      std::remove_if(new_landmarks_ref.begin(), new_landmarks_ref.end(),
+                     [&](const auto& kv) {
+                       return skip_landmarks.count(kv.first) > 0;
+                     }),
+      new_landmarks_ref.end());
 
   // The track_ids of new added landmarks might differ if they are added in a
   // differen order. However, we can sort newly added landmarks by their
@@ -464,7 +612,6 @@ TEST(Ex5TestSuite, AddNewLandmarks) {
 
   ASSERT_EQ(new_landmarks_ref.size(), new_landmarks.size());
   for (int64_t i = 0; i < int64_t(new_landmarks.size()); i++) {
-    if (skip_landmarks.count(new_landmarks_ref[i].first)) continue;
     test_landmark_equal(new_landmarks_ref[i].second, new_landmarks[i].second,
                         new_landmarks_ref[i].first);
   }
@@ -523,3 +670,348 @@ TEST(Ex5TestSuite, RemoveOldKFs) {
     }
   }
 }
+
+TEST(Ex5TestSuite, RemoveOldKFsWithIndex) {
+  Corners feature_corners;
+  Matches feature_matches;
+  FeatureTracks feature_tracks;
+  FeatureTracks outlier_tracks;
+  Cameras cameras;
+  Landmarks landmarks;
+
+  load_map_file(map_localize_path, feature_corners, feature_matches,
+                feature_tracks, outlier_tracks, cameras, landmarks);
+
+  std::set<FrameId> kf_frames;
+  for (const auto& kv : cameras) {
+    kf_frames.emplace(kv.first.frame_id);
+  }
+  const FrameCamId fcid(*kf_frames.rbegin() + 1, 0);
+  cameras[fcid] = cameras.begin()->second;
+  cameras[FrameCamId(fcid.frame_id, 1)] = cameras.begin()->second;
+
+  FrameLandmarkIndex frame_landmarks;
+  frame_landmarks.rebuild(landmarks);
+
+  // removal by scanning all landmarks as reference
+  Cameras cameras_ref = cameras;
+  Landmarks landmarks_ref = landmarks, old_landmarks_ref;
+  std::set<FrameId> kf_frames_ref = kf_frames;
+  Camera removed_camera_ref;
+  FrameId removed_fid_ref;
+  const int max_num_kfs = 2;
+  delete_oldframes(fcid, max_num_kfs, cameras_ref, landmarks_ref,
+                   old_landmarks_ref, kf_frames_ref, removed_camera_ref,
+                   removed_fid_ref);
+
+  Landmarks old_landmarks;
+  Camera removed_camera;
+  FrameId removed_fid;
+  delete_oldframes(fcid, max_num_kfs, cameras, landmarks, old_landmarks,
+                   kf_frames, removed_camera, removed_fid, nullptr,
+                   &frame_landmarks);
+
+  EXPECT_EQ(kf_frames_ref, kf_frames);
+  EXPECT_EQ(removed_fid_ref, removed_fid);
+  test_landmarks_equal(landmarks_ref, landmarks);
+  test_landmarks_equal(old_landmarks_ref, old_landmarks);
+
+  // the index covers exactly the remaining observations
+  FrameLandmarkIndex frame_landmarks_ref;
+  frame_landmarks_ref.rebuild(landmarks_ref);
+  ASSERT_EQ(frame_landmarks_ref.size(), frame_landmarks.size());
+  for (const auto& [image, track_ids_ref] : frame_landmarks_ref.images()) {
+    std::vector<TrackId> track_ids = frame_landmarks.landmarks(image);
+    std::vector<TrackId> sorted_ref = track_ids_ref;
+    std::sort(track_ids.begin(), track_ids.end());
+    std::sort(sorted_ref.begin(), sorted_ref.end());
+    EXPECT_EQ(sorted_ref, track_ids) << "image " << image;
+  }
+}
+
+TEST(Ex5TestSuite, LandmarkContainers) {
+  // observations stay sorted by image, also after spilling to the heap
+  LandmarkObservations obs;
+  for (FrameId frame_id = 9; frame_id >= 0; frame_id--) {
+    EXPECT_TRUE(obs.emplace(FrameCamId(frame_id, 1), int(frame_id)).second);
+    EXPECT_TRUE(obs.emplace(FrameCamId(frame_id, 0), int(frame_id)).second);
+  }
+  EXPECT_FALSE(obs.emplace(FrameCamId(3, 0), 100).second);
+  EXPECT_EQ(20u, obs.size());
+  EXPECT_TRUE(std::is_sorted(
+      obs.begin(), obs.end(),
+      [](const auto& a, const auto& b) { return a.first < b.first; }));
+
+  EXPECT_EQ(1u, obs.erase(FrameCamId(3, 0)));
+  EXPECT_EQ(0u, obs.count(FrameCamId(3, 0)));
+  EXPECT_EQ(4, obs.at(FrameCamId(4, 1)));
+
+  LandmarkObservations copy = obs, moved = std::move(copy);
+  EXPECT_EQ(obs, moved);
+
+  // erasing while iterating visits every landmark once
+  Landmarks landmarks;
+  for (TrackId track_id = 0; track_id < 100; track_id++) {
+    landmarks[track_id].p = Eigen::Vector3d::Constant(track_id);
+  }
+
+  std::set<TrackId> visited;
+  for (auto it = landmarks.begin(); it != landmarks.end();) {
+    EXPECT_TRUE(visited.emplace(it->first).second);
+    if (it->first % 3 == 0) {
+      it = landmarks.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  EXPECT_EQ(100u, visited.size());
+  EXPECT_EQ(66u, landmarks.size());
+
+  for (TrackId track_id = 0; track_id < 100; track_id++) {
+    ASSERT_EQ(track_id % 3 != 0, landmarks.count(track_id) > 0);
+    if (track_id % 3 != 0) {
+      EXPECT_EQ(double(track_id), landmarks.at(track_id).p.x());
+    }
+  }
+}
+
+TEST(Ex5TestSuite, FeatureStore) {
+  Corners feature_corners;
+  Matches feature_matches;
+  FeatureTracks feature_tracks;
+  FeatureTracks outlier_tracks;
+  Cameras cameras;
+  Landmarks landmarks;
+
+  load_map_file(map_localize_path, feature_corners, feature_matches,
+                feature_tracks, outlier_tracks, cameras, landmarks);
+  ASSERT_FALSE(feature_corners.empty());
+
+  // images are visited in order and can be looked up
+  std::vector<FrameCamId> fcids;
+  for (const auto& kv : feature_corners) fcids.push_back(kv.first);
+  EXPECT_TRUE(std::is_sorted(fcids.begin(), fcids.end()));
+  EXPECT_EQ(fcids.size(), feature_corners.size());
+  for (const FrameCamId& fcid : fcids) {
+    ASSERT_EQ(1u, feature_corners.count(fcid));
+    EXPECT_EQ(fcid, feature_corners.find(fcid)->first);
+  }
+
+  // compacting keeps the corners but releases the descriptors
+  const FrameCamId first = fcids.front();
+  const size_t num_corners = feature_corners.at(first).corners.size();
+  const size_t bytes = feature_corners.memoryUsage();
+  feature_corners.compact(first);
+  EXPECT_EQ(num_corners, feature_corners.at(first).corners.size());
+  EXPECT_TRUE(feature_corners.at(first).corner_descriptors.empty());
+  EXPECT_LT(feature_corners.memoryUsage(), bytes);
+
+  // erasing all but the last image releases everything else
+  for (size_t i = 0; i + 1 < fcids.size(); i++) {
+    EXPECT_EQ(1u, feature_corners.erase(fcids[i]));
+  }
+  EXPECT_EQ(0u, feature_corners.erase(fcids.front()));
+  EXPECT_EQ(1u, feature_corners.size());
+  EXPECT_EQ(fcids.back(), feature_corners.begin()->first);
+  EXPECT_EQ(0u, feature_corners.count(fcids.front()));
+
+  // images before the stored ones can still be added
+  feature_corners[FrameCamId(0, 1)].corners.emplace_back(1, 2);
+  EXPECT_EQ(FrameCamId(0, 1), feature_corners.begin()->first);
+  EXPECT_EQ(2u, feature_corners.size());
+
+  // moving leaves the source empty
+  Corners moved(std::move(feature_corners));
+  EXPECT_EQ(2u, moved.size());
+  EXPECT_TRUE(feature_corners.empty());
+  EXPECT_TRUE(feature_corners.begin() == feature_corners.end());
+
+  feature_corners = std::move(moved);
+  EXPECT_EQ(2u, feature_corners.size());
+  EXPECT_TRUE(moved.empty());
+  EXPECT_EQ(0u, moved.count(FrameCamId(0, 1)));
+}
+
+TEST(Ex5TestSuite, RetentionManager) {
+  const std::string archive_path =
+      ::testing::TempDir() + "test_state_archive.bin";
+
+  RetentionManager retention;
+  ASSERT_TRUE(retention.archive().open(archive_path));
+
+  // stereo matches of keyframes
+  Matches feature_matches;
+  for (FrameId frame_id = 0; frame_id < 4; frame_id++) {
+    MatchData& md = feature_matches[std::make_pair(FrameCamId(frame_id, 0),
+                                                   FrameCamId(frame_id, 1))];
+    md.inliers.emplace_back(int(frame_id), int(frame_id) + 1);
+  }
+  retention.evictKeyframe(0, feature_matches);
+  retention.evictKeyframe(1, feature_matches);
+  retention.evictKeyframe(7, feature_matches);
+  EXPECT_EQ(2u, feature_matches.size());
+  EXPECT_EQ(2u, retention.stats().evicted_matches);
+
+  // IMU states and measurements before the oldest state in use
+  FrameStates states;
+  ImuMeasurements imu_measurements;
+  for (Timestamp t_ns = 0; t_ns < 10; t_ns++) {
+    states[t_ns].t_ns = t_ns;
+    imu_measurements.emplace(t_ns, IntegratedImuMeasurement<double>(
+                                       t_ns, Eigen::Vector3d::Zero(),
+                                       Eigen::Vector3d::Zero()));
+  }
+  retention.evictStates(6, states, imu_measurements);
+  EXPECT_EQ(6, states.begin()->first);
+  EXPECT_EQ(6, imu_measurements.begin()->first);
+  EXPECT_EQ(6u, retention.stats().evicted_states);
+  EXPECT_EQ(6u, retention.stats().evicted_imu_measurements);
+
+  // old landmarks beyond the memory limit, oldest first
+  Landmarks old_landmarks;
+  for (TrackId track_id = 999; track_id >= 0; track_id--) {
+    old_landmarks[track_id].p = Eigen::Vector3d::Constant(track_id);
+  }
+  retention.update(0, old_landmarks);
+  EXPECT_EQ(1000u, old_landmarks.size());
+
+  old_landmarks.shrink_to_fit();
+  const size_t limit = old_landmarks.memoryUsage() / 2;
+  retention.setMemoryLimit(limit);
+  retention.update(0, old_landmarks);
+
+  const size_t num_evicted = retention.stats().evicted_landmarks;
+  EXPECT_GT(num_evicted, 500u);
+  EXPECT_EQ(1000u, old_landmarks.size() + num_evicted);
+  EXPECT_LE(retention.stats().memory_bytes, limit);
+  for (TrackId track_id = 0; track_id < 1000; track_id++) {
+    EXPECT_EQ(track_id >= TrackId(num_evicted), old_landmarks.count(track_id))
+        << "landmark " << track_id;
+  }
+
+  // everything evicted is in the archive
+  retention.archive().close();
+
+  Landmarks archived_landmarks;
+  FrameStates archived_states;
+  Matches archived_matches;
+  ASSERT_TRUE(read_state_archive(archive_path, archived_landmarks,
+                                 archived_states, archived_matches));
+  EXPECT_EQ(num_evicted, archived_landmarks.size());
+  EXPECT_EQ(6u, archived_states.size());
+  EXPECT_EQ(2u, archived_matches.size());
+  for (const auto& [track_id, lm] : archived_landmarks) {
+    EXPECT_LT(track_id, TrackId(num_evicted));
+    EXPECT_EQ(double(track_id), lm.p.x());
+  }
+  EXPECT_EQ(1, archived_matches.at(std::make_pair(FrameCamId(1, 0),
+                                                  FrameCamId(1, 1)))
+                   .inliers.at(0)
+                   .first);
+
+  std::remove(archive_path.c_str());
+}
+
+TEST(Ex5TestSuite, ProjectionCache) {
+  Calibration calib_cam;
+  Corners feature_corners;
+  Matches feature_matches;
+  FeatureTracks feature_tracks;
+  FeatureTracks outlier_tracks;
+  Cameras cameras;
+  Landmarks landmarks;
+
+  load_calib(calib_path, calib_cam);
+
+  load_map_file(map_localize_path, feature_corners, feature_matches,
+                feature_tracks, outlier_tracks, cameras, landmarks);
+
+  FrameLandmarkIndex frame_landmarks;
+  frame_landmarks.rebuild(landmarks);
+  for (const auto& kv_lm : landmarks) {
+    for (const auto& kv_obs : kv_lm.second.outlier_obs) {
+      frame_landmarks.add(kv_obs.first, kv_lm.first);
+    }
+  }
+
+  ProjectionCache cache;
+  cache.update(landmarks, cameras, calib_cam, feature_corners,
+               frame_landmarks);
+
+  // same projections as compute_image_projections
+  ImageProjections image_projections;
+  compute_image_projections(landmarks, cameras, calib_cam, feature_corners,
+                            image_projections);
+  ASSERT_EQ(image_projections.size(), cache.size());
+  EXPECT_EQ(cache.size(), cache.numUpdated());
+
+  for (const auto& [fcid, ip] : image_projections) {
+    const ProjectionCache::Image* image = cache.find(fcid);
+    ASSERT_TRUE(image != nullptr);
+    ASSERT_EQ(ip.obs.size() + ip.outlier_obs.size(), image->size);
+
+    std::map<TrackId, size_t> rows;
+    for (size_t i = 0; i < image->size; i++) rows[image->track_ids[i]] = i;
+
+    for (const auto& proj_lm : ip.obs) {
+      const size_t i = rows.at(proj_lm->track_id);
+      EXPECT_FALSE(image->outlier[i]);
+      EXPECT_TRUE(proj_lm->point_reprojected.isApprox(
+          image->reprojected.row(i).transpose()));
+      EXPECT_EQ(proj_lm->point_measured, image->measured.row(i).transpose());
+      EXPECT_NEAR(proj_lm->reprojection_error, image->reprojection_errors[i],
+                  1e-9);
+    }
+    for (const auto& proj_lm : ip.outlier_obs) {
+      EXPECT_TRUE(image->outlier[rows.at(proj_lm->track_id)]);
+    }
+  }
+
+  // nothing changed
+  cache.update(landmarks, cameras, calib_cam, feature_corners,
+               frame_landmarks);
+  EXPECT_EQ(0u, cache.numUpdated());
+
+  // only the moved camera is reprojected
+  const FrameCamId moved_fcid = image_projections.begin()->first;
+  const Eigen::Vector2d reprojected_before =
+      cache.find(moved_fcid)->reprojected.row(0).transpose();
+  cameras.at(moved_fcid).T_w_c.translation() += Eigen::Vector3d(0.1, 0, 0);
+  cache.update(landmarks, cameras, calib_cam, feature_corners,
+               frame_landmarks);
+  EXPECT_EQ(1u, cache.numUpdated());
+  EXPECT_FALSE(reprojected_before.isApprox(
+      cache.find(moved_fcid)->reprojected.row(0).transpose()));
+
+  // only the images observing the invalidated landmark are reprojected
+  const TrackId moved_track_id = landmarks.begin()->first;
+  Landmark& lm = landmarks.begin()->second;
+  size_t num_observing = 0;
+  for (const auto& kv_obs : lm.obs) {
+    num_observing += cameras.count(kv_obs.first);
+  }
+  for (const auto& kv_obs : lm.outlier_obs) {
+    num_observing += cameras.count(kv_obs.first);
+  }
+  lm.p.z() += 0.1;
+  cache.invalidateLandmark(moved_track_id);
+  cache.update(landmarks, cameras, calib_cam, feature_corners,
+               frame_landmarks);
+  EXPECT_EQ(num_observing, cache.numUpdated());
+
+  // all images of a camera with new intrinsics are reprojected
+  size_t num_cam0 = 0;
+  for (const auto& kv : image_projections) num_cam0 += kv.first.cam_id == 0;
+  calib_cam.intrinsics[0]->data()[0] += 1;
+  cache.update(landmarks, cameras, calib_cam, feature_corners,
+               frame_landmarks);
+  EXPECT_EQ(num_cam0, cache.numUpdated());
+
+  // images without camera are dropped
+  cameras.erase(moved_fcid);
+  cache.update(landmarks, cameras, calib_cam, feature_corners,
+               frame_landmarks);
+  EXPECT_EQ(0u, cache.numUpdated());
+  EXPECT_TRUE(cache.find(moved_fcid) == nullptr);
+  EXPECT_EQ(image_projections.size() - 1, cache.size());
+}